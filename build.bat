@@ -118,6 +118,28 @@ if errorlevel 1 (
 )
 echo [+] Server build successful.
 
+REM === BUILD CATALOG BENCHMARK ===
+echo.
+echo [*] Building catalog_bench.exe ...
+g++ -std=c++17 -O2 catalog_bench.cpp -o "%BUILD_DIR%\catalog_bench.exe"
+if errorlevel 1 (
+    echo [!] Catalog benchmark build failed.
+    pause
+    exit /b 1
+)
+echo [+] Catalog benchmark build successful.
+
+REM === BUILD LOAD GENERATOR ===
+echo.
+echo [*] Building loadgen.exe ...
+g++ -std=c++17 -O2 loadgen.cpp -o "%BUILD_DIR%\loadgen.exe" -I"%INCLUDE_PATH%" -L"%LIB_PATH%" -lzlib -lws2_32
+if errorlevel 1 (
+    echo [!] Load generator build failed.
+    pause
+    exit /b 1
+)
+echo [+] Load generator build successful.
+
 REM === COPY MENU HEADER ===
 echo.
 echo [*] Copying menu.h to builds directory...
@@ -147,6 +169,8 @@ echo.
 echo Built executables in %BUILD_DIR%\:
 echo   - %CLIENT_NAME%.exe
 echo   - %SERVER_NAME%.exe
+echo   - catalog_bench.exe
+echo   - loadgen.exe
 echo.
 echo New Features:
 echo   - Arrow key navigation
@@ -0,0 +1,973 @@
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <filesystem>
+
+// In-memory catalog of shared files, sized for millions of entries.
+//
+// Files are keyed by their path relative to the shared folder they were found
+// in, always with '/' ("music/live/01.flac"), so same-named files in
+// different subfolders are separate entries. Each file is one fixed-size
+// Entry: the binary SHA-256, size, write time and 32-bit references to its
+// folder, its name and its neighbours in the search chains. Names are
+// interned in an arena and folders in a {parent, name} table, so the files of
+// one folder share its path, and all three lookups go through open-addressing
+// tables of 32-bit numbers rather than tree nodes and per-entry strings. A
+// fourth table finds files by content digest.
+//
+// search() answers prefix, substring and glob queries without visiting every
+// file: the folder table doubles as a path trie, live entries are chained per
+// folder and per name, and a trigram index over the names narrows a
+// substring down to the few names that can contain it.
+//
+// Entries keep their slot until removed. A removed slot stays resolvable by
+// path until it is reused, and free slots are reused oldest first, so a LISTB
+// cursor naming a file that was just removed can still be found.
+//
+// Not thread safe; the server guards it with filesMutex.
+
+struct FileInfo {
+    // Content identity: shared by files with the same digest and new for new
+    // content, so duplicates share cached blocks and readers while a
+    // replaced file never gets the old content's blocks.
+    uint64_t id = 0;
+    std::string filename;  // Catalog key: path relative to the shared folder
+    std::string filepath;
+    size_t filesize;
+    std::filesystem::file_time_type modified;  // When the indexed content was written
+    std::string sha256;
+    // MANIFEST payload: one [u32 length][SHA-256] entry per chunk, in file order.
+    // Shared so copying a FileInfo out of the catalog stays cheap.
+    std::shared_ptr<const std::string> manifest;
+};
+
+// Tables index buckets with the low bits, so every hash ends with a mix
+inline uint64_t catalogMix(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+inline uint64_t catalogHash(const char *data, size_t length) {
+    uint64_t hash = 14695981039346656037ull;  // FNV-1a
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    return catalogMix(hash);
+}
+
+inline uint64_t catalogHash(uint32_t a, uint32_t b) {
+    return catalogMix(((uint64_t)a << 32) | b);
+}
+
+// Append-only array kept in fixed pages, so growing never copies the
+// existing elements or leaves half of a doubled buffer unused.
+template <typename T, size_t PageSize>
+class PagedArray {
+private:
+    std::vector<std::unique_ptr<T[]>> pages;
+    size_t count = 0;
+
+public:
+    T &operator[](size_t i) { return pages[i / PageSize][i % PageSize]; }
+    const T &operator[](size_t i) const { return pages[i / PageSize][i % PageSize]; }
+    size_t size() const { return count; }
+
+    size_t push_back(const T &value) {
+        if (count == pages.size() * PageSize) pages.emplace_back(new T[PageSize]());
+        (*this)[count] = value;
+        return count++;
+    }
+
+    size_t memoryUsage() const {
+        return pages.size() * PageSize * sizeof(T) + pages.capacity() * sizeof(pages[0]);
+    }
+};
+
+// Linear-probing hash set of 32-bit values that live elsewhere. Buckets hold
+// value + 1 so that 0 means empty; callers pass the hash of what they look
+// for, a test for whether a stored value matches it, and a way to rehash a
+// stored value when the table grows or an erase shifts entries back.
+class OpenIndex {
+private:
+    std::vector<uint32_t> buckets;
+    size_t count = 0;
+
+    size_t mask() const { return buckets.size() - 1; }
+
+    template <typename HashOf>
+    void grow(HashOf hashOf) {
+        std::vector<uint32_t> old(buckets.empty() ? 16 : buckets.size() * 2, 0);
+        old.swap(buckets);
+        for (uint32_t stored : old) {
+            if (stored == 0) continue;
+            size_t i = hashOf(stored - 1) & mask();
+            while (buckets[i] != 0) i = (i + 1) & mask();
+            buckets[i] = stored;
+        }
+    }
+
+public:
+    static constexpr uint32_t NONE = UINT32_MAX;
+
+    template <typename Match>
+    uint32_t find(uint64_t hash, Match match) const {
+        if (buckets.empty()) return NONE;
+        for (size_t i = hash & mask(); buckets[i] != 0; i = (i + 1) & mask()) {
+            if (match(buckets[i] - 1)) return buckets[i] - 1;
+        }
+        return NONE;
+    }
+
+    // Resized at 70% load, where probe runs are still a few buckets long
+    template <typename HashOf>
+    void insert(uint64_t hash, uint32_t value, HashOf hashOf) {
+        if ((count + 1) * 10 > buckets.size() * 7) grow(hashOf);
+        size_t i = hash & mask();
+        while (buckets[i] != 0) i = (i + 1) & mask();
+        buckets[i] = value + 1;
+        count++;
+    }
+
+    // Backward-shift deletion: later members of the probe run move up into
+    // the hole, so lookups never need tombstones.
+    template <typename HashOf>
+    bool erase(uint64_t hash, uint32_t value, HashOf hashOf) {
+        if (buckets.empty()) return false;
+        size_t hole = hash & mask();
+        while (buckets[hole] != value + 1) {
+            if (buckets[hole] == 0) return false;
+            hole = (hole + 1) & mask();
+        }
+        for (size_t i = (hole + 1) & mask(); buckets[i] != 0; i = (i + 1) & mask()) {
+            size_t home = hashOf(buckets[i] - 1) & mask();
+            // Move it unless its home lies cyclically in (hole, i]
+            if (((i - home) & mask()) >= ((i - hole) & mask())) {
+                buckets[hole] = buckets[i];
+                hole = i;
+            }
+        }
+        buckets[hole] = 0;
+        count--;
+        return true;
+    }
+
+    size_t memoryUsage() const { return buckets.capacity() * sizeof(uint32_t); }
+};
+
+class Catalog {
+public:
+    static constexpr size_t DIGEST_SIZE = 32;
+
+    // The part of an entry a catalog listing sends, with the raw digest,
+    // cheaper to copy out than a whole FileInfo
+    struct Listing {
+        std::string filename;
+        uint64_t size;
+        unsigned char digest[DIGEST_SIZE];
+    };
+
+private:
+    static constexpr size_t NAME_PAGE = 1 << 20;
+    static constexpr uint32_t ROOT_DIR = 0;
+
+    enum : uint8_t {
+        HAS_MANIFEST = 1,
+        SINGLE_CHUNK = 2  // Manifest is [size][digest], rebuilt on demand
+    };
+
+    struct Entry {
+        unsigned char digest[DIGEST_SIZE];
+        uint64_t size;
+        int64_t modified;  // file_time_type ticks
+        uint64_t id;       // 0 while the slot is free
+        uint32_t dir;
+        uint32_t name;
+        // Live entries are on two doubly linked lists: the files in their
+        // folder and the files with their name
+        uint32_t nextInDir, prevInDir;
+        uint32_t nextByName, prevByName;
+        uint32_t nextTwin, prevTwin;  // Other live files with the same digest
+        uint16_t root;
+        uint8_t flags;
+    };
+
+    // Folders form a tree through their first child and next sibling.
+    // Folders are never removed, so these links never change.
+    struct Dir {
+        uint32_t parent;
+        uint32_t name;
+        uint32_t firstChild;
+        uint32_t nextSibling;
+    };
+
+    // Names are stored once each as [u16 length][bytes] in an arena that no
+    // name straddles two pages of, and numbered in order of first use.
+    PagedArray<char, NAME_PAGE> nameArena;
+    PagedArray<uint32_t, 16384> nameOffsets;  // By name number
+    PagedArray<uint32_t, 16384> nameFiles;    // First live entry with the name
+    OpenIndex nameIndex;
+    PagedArray<Dir, 4096> dirs;
+    PagedArray<uint32_t, 4096> dirFiles;      // First live entry in the folder
+    OpenIndex dirIndex;
+    PagedArray<Entry, 8192> entries;
+    OpenIndex entryIndex;
+    // One live entry per digest. Its twins hang off it, so a thousand empty
+    // files do not share one probe run.
+    OpenIndex digestIndex;
+    // Substring index: for each trigram of a lowercased name, the numbers of
+    // the names containing it as ascending varint deltas. Names are never
+    // removed, so the lists only ever grow at the end.
+    struct Postings {
+        uint32_t last = 0;
+        uint32_t count = 0;
+        std::string deltas;
+    };
+    std::unordered_map<uint32_t, Postings> trigrams;
+    bool trigramsEnabled = true;
+    std::deque<uint32_t> freeSlots;  // Oldest first
+    std::unordered_map<uint32_t, std::shared_ptr<const std::string>> manifests;  // Multi-chunk, by slot
+    std::vector<std::string> roots;
+    size_t liveCount = 0;
+
+    const char *nameData(uint32_t name, uint16_t &length) const {
+        uint32_t offset = nameOffsets[name];
+        std::memcpy(&length, &nameArena[offset], sizeof(length));
+        return &nameArena[offset + sizeof(length)];
+    }
+
+    uint64_t nameHash(uint32_t name) const {
+        uint16_t length;
+        const char *data = nameData(name, length);
+        return catalogHash(data, length);
+    }
+
+    uint32_t findName(const char *data, size_t length) const {
+        return nameIndex.find(catalogHash(data, length), [&](uint32_t name) {
+            uint16_t storedLength;
+            const char *stored = nameData(name, storedLength);
+            return storedLength == length && std::memcmp(stored, data, length) == 0;
+        });
+    }
+
+    uint32_t internName(const char *data, size_t length) {
+        uint32_t name = findName(data, length);
+        if (name != OpenIndex::NONE) return name;
+
+        uint16_t stored = (uint16_t)length;
+        size_t needed = sizeof(stored) + length;
+        size_t used = nameArena.size() % NAME_PAGE;
+        if (used != 0 && used + needed > NAME_PAGE) {
+            while (nameArena.size() % NAME_PAGE != 0) nameArena.push_back(0);
+        }
+        name = (uint32_t)nameOffsets.push_back((uint32_t)nameArena.size());
+        nameFiles.push_back(OpenIndex::NONE);
+        for (size_t i = 0; i < sizeof(stored); i++) nameArena.push_back(((const char *)&stored)[i]);
+        for (size_t i = 0; i < length; i++) nameArena.push_back(data[i]);
+        nameIndex.insert(catalogHash(data, length), name, [&](uint32_t other) { return nameHash(other); });
+        if (trigramsEnabled) indexTrigrams(name, lowered(data, length));
+        return name;
+    }
+
+    uint32_t findDir(uint32_t parent, uint32_t name) const {
+        return dirIndex.find(catalogHash(parent, name), [&](uint32_t dir) {
+            return dirs[dir].parent == parent && dirs[dir].name == name;
+        });
+    }
+
+    uint32_t internDir(uint32_t parent, uint32_t name) {
+        uint32_t dir = findDir(parent, name);
+        if (dir != OpenIndex::NONE) return dir;
+        dir = (uint32_t)dirs.push_back({parent, name, OpenIndex::NONE, dirs[parent].firstChild});
+        dirs[parent].firstChild = dir;
+        dirFiles.push_back(OpenIndex::NONE);
+        dirIndex.insert(catalogHash(parent, name), dir, [&](uint32_t other) {
+            return catalogHash(dirs[other].parent, dirs[other].name);
+        });
+        return dir;
+    }
+
+    static char lowerChar(char c) { return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c; }
+
+    static std::string lowered(const char *data, size_t length) {
+        std::string out(data, length);
+        for (char &c : out) c = lowerChar(c);
+        return out;
+    }
+
+    static uint32_t trigramOf(const char *data) {
+        return ((uint32_t)(unsigned char)data[0] << 16) | ((uint32_t)(unsigned char)data[1] << 8) |
+               (unsigned char)data[2];
+    }
+
+    static std::vector<uint32_t> trigramsOf(const std::string &text) {
+        std::vector<uint32_t> grams;
+        for (size_t i = 0; i + 3 <= text.size(); i++) grams.push_back(trigramOf(text.data() + i));
+        std::sort(grams.begin(), grams.end());
+        grams.erase(std::unique(grams.begin(), grams.end()), grams.end());
+        return grams;
+    }
+
+    void indexTrigrams(uint32_t name, const std::string &lower) {
+        for (uint32_t gram : trigramsOf(lower)) {
+            Postings &postings = trigrams[gram];
+            uint32_t delta = name - postings.last;
+            while (delta >= 0x80) {
+                postings.deltas += (char)(delta | 0x80);
+                delta >>= 7;
+            }
+            postings.deltas += (char)delta;
+            postings.last = name;
+            postings.count++;
+        }
+    }
+
+    static std::vector<uint32_t> decode(const Postings &postings) {
+        std::vector<uint32_t> names;
+        names.reserve(postings.count);
+        uint32_t name = 0;
+        for (size_t i = 0; i < postings.deltas.size();) {
+            uint32_t delta = 0;
+            for (int shift = 0;; shift += 7) {
+                unsigned char byte = (unsigned char)postings.deltas[i++];
+                delta |= (uint32_t)(byte & 0x7f) << shift;
+                if (!(byte & 0x80)) break;
+            }
+            name += delta;
+            names.push_back(name);
+        }
+        return names;
+    }
+
+    // Unlinked while the slot is free, so the chains only hold live files
+    void link(uint32_t slot) {
+        Entry &entry = entries[slot];
+        entry.prevInDir = OpenIndex::NONE;
+        entry.nextInDir = dirFiles[entry.dir];
+        if (entry.nextInDir != OpenIndex::NONE) entries[entry.nextInDir].prevInDir = slot;
+        dirFiles[entry.dir] = slot;
+        entry.prevByName = OpenIndex::NONE;
+        entry.nextByName = nameFiles[entry.name];
+        if (entry.nextByName != OpenIndex::NONE) entries[entry.nextByName].prevByName = slot;
+        nameFiles[entry.name] = slot;
+    }
+
+    void unlink(uint32_t slot) {
+        Entry &entry = entries[slot];
+        if (entry.prevInDir != OpenIndex::NONE) {
+            entries[entry.prevInDir].nextInDir = entry.nextInDir;
+        } else {
+            dirFiles[entry.dir] = entry.nextInDir;
+        }
+        if (entry.nextInDir != OpenIndex::NONE) entries[entry.nextInDir].prevInDir = entry.prevInDir;
+        if (entry.prevByName != OpenIndex::NONE) {
+            entries[entry.prevByName].nextByName = entry.nextByName;
+        } else {
+            nameFiles[entry.name] = entry.nextByName;
+        }
+        if (entry.nextByName != OpenIndex::NONE) entries[entry.nextByName].prevByName = entry.prevByName;
+    }
+
+    uint64_t entryHash(uint32_t slot) const { return catalogHash(entries[slot].dir, entries[slot].name); }
+
+    static uint64_t digestHash(const unsigned char *digest) {
+        uint64_t hash;
+        std::memcpy(&hash, digest, sizeof(hash));  // Already uniform
+        return hash;
+    }
+
+    uint32_t findDigest(const unsigned char *digest) const {
+        return digestIndex.find(digestHash(digest), [&](uint32_t slot) {
+            return std::memcmp(entries[slot].digest, digest, DIGEST_SIZE) == 0;
+        });
+    }
+
+    void indexDigest(uint32_t slot) {
+        Entry &entry = entries[slot];
+        entry.prevTwin = findDigest(entry.digest);
+        entry.nextTwin = OpenIndex::NONE;
+        if (entry.prevTwin == OpenIndex::NONE) {
+            digestIndex.insert(digestHash(entry.digest), slot,
+                               [&](uint32_t other) { return digestHash(entries[other].digest); });
+            return;
+        }
+        entry.nextTwin = entries[entry.prevTwin].nextTwin;
+        if (entry.nextTwin != OpenIndex::NONE) entries[entry.nextTwin].prevTwin = slot;
+        entries[entry.prevTwin].nextTwin = slot;
+    }
+
+    void unindexDigest(uint32_t slot) {
+        Entry &entry = entries[slot];
+        auto hashOf = [&](uint32_t other) { return digestHash(entries[other].digest); };
+        if (entry.prevTwin != OpenIndex::NONE) {
+            entries[entry.prevTwin].nextTwin = entry.nextTwin;
+            if (entry.nextTwin != OpenIndex::NONE) entries[entry.nextTwin].prevTwin = entry.prevTwin;
+            return;
+        }
+        digestIndex.erase(digestHash(entry.digest), slot, hashOf);
+        if (entry.nextTwin != OpenIndex::NONE) {
+            entries[entry.nextTwin].prevTwin = OpenIndex::NONE;
+            digestIndex.insert(digestHash(entry.digest), entry.nextTwin, hashOf);
+        }
+    }
+
+    static int hexValue(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    static bool parseDigest(const std::string &hex, unsigned char *digest) {
+        if (hex.size() != DIGEST_SIZE * 2) return false;
+        for (size_t i = 0; i < DIGEST_SIZE; i++) {
+            int high = hexValue(hex[2 * i]);
+            int low = hexValue(hex[2 * i + 1]);
+            if (high < 0 || low < 0) return false;
+            digest[i] = (unsigned char)(high * 16 + low);
+        }
+        return true;
+    }
+
+    uint32_t findEntry(uint32_t dir, uint32_t name) const {
+        return entryIndex.find(catalogHash(dir, name), [&](uint32_t slot) {
+            return entries[slot].dir == dir && entries[slot].name == name;
+        });
+    }
+
+    // Splits path at '/' into its folder and name. With create, missing
+    // names and folders are added; without it, NONE means not cataloged.
+    bool resolve(const std::string &path, bool create, uint32_t &dir, uint32_t &name) {
+        dir = ROOT_DIR;
+        size_t start = 0;
+        while (true) {
+            size_t end = path.find('/', start);
+            if (end == std::string::npos) end = path.size();
+            if (end - start > UINT16_MAX) return false;
+            name = create ? internName(path.data() + start, end - start) : findName(path.data() + start, end - start);
+            if (name == OpenIndex::NONE) return false;
+            if (end == path.size()) return true;
+            dir = create ? internDir(dir, name) : findDir(dir, name);
+            if (dir == OpenIndex::NONE) return false;
+            start = end + 1;
+        }
+    }
+
+    bool resolve(const std::string &path, uint32_t &dir, uint32_t &name) const {
+        return const_cast<Catalog *>(this)->resolve(path, false, dir, name);
+    }
+
+    void appendPath(std::string &out, uint32_t dir) const {
+        if (dir == ROOT_DIR) return;
+        appendPath(out, dirs[dir].parent);
+        uint16_t length;
+        const char *data = nameData(dirs[dir].name, length);
+        out.append(data, length);
+        out += '/';
+    }
+
+    std::string pathOf(uint32_t slot) const {
+        std::string path;
+        appendPath(path, entries[slot].dir);
+        uint16_t length;
+        const char *data = nameData(entries[slot].name, length);
+        path.append(data, length);
+        return path;
+    }
+
+    static std::string singleChunkManifest(const Entry &entry) {
+        uint32_t size = (uint32_t)entry.size;
+        std::string manifest((const char *)&size, sizeof(size));
+        manifest.append((const char *)entry.digest, DIGEST_SIZE);
+        return manifest;
+    }
+
+    void materialize(uint32_t slot, const std::string &path, Listing &listing) const {
+        const Entry &entry = entries[slot];
+        listing.filename = path;
+        listing.size = entry.size;
+        std::memcpy(listing.digest, entry.digest, DIGEST_SIZE);
+    }
+
+    void materialize(uint32_t slot, const std::string &path, FileInfo &info) const {
+        static const char hex[] = "0123456789abcdef";
+        const Entry &entry = entries[slot];
+        info.id = entry.id;
+        info.filename = path;
+        const char separator = (char)std::filesystem::path::preferred_separator;
+        info.filepath = roots[entry.root];
+        if (!info.filepath.empty() && info.filepath.back() != '/' && info.filepath.back() != separator) {
+            info.filepath += separator;
+        }
+        size_t start = info.filepath.size();
+        info.filepath += path;
+        std::replace(info.filepath.begin() + start, info.filepath.end(), '/', separator);
+        info.filesize = (size_t)entry.size;
+        info.modified = std::filesystem::file_time_type(std::filesystem::file_time_type::duration(entry.modified));
+        info.sha256.resize(DIGEST_SIZE * 2);
+        for (size_t i = 0; i < DIGEST_SIZE; i++) {
+            info.sha256[2 * i] = hex[entry.digest[i] >> 4];
+            info.sha256[2 * i + 1] = hex[entry.digest[i] & 15];
+        }
+        info.manifest.reset();
+        if (entry.flags & SINGLE_CHUNK) {
+            info.manifest = std::make_shared<const std::string>(singleChunkManifest(entry));
+        } else if (entry.flags & HAS_MANIFEST) {
+            auto it = manifests.find(slot);
+            info.manifest = (it != manifests.end()) ? it->second : std::make_shared<const std::string>();
+        }
+    }
+
+    bool nameMatches(uint32_t name, const std::string &lower, bool wholeName) const {
+        uint16_t length;
+        const char *data = nameData(name, length);
+        if (length < lower.size() || (wholeName && length != lower.size())) return false;
+        for (size_t i = 0; i < lower.size(); i++) {
+            if (lowerChar(data[i]) != lower[i]) return false;
+        }
+        return true;
+    }
+
+    bool nameContains(uint32_t name, const std::string &lower) const {
+        uint16_t length;
+        const char *data = nameData(name, length);
+        return lowered(data, length).find(lower) != std::string::npos;
+    }
+
+    // Longest stretch of text without any of the separators
+    static std::string longestRun(const std::string &text, const char *separators) {
+        std::string best;
+        size_t start = 0;
+        while (start <= text.size()) {
+            size_t end = text.find_first_of(separators, start);
+            if (end == std::string::npos) end = text.size();
+            if (end - start > best.size()) best = text.substr(start, end - start);
+            start = end + 1;
+        }
+        return best;
+    }
+
+    // Same rules as the client's globMatch: '?' is any one character and
+    // '*' any run, '/' included; pattern is already lowercase
+    static bool globMatch(const std::string &pattern, const std::string &path) {
+        size_t p = 0, n = 0, starP = std::string::npos, starN = 0;
+        while (n < path.size()) {
+            if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == lowerChar(path[n]))) {
+                p++;
+                n++;
+            } else if (p < pattern.size() && pattern[p] == '*') {
+                starP = p++;
+                starN = n;
+            } else if (starP != std::string::npos) {
+                p = starP + 1;
+                n = ++starN;
+            } else {
+                return false;
+            }
+        }
+        while (p < pattern.size() && pattern[p] == '*') p++;
+        return p == pattern.size();
+    }
+
+    void collectFolder(uint32_t dir, std::vector<uint32_t> &out) const {
+        for (uint32_t slot = dirFiles[dir]; slot != OpenIndex::NONE; slot = entries[slot].nextInDir) {
+            out.push_back(slot);
+        }
+    }
+
+    void collectSubtree(uint32_t dir, std::vector<uint32_t> &out) const {
+        std::vector<uint32_t> pending{dir};
+        while (!pending.empty()) {
+            uint32_t next = pending.back();
+            pending.pop_back();
+            collectFolder(next, out);
+            for (uint32_t child = dirs[next].firstChild; child != OpenIndex::NONE; child = dirs[child].nextSibling) {
+                pending.push_back(child);
+            }
+        }
+    }
+
+    void collectLive(std::vector<uint32_t> &out) const {
+        for (uint32_t slot = 0; slot < entries.size(); slot++) {
+            if (entries[slot].id != 0) out.push_back(slot);
+        }
+    }
+
+    // Walks the folder trie along the whole components of lower, then takes
+    // every child folder and file whose name starts with the last, partial one
+    std::vector<uint32_t> prefixMatches(const std::string &lower) const {
+        std::vector<uint32_t> found;
+        std::vector<uint32_t> level{ROOT_DIR};
+        size_t start = 0;
+        for (size_t end; (end = lower.find('/', start)) != std::string::npos; start = end + 1) {
+            std::string part = lower.substr(start, end - start);
+            std::vector<uint32_t> next;
+            for (uint32_t dir : level) {
+                for (uint32_t child = dirs[dir].firstChild; child != OpenIndex::NONE; child = dirs[child].nextSibling) {
+                    if (nameMatches(dirs[child].name, part, true)) next.push_back(child);
+                }
+            }
+            level.swap(next);
+        }
+        std::string partial = lower.substr(start);
+        for (uint32_t dir : level) {
+            for (uint32_t child = dirs[dir].firstChild; child != OpenIndex::NONE; child = dirs[child].nextSibling) {
+                if (nameMatches(dirs[child].name, partial, false)) collectSubtree(child, found);
+            }
+            for (uint32_t slot = dirFiles[dir]; slot != OpenIndex::NONE; slot = entries[slot].nextInDir) {
+                if (nameMatches(entries[slot].name, partial, false)) found.push_back(slot);
+            }
+        }
+        return found;
+    }
+
+    // Names containing key, through the rarest few of its trigrams when it
+    // has any and the index is kept, by checking every name otherwise
+    std::vector<uint32_t> namesContaining(const std::string &key) const {
+        std::vector<uint32_t> names;
+        if (!trigramsEnabled || key.size() < 3) {
+            for (uint32_t name = 0; name < nameOffsets.size(); name++) {
+                if (nameContains(name, key)) names.push_back(name);
+            }
+            return names;
+        }
+
+        std::vector<const Postings *> lists;
+        for (uint32_t gram : trigramsOf(key)) {
+            auto it = trigrams.find(gram);
+            if (it == trigrams.end()) return names;
+            lists.push_back(&it->second);
+        }
+        std::sort(lists.begin(), lists.end(), [](const Postings *a, const Postings *b) { return a->count < b->count; });
+        if (lists.size() > 4) lists.resize(4);
+
+        std::vector<uint32_t> candidates = decode(*lists[0]);
+        for (size_t i = 1; i < lists.size() && !candidates.empty(); i++) {
+            std::vector<uint32_t> other = decode(*lists[i]);
+            auto end = std::set_intersection(candidates.begin(), candidates.end(), other.begin(), other.end(),
+                                             candidates.begin());
+            candidates.erase(end, candidates.end());
+        }
+        for (uint32_t name : candidates) {
+            if (nameContains(name, key)) names.push_back(name);
+        }
+        return names;
+    }
+
+    // Files with some folder or file name containing key (no '/' in it):
+    // the whole subtree of every matching folder plus the files whose own
+    // name matches
+    std::vector<uint32_t> substringMatches(const std::string &key) const {
+        std::vector<uint32_t> found;
+        if (key.empty()) {
+            collectLive(found);
+            return found;
+        }
+        std::vector<uint32_t> names = namesContaining(key);
+        std::vector<bool> matched(nameOffsets.size(), false);
+        for (uint32_t name : names) matched[name] = true;
+
+        // Folders are numbered after their parents, so one pass marks them all
+        std::vector<bool> covered(dirs.size(), false);
+        for (size_t i = 1; i < dirs.size(); i++) {
+            covered[i] = covered[dirs[i].parent] || matched[dirs[i].name];
+            if (covered[i]) collectFolder((uint32_t)i, found);
+        }
+        for (uint32_t name : names) {
+            for (uint32_t slot = nameFiles[name]; slot != OpenIndex::NONE; slot = entries[slot].nextByName) {
+                if (!covered[entries[slot].dir]) found.push_back(slot);
+            }
+        }
+        return found;
+    }
+
+    // Takes the oldest free slot that was not revived meanwhile, dropping
+    // the removed path it still answered for
+    uint32_t takeSlot() {
+        while (!freeSlots.empty()) {
+            uint32_t slot = freeSlots.front();
+            freeSlots.pop_front();
+            if (entries[slot].id != 0) continue;
+            entryIndex.erase(entryHash(slot), slot, [&](uint32_t other) { return entryHash(other); });
+            return slot;
+        }
+        return (uint32_t)entries.push_back(Entry());
+    }
+
+public:
+    Catalog() {
+        dirs.push_back({ROOT_DIR, 0, OpenIndex::NONE, OpenIndex::NONE});  // Never indexed, so it cannot be found as a child
+        dirFiles.push_back(OpenIndex::NONE);
+    }
+
+    // Without the trigram index substring queries check every name instead,
+    // saving about 25 bytes per distinct name
+    void setSubstringIndex(bool enabled) {
+        if (enabled == trigramsEnabled) return;
+        trigramsEnabled = enabled;
+        trigrams.clear();
+        if (!enabled) return;
+        for (uint32_t name = 0; name < nameOffsets.size(); name++) {
+            uint16_t length;
+            const char *data = nameData(name, length);
+            indexTrigrams(name, lowered(data, length));
+        }
+    }
+
+    // Shared folders are stored once; entries refer to theirs by number
+    uint16_t addRoot(const std::string &folder) {
+        for (size_t i = 0; i < roots.size(); i++) {
+            if (roots[i] == folder) return (uint16_t)i;
+        }
+        if (roots.size() >= UINT16_MAX) return UINT16_MAX;  // put() refuses it
+        roots.push_back(folder);
+        return (uint16_t)(roots.size() - 1);
+    }
+
+    // Adds info under info.filename, replacing any entry already there. If
+    // another file has the same content, the entry takes over its id (see
+    // FileInfo::id) and its manifest; otherwise info.id is used.
+    bool put(const FileInfo &info, uint16_t root) {
+        unsigned char digest[DIGEST_SIZE];
+        if (info.filename.empty() || !parseDigest(info.sha256, digest) || root >= roots.size()) return false;
+        uint32_t dir, name;
+        if (!resolve(info.filename, true, dir, name)) return false;
+
+        uint32_t slot = findEntry(dir, name);
+        if (slot == OpenIndex::NONE) {
+            slot = takeSlot();
+            entryIndex.insert(catalogHash(dir, name), slot, [&](uint32_t other) { return entryHash(other); });
+        }
+        bool revived = (entries[slot].id == 0);
+        if (revived) {
+            liveCount++;
+        } else {
+            unindexDigest(slot);
+        }
+        manifests.erase(slot);
+
+        uint32_t twin = findDigest(digest);
+        if (twin != OpenIndex::NONE && entries[twin].size != info.filesize) twin = OpenIndex::NONE;
+
+        Entry &entry = entries[slot];
+        std::memcpy(entry.digest, digest, DIGEST_SIZE);
+        entry.size = info.filesize;
+        entry.modified = info.modified.time_since_epoch().count();
+        entry.id = (twin != OpenIndex::NONE) ? entries[twin].id : (info.id ? info.id : 1);
+        entry.dir = dir;
+        entry.name = name;
+        entry.root = root;
+        entry.flags = 0;
+        if (revived) link(slot);
+        indexDigest(slot);
+
+        if (info.manifest) {
+            entry.flags |= HAS_MANIFEST;
+            if (*info.manifest == singleChunkManifest(entry)) {
+                entry.flags |= SINGLE_CHUNK;
+            } else if (!info.manifest->empty()) {
+                auto shared = (twin != OpenIndex::NONE) ? manifests.find(twin) : manifests.end();
+                manifests[slot] = (shared != manifests.end() && *shared->second == *info.manifest) ? shared->second
+                                                                                                  : info.manifest;
+            }
+        }
+        return true;
+    }
+
+    bool find(const std::string &path, FileInfo &info) const {
+        uint32_t slot = slotOf(path);
+        if (slot == OpenIndex::NONE || entries[slot].id == 0) return false;
+        materialize(slot, path, info);
+        return true;
+    }
+
+    bool findListing(const std::string &path, Listing &listing) const {
+        uint32_t slot = slotOf(path);
+        if (slot == OpenIndex::NONE || entries[slot].id == 0) return false;
+        materialize(slot, path, listing);
+        return true;
+    }
+
+    // Any file whose SHA-256 is sha256 (hex)
+    bool findByDigest(const std::string &sha256, FileInfo &info) const {
+        unsigned char digest[DIGEST_SIZE];
+        if (!parseDigest(sha256, digest)) return false;
+        uint32_t slot = findDigest(digest);
+        if (slot == OpenIndex::NONE) return false;
+        materialize(slot, pathOf(slot), info);
+        return true;
+    }
+
+    bool contains(const std::string &path) const {
+        uint32_t slot = slotOf(path);
+        return slot != OpenIndex::NONE && entries[slot].id != 0;
+    }
+
+    bool erase(const std::string &path) {
+        uint32_t slot = slotOf(path);
+        if (slot == OpenIndex::NONE || entries[slot].id == 0) return false;
+        unindexDigest(slot);
+        unlink(slot);
+        entries[slot].id = 0;
+        manifests.erase(slot);
+        freeSlots.push_back(slot);
+        liveCount--;
+        return true;
+    }
+
+    // Slot of path, live or removed but not yet reused; OpenIndex::NONE otherwise
+    uint32_t slotOf(const std::string &path) const {
+        uint32_t dir, name;
+        if (!resolve(path, dir, name)) return OpenIndex::NONE;
+        return findEntry(dir, name);
+    }
+
+    size_t slotCount() const { return entries.size(); }
+    size_t size() const { return liveCount; }
+    bool empty() const { return liveCount == 0; }
+
+    bool isLive(size_t slot) const { return slot < entries.size() && entries[slot].id != 0; }
+
+    // False for a free slot
+    bool entryAt(size_t slot, FileInfo &info) const {
+        if (slot >= entries.size() || entries[slot].id == 0) return false;
+        materialize((uint32_t)slot, pathOf((uint32_t)slot), info);
+        return true;
+    }
+
+    bool listingAt(size_t slot, Listing &listing) const {
+        if (slot >= entries.size() || entries[slot].id == 0) return false;
+        materialize((uint32_t)slot, pathOf((uint32_t)slot), listing);
+        return true;
+    }
+
+    // Every file in slot order
+    template <typename Fn>
+    void forEach(Fn fn) const {
+        FileInfo info;
+        for (size_t slot = 0; slot < entries.size(); slot++) {
+            if (entryAt(slot, info)) fn(info);
+        }
+    }
+
+    // Paths of the files from root that are path itself or lie under it;
+    // an empty path means all of them
+    std::vector<std::string> pathsUnder(const std::string &path, uint16_t root) const {
+        std::vector<std::string> found;
+        uint32_t folder = ROOT_DIR;
+        if (!path.empty()) {
+            uint32_t dir, name;
+            if (!resolve(path, dir, name)) return found;
+            uint32_t slot = findEntry(dir, name);
+            if (slot != OpenIndex::NONE && entries[slot].id != 0 && entries[slot].root == root) {
+                found.push_back(path);
+            }
+            folder = findDir(dir, name);
+            if (folder == OpenIndex::NONE) return found;
+        }
+
+        // Folders are numbered after their parents, so one pass marks them all
+        std::vector<bool> inside(dirs.size(), false);
+        inside[folder] = true;
+        for (size_t i = folder + 1; i < dirs.size(); i++) inside[i] = inside[dirs[i].parent];
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (entries[i].id != 0 && entries[i].root == root && inside[entries[i].dir]) {
+                found.push_back(pathOf((uint32_t)i));
+            }
+        }
+        return found;
+    }
+
+    enum MatchKind { MATCH_PREFIX, MATCH_SUBSTRING, MATCH_GLOB };
+    enum SortOrder { SORT_NAME, SORT_SIZE, SORT_NEWEST };
+
+    // Live files whose path starts with query (MATCH_PREFIX), contains it
+    // (MATCH_SUBSTRING) or matches it as a glob (MATCH_GLOB), ignoring ASCII
+    // case. Fills results with the first limit matches in order (by path,
+    // largest first or newest first) and returns how many matched in all.
+    // Results are FileInfo or Listing.
+    template <typename Result>
+    size_t search(MatchKind kind, const std::string &query, SortOrder order, size_t limit,
+                  std::vector<Result> &results) const {
+        std::string lower = lowered(query.data(), query.size());
+        std::vector<uint32_t> candidates;
+        bool verify = true;  // Candidates are a superset; check each full path
+        if (kind == MATCH_PREFIX) {
+            candidates = prefixMatches(lower);
+            verify = false;
+        } else if (kind == MATCH_SUBSTRING) {
+            // Some single name holds the longest '/'-free stretch of the query
+            candidates = substringMatches(longestRun(lower, "/"));
+            verify = (lower.find('/') != std::string::npos);
+        } else {
+            size_t wildcard = lower.find_first_of("*?");
+            if (wildcard != 0) {
+                candidates = prefixMatches(lower.substr(0, wildcard));
+            } else {
+                candidates = substringMatches(longestRun(lower, "*?/"));
+            }
+        }
+
+        std::vector<uint32_t> matches;
+        std::vector<std::string> paths;
+        bool needPaths = verify || order == SORT_NAME;
+        for (uint32_t slot : candidates) {
+            if (!needPaths) {
+                matches.push_back(slot);
+                continue;
+            }
+            std::string path = pathOf(slot);
+            if (verify) {
+                bool ok = (kind == MATCH_GLOB) ? globMatch(lower, path)
+                                               : lowered(path.data(), path.size()).find(lower) != std::string::npos;
+                if (!ok) continue;
+            }
+            matches.push_back(slot);
+            paths.push_back(std::move(path));
+        }
+
+        std::vector<size_t> ranked(matches.size());
+        for (size_t i = 0; i < ranked.size(); i++) ranked[i] = i;
+        auto before = [&](size_t a, size_t b) {
+            const Entry &x = entries[matches[a]];
+            const Entry &y = entries[matches[b]];
+            if (order == SORT_SIZE && x.size != y.size) return x.size > y.size;
+            if (order == SORT_NEWEST && x.modified != y.modified) return x.modified > y.modified;
+            if (!paths.empty()) return paths[a] < paths[b];
+            return matches[a] < matches[b];
+        };
+        size_t count = std::min(limit, ranked.size());
+        std::partial_sort(ranked.begin(), ranked.begin() + count, ranked.end(), before);
+
+        results.resize(count);
+        for (size_t i = 0; i < count; i++) {
+            uint32_t slot = matches[ranked[i]];
+            materialize(slot, paths.empty() ? pathOf(slot) : paths[ranked[i]], results[i]);
+        }
+        return matches.size();
+    }
+
+    size_t memoryUsage() const {
+        size_t manifestBytes = 0;
+        for (const auto &pair : manifests) manifestBytes += pair.second->capacity() + 64;
+        size_t rootBytes = 0;
+        for (const auto &root : roots) rootBytes += sizeof(root) + root.capacity();
+        size_t trigramBytes = trigrams.bucket_count() * sizeof(void *);
+        for (const auto &pair : trigrams) trigramBytes += sizeof(pair) + 16 + pair.second.deltas.capacity();
+        return nameArena.memoryUsage() + nameOffsets.memoryUsage() + nameFiles.memoryUsage() +
+               nameIndex.memoryUsage() + dirs.memoryUsage() + dirFiles.memoryUsage() + dirIndex.memoryUsage() +
+               entries.memoryUsage() + entryIndex.memoryUsage() + digestIndex.memoryUsage() + freeSlots.size() * sizeof(uint32_t) +
+               manifestBytes + rootBytes + trigramBytes;
+    }
+};
+
+#endif // CATALOG_H
@@ -0,0 +1,160 @@
+// Compares the server's Catalog with the std::map<std::string, FileInfo> it
+// replaced: heap bytes per entry and lookup latency for N synthetic files
+// spread over nested folders, 200 to a folder. Then times a few LISTB MATCH
+// searches against the catalog.
+//
+//   catalog_bench [files]       (default 1000000)
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <random>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "catalog.h"
+
+// Every allocation carries its size in front so live heap bytes can be
+// counted. Kept out of line so g++ does not pair the inlined free() with new.
+static std::atomic<size_t> heapBytes{0};
+static const size_t HEADER_SIZE = 16;
+
+__attribute__((noinline)) void *operator new(size_t size) {
+    char *block = (char *)std::malloc(size + HEADER_SIZE);
+    if (!block) throw std::bad_alloc();
+    *(size_t *)block = size;
+    heapBytes += size;
+    return block + HEADER_SIZE;
+}
+
+__attribute__((noinline)) void operator delete(void *pointer) noexcept {
+    if (!pointer) return;
+    char *block = (char *)pointer - HEADER_SIZE;
+    heapBytes -= *(size_t *)block;
+    std::free(block);
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete[](void *pointer) noexcept { operator delete(pointer); }
+void operator delete(void *pointer, size_t) noexcept { operator delete(pointer); }
+void operator delete[](void *pointer, size_t) noexcept { operator delete(pointer); }
+
+static const char *ROOT = "D:\\Shared\\Library";
+
+static std::string pathFor(size_t i) {
+    return "collection" + std::to_string(i / 200000) + "/album" + std::to_string(i / 200 % 1000) +
+           "/track-" + std::to_string(i) + ".flac";
+}
+
+static FileInfo makeInfo(size_t i) {
+    static const char hex[] = "0123456789abcdef";
+    FileInfo info;
+    info.id = i + 1;
+    info.filename = pathFor(i);
+    info.filepath = std::string(ROOT) + "\\" + info.filename;
+    info.filesize = 1000000 + i * 7919 % 50000000;
+    info.modified = std::filesystem::file_time_type(std::filesystem::file_time_type::duration(i * 10000000LL));
+    uint64_t state = i * 0x9E3779B97F4A7C15ull + 1;
+    for (int c = 0; c < 64; c++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        info.sha256 += hex[state & 15];
+    }
+    return info;
+}
+
+template <typename Lookup>
+static double nanosPerLookup(const std::vector<std::string> &keys, Lookup lookup) {
+    size_t found = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const auto &key : keys) found += lookup(key);
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (found != keys.size()) std::cout << "  (only " << found << " of " << keys.size() << " found)\n";
+    return seconds * 1e9 / keys.size();
+}
+
+int main(int argc, char *argv[]) {
+    size_t count = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 1000000;
+    if (count == 0) return 1;
+
+    std::vector<std::string> keys;
+    std::mt19937_64 random(42);
+    for (size_t i = 0; i < 1000000; i++) keys.push_back(pathFor(random() % count));
+    size_t baseline = heapBytes;
+
+    std::cout << "Files: " << count << "\n\n";
+    std::cout << std::left << std::setw(10) << "" << std::right << std::setw(14) << "heap MB"
+              << std::setw(14) << "bytes/file" << std::setw(14) << "key ns" << std::setw(14) << "copy ns"
+              << "\n";
+    std::cout << std::fixed << std::setprecision(1);
+
+    {
+        std::map<std::string, FileInfo> files;
+        for (size_t i = 0; i < count; i++) {
+            FileInfo info = makeInfo(i);
+            files[info.filename] = info;
+        }
+        size_t bytes = heapBytes - baseline;
+        double keyNs = nanosPerLookup(keys, [&](const std::string &key) { return files.count(key); });
+        FileInfo info;
+        double copyNs = nanosPerLookup(keys, [&](const std::string &key) {
+            auto it = files.find(key);
+            if (it == files.end()) return 0;
+            info = it->second;
+            return 1;
+        });
+        std::cout << std::left << std::setw(10) << "std::map" << std::right << std::setw(14)
+                  << bytes / (1024.0 * 1024.0) << std::setw(14) << (double)bytes / count << std::setw(14) << keyNs
+                  << std::setw(14) << copyNs << "\n";
+    }
+
+    {
+        Catalog catalog;
+        uint16_t root = catalog.addRoot(ROOT);
+        for (size_t i = 0; i < count; i++) catalog.put(makeInfo(i), root);
+        size_t bytes = heapBytes - baseline;
+        double keyNs = nanosPerLookup(keys, [&](const std::string &key) { return catalog.contains(key); });
+        FileInfo info;
+        double copyNs = nanosPerLookup(keys, [&](const std::string &key) { return catalog.find(key, info); });
+        std::cout << std::left << std::setw(10) << "Catalog" << std::right << std::setw(14)
+                  << bytes / (1024.0 * 1024.0) << std::setw(14) << (double)bytes / count << std::setw(14) << keyNs
+                  << std::setw(14) << copyNs << "\n";
+        std::cout << "\nCatalog::memoryUsage(): " << catalog.memoryUsage() / (1024.0 * 1024.0) << " MB\n";
+
+        struct Query {
+            Catalog::MatchKind kind;
+            const char *label;
+            std::string text;
+        };
+        const Query queries[] = {
+            {Catalog::MATCH_PREFIX, "PREFIX", "collection0/album7"},
+            {Catalog::MATCH_SUBSTRING, "SUBSTR", "track-" + std::to_string(count / 3)},
+            {Catalog::MATCH_SUBSTRING, "SUBSTR", "album99/"},
+            {Catalog::MATCH_GLOB, "GLOB", "*/album42/*7.flac"},
+            {Catalog::MATCH_GLOB, "GLOB", "*-" + std::to_string(count / 7) + "?.FLAC"},
+        };
+        std::cout << "\n" << std::left << std::setw(34) << "Search (first 100 by name)" << std::right
+                  << std::setw(10) << "matches" << std::setw(10) << "ms" << "\n";
+        std::vector<FileInfo> results;
+        for (const auto &query : queries) {
+            auto start = std::chrono::steady_clock::now();
+            size_t total = catalog.search(query.kind, query.text, Catalog::SORT_NAME, 100, results);
+            double ms = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1000;
+            std::cout << std::left << std::setw(34) << (std::string(query.label) + " " + query.text) << std::right
+                      << std::setw(10) << total << std::setw(10) << ms << "\n";
+        }
+
+        size_t indexed = heapBytes;
+        catalog.setSubstringIndex(false);
+        std::cout << "\nTrigram index: " << (indexed - heapBytes) / (1024.0 * 1024.0) << " MB\n";
+    }
+
+    std::cout << "\n\"key ns\" only resolves the path; \"copy ns\" also copies the entry out as a\n"
+                 "FileInfo, which is what the server does for every request.\n";
+    return 0;
+}
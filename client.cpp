@@ -8,8 +8,19 @@
 #include <iomanip>
 #include <chrono>
 #include <filesystem>
+#include <memory>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <unordered_map>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mswsock.h>
 
 // For compression
 #include <zlib.h>
@@ -20,6 +31,8 @@
 
 // Include our menu system
 #include "menu.h"
+#include "delta.h"
+#include "trace.h"
 
 #pragma comment(lib, "ws2_32.lib")
 #pragma comment(lib, "zlib.lib")
@@ -30,6 +43,21 @@ namespace fs = std::filesystem;
 const int CHUNK_SIZE = 65536;
 const std::string CONFIG_FILE = "client_config.txt";
 const std::string RESUME_DIR = ".resume";
+const std::string CHUNK_STORE_DIR = ".chunks";
+const size_t DEDUPE_THRESHOLD = 1024 * 1024;
+const size_t WRITE_BLOCK_SIZE = 1024 * 1024;
+const uint32_t MAX_FRAME_SIZE = 16 * 1024 * 1024;
+const size_t SEGMENT_THRESHOLD = 16 * 1024 * 1024;
+const size_t MIN_SEGMENT_SPLIT = 1024 * 1024;
+const int SEGMENT_RETRIES = 3;
+const DWORD SEGMENT_RECV_TIMEOUT_MS = 15000;
+const int MAX_DOWNLOAD_ATTEMPTS = 4;
+const DWORD CONNECT_TIMEOUT_MS = 5000;
+const size_t POOL_MAX_IDLE = 8;
+const int POOL_IDLE_SECONDS = 20;       // Below the server's 30 s keep-alive timeout
+const int PREDIAL_CONNECTIONS = 2;
+const DWORD WATCH_RECV_TIMEOUT_MS = 75000;
+const int WATCH_MAX_BACKOFF_SECONDS = 30;
 
 struct FileEntry {
     std::string filename;
@@ -37,63 +65,394 @@ struct FileEntry {
     std::string sha256;
 };
 
+// Resume state lives in an append-only binary journal per download: one header
+// record followed by checkpoint records. Every record carries its length and a
+// CRC32, so a torn write at the tail is detected and the last intact
+// checkpoint wins.
+const uint32_t JOURNAL_MAGIC = 0x4C4E4A52;  // "RJNL"
+const uint16_t JOURNAL_VERSION = 1;
+const size_t JOURNAL_BLOCK_SIZE = WRITE_BLOCK_SIZE;
+const size_t JOURNAL_COMPACT_SIZE = 1024 * 1024;
+
+enum JournalRecordType : uint16_t {
+    JOURNAL_HEADER = 1,
+    JOURNAL_CHECKPOINT = 2
+};
+
+void putU16(std::string& out, uint16_t v) { out.append((const char*)&v, sizeof(v)); }
+void putU32(std::string& out, uint32_t v) { out.append((const char*)&v, sizeof(v)); }
+void putU64(std::string& out, uint64_t v) { out.append((const char*)&v, sizeof(v)); }
+
+void putString(std::string& out, const std::string& value) {
+    putU16(out, (uint16_t)value.size());
+    out += value;
+}
+
+// Bounds-checked little-endian reader over a record payload.
+struct RecordReader {
+    const char* data;
+    size_t size;
+    size_t pos = 0;
+    bool ok = true;
+    
+    RecordReader(const char* d, size_t n) : data(d), size(n) {}
+    
+    template <typename T>
+    T get() {
+        T value = 0;
+        if (pos + sizeof(T) > size) {
+            ok = false;
+            return value;
+        }
+        std::memcpy(&value, data + pos, sizeof(T));
+        pos += sizeof(T);
+        return value;
+    }
+    
+    std::string getString() {
+        uint16_t length = get<uint16_t>();
+        if (!ok || pos + length > size) {
+            ok = false;
+            return "";
+        }
+        std::string value(data + pos, length);
+        pos += length;
+        return value;
+    }
+};
+
+std::string encodeRecord(uint16_t type, const std::string& payload) {
+    std::string record;
+    putU32(record, JOURNAL_MAGIC);
+    putU16(record, type);
+    putU16(record, 0);
+    putU32(record, (uint32_t)payload.size());
+    record += payload;
+    uLong crc = crc32(0L, (const Bytef*)record.data() + 4, (uInt)(record.size() - 4));
+    putU32(record, (uint32_t)crc);
+    return record;
+}
+
 struct ResumeInfo {
     std::string filename;
     std::string expectedHash;
-    size_t totalSize;
-    size_t bytesDownloaded;
+    size_t totalSize = 0;
+    size_t bytesDownloaded = 0;   // Contiguous prefix known to be on disk
     std::string serverIP;
-    int serverPort;
+    int serverPort = 0;
+    size_t bitmapFirst = 0;       // Block index of the first bit in bitmap
+    std::vector<uint8_t> bitmap;  // Completed JOURNAL_BLOCK_SIZE blocks past the prefix
+    
+    static fs::path journalPath(const std::string& savePath) {
+        return fs::path(RESUME_DIR) / (fs::path(savePath).filename().string() + ".journal");
+    }
+    
+    size_t blockCount() const {
+        return (totalSize + JOURNAL_BLOCK_SIZE - 1) / JOURNAL_BLOCK_SIZE;
+    }
+    
+    bool blockDone(size_t block) const {
+        if ((block + 1) * JOURNAL_BLOCK_SIZE <= bytesDownloaded) return true;
+        if (block < bitmapFirst) return false;
+        size_t bit = block - bitmapFirst;
+        return bit / 8 < bitmap.size() && (bitmap[bit / 8] & (1 << (bit % 8)));
+    }
     
-    void save(const std::string& savePath) {
-        fs::path resumePath = fs::path(RESUME_DIR) / (fs::path(savePath).filename().string() + ".resume");
-        std::ofstream file(resumePath);
-        if (file) {
-            file << "filename=" << filename << "\n";
-            file << "hash=" << expectedHash << "\n";
-            file << "total=" << totalSize << "\n";
-            file << "downloaded=" << bytesDownloaded << "\n";
-            file << "server=" << serverIP << "\n";
-            file << "port=" << serverPort << "\n";
+    // Ranges still missing: everything past the prefix that is not in a
+    // completed block, merged into as few ranges as possible.
+    std::vector<std::pair<size_t, size_t>> pendingRanges() const {
+        std::vector<std::pair<size_t, size_t>> pending;
+        size_t pos = bytesDownloaded;
+        while (pos < totalSize) {
+            size_t block = pos / JOURNAL_BLOCK_SIZE;
+            size_t blockEnd = std::min((block + 1) * JOURNAL_BLOCK_SIZE, totalSize);
+            if (!blockDone(block)) {
+                if (!pending.empty() && pending.back().second == pos) {
+                    pending.back().second = blockEnd;
+                } else {
+                    pending.push_back({pos, blockEnd});
+                }
+            }
+            pos = blockEnd;
         }
+        return pending;
+    }
+    
+    size_t completedBytes() const {
+        size_t missing = 0;
+        for (const auto& range : pendingRanges()) missing += range.second - range.first;
+        return totalSize - missing;
     }
     
     bool load(const std::string& savePath) {
-        fs::path resumePath = fs::path(RESUME_DIR) / (fs::path(savePath).filename().string() + ".resume");
-        std::ifstream file(resumePath);
+        std::ifstream file(journalPath(savePath), std::ios::binary);
         if (!file) return false;
-        
-        std::string line;
-        while (std::getline(file, line)) {
-            size_t eq = line.find('=');
-            if (eq != std::string::npos) {
-                std::string key = line.substr(0, eq);
-                std::string value = line.substr(eq + 1);
-                
-                if (key == "filename") filename = value;
-                else if (key == "hash") expectedHash = value;
-                else if (key == "total") totalSize = std::stoull(value);
-                else if (key == "downloaded") bytesDownloaded = std::stoull(value);
-                else if (key == "server") serverIP = value;
-                else if (key == "port") serverPort = std::stoi(value);
+        std::string journal((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        
+        bool haveHeader = false;
+        size_t pos = 0;
+        while (pos + 16 <= journal.size()) {
+            RecordReader head(journal.data() + pos, 12);
+            uint32_t magic = head.get<uint32_t>();
+            uint16_t type = head.get<uint16_t>();
+            head.get<uint16_t>();
+            uint32_t length = head.get<uint32_t>();
+            if (magic != JOURNAL_MAGIC || length > journal.size() - pos - 16) break;
+            
+            uint32_t storedCrc;
+            std::memcpy(&storedCrc, journal.data() + pos + 12 + length, sizeof(storedCrc));
+            uLong crc = crc32(0L, (const Bytef*)journal.data() + pos + 4, 8 + length);
+            if ((uint32_t)crc != storedCrc) break;  // Torn or corrupt tail
+            
+            RecordReader payload(journal.data() + pos + 12, length);
+            if (type == JOURNAL_HEADER) {
+                if (payload.get<uint16_t>() != JOURNAL_VERSION) return false;
+                if (payload.get<uint32_t>() != JOURNAL_BLOCK_SIZE) return false;
+                totalSize = payload.get<uint64_t>();
+                serverPort = payload.get<uint32_t>();
+                filename = payload.getString();
+                expectedHash = payload.getString();
+                serverIP = payload.getString();
+                haveHeader = payload.ok;
+            } else if (type == JOURNAL_CHECKPOINT && haveHeader) {
+                payload.get<uint64_t>();  // Sequence number
+                size_t prefix = payload.get<uint64_t>();
+                size_t first = payload.get<uint64_t>();
+                uint32_t bitmapLength = payload.get<uint32_t>();
+                if (payload.ok && payload.pos + bitmapLength == length && prefix <= totalSize) {
+                    bytesDownloaded = prefix;
+                    bitmapFirst = first;
+                    bitmap.assign(journal.data() + pos + 12 + payload.pos,
+                                  journal.data() + pos + 12 + length);
+                }
             }
+            pos += 16 + length;
         }
-        return true;
+        return haveHeader;
     }
     
     void remove(const std::string& savePath) {
-        fs::path resumePath = fs::path(RESUME_DIR) / (fs::path(savePath).filename().string() + ".resume");
         try {
-            fs::remove(resumePath);
+            fs::remove(journalPath(savePath));
+            // Text resume files written by older clients
+            fs::remove(fs::path(RESUME_DIR) / (fs::path(savePath).filename().string() + ".resume"));
         } catch (...) {}
     }
 };
 
+// Writer side of the resume journal. The disk writer reports every block it
+// writes; once checkpoint_interval seconds or checkpoint_mb megabytes have
+// passed, it flushes the data file and appends an fsync'd checkpoint, so a
+// crash loses at most one interval. The journal is compacted into a fresh
+// header plus the latest checkpoint once it grows past JOURNAL_COMPACT_SIZE.
+class ResumeJournal {
+private:
+    std::mutex mutex;
+    HANDLE file;
+    std::string path;
+    ResumeInfo info;
+    std::vector<uint32_t> blockFill;
+    uint64_t sequence;
+    size_t journalSize;
+    size_t bytesSinceCheckpoint;
+    std::chrono::steady_clock::time_point lastCheckpoint;
+    std::chrono::seconds interval;
+    size_t byteCadence;
+    
+    size_t blockLength(size_t block) const {
+        return std::min(JOURNAL_BLOCK_SIZE, info.totalSize - block * JOURNAL_BLOCK_SIZE);
+    }
+    
+    std::string encodeHeader() const {
+        std::string payload;
+        putU16(payload, JOURNAL_VERSION);
+        putU32(payload, (uint32_t)JOURNAL_BLOCK_SIZE);
+        putU64(payload, info.totalSize);
+        putU32(payload, (uint32_t)info.serverPort);
+        putString(payload, info.filename);
+        putString(payload, info.expectedHash);
+        putString(payload, info.serverIP);
+        return encodeRecord(JOURNAL_HEADER, payload);
+    }
+    
+    std::string encodeCheckpoint() {
+        size_t prefix = info.bytesDownloaded;
+        size_t first = prefix / JOURNAL_BLOCK_SIZE;
+        
+        std::vector<uint8_t> bits;
+        for (size_t block = first; block < blockFill.size(); block++) {
+            if (blockFill[block] < blockLength(block)) continue;
+            size_t bit = block - first;
+            if (bits.size() <= bit / 8) bits.resize(bit / 8 + 1, 0);
+            bits[bit / 8] |= (uint8_t)(1 << (bit % 8));
+        }
+        
+        std::string payload;
+        putU64(payload, ++sequence);
+        putU64(payload, prefix);
+        putU64(payload, first);
+        putU32(payload, (uint32_t)bits.size());
+        payload.append(bits.begin(), bits.end());
+        return encodeRecord(JOURNAL_CHECKPOINT, payload);
+    }
+    
+    bool append(const std::string& record) {
+        DWORD written = 0;
+        OVERLAPPED position = {};
+        position.Offset = (DWORD)(journalSize & 0xFFFFFFFF);
+        position.OffsetHigh = (DWORD)((uint64_t)journalSize >> 32);
+        if (!WriteFile(file, record.data(), (DWORD)record.size(), &written, &position) ||
+            written != record.size()) {
+            return false;
+        }
+        journalSize += record.size();
+        return FlushFileBuffers(file) != 0;
+    }
+    
+    // Writes header + current checkpoint to a temp file and atomically swaps it in.
+    bool rewrite() {
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        
+        std::string tempPath = path + ".tmp";
+        file = CreateFileA(tempPath.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                           CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        
+        journalSize = 0;
+        bool ok = append(encodeHeader() + encodeCheckpoint());
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+        
+        if (!ok || !MoveFileExA(tempPath.c_str(), path.c_str(),
+                                MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+            return false;
+        }
+        
+        file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                           OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        return file != INVALID_HANDLE_VALUE;
+    }
+    
+public:
+    ResumeJournal(const ResumeInfo& resume, int intervalSeconds, int cadenceMB)
+        : file(INVALID_HANDLE_VALUE), info(resume), sequence(0), journalSize(0),
+          bytesSinceCheckpoint(0), lastCheckpoint(std::chrono::steady_clock::now()),
+          interval(std::max(1, intervalSeconds)),
+          byteCadence((size_t)std::max(1, cadenceMB) * 1024 * 1024) {
+        blockFill.assign(info.blockCount(), 0);
+        for (size_t block = 0; block < blockFill.size(); block++) {
+            if (info.blockDone(block)) blockFill[block] = (uint32_t)blockLength(block);
+        }
+        size_t prefixBlock = info.bytesDownloaded / JOURNAL_BLOCK_SIZE;
+        if (prefixBlock < blockFill.size() && !info.blockDone(prefixBlock)) {
+            blockFill[prefixBlock] = (uint32_t)(info.bytesDownloaded % JOURNAL_BLOCK_SIZE);
+        }
+    }
+    
+    ~ResumeJournal() {
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    }
+    
+    ResumeJournal(const ResumeJournal&) = delete;
+    ResumeJournal& operator=(const ResumeJournal&) = delete;
+    
+    // Starts a compacted journal for savePath that already reflects the
+    // progress this journal was constructed with.
+    bool begin(const std::string& savePath) {
+        std::lock_guard<std::mutex> lock(mutex);
+        path = ResumeInfo::journalPath(savePath).string();
+        return rewrite();
+    }
+    
+    // Called by the disk writer after a block has been written.
+    void markWritten(size_t offset, size_t length) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t end = std::min(offset + length, info.totalSize);
+        for (size_t pos = offset; pos < end; ) {
+            size_t block = pos / JOURNAL_BLOCK_SIZE;
+            size_t blockEnd = std::min((block + 1) * JOURNAL_BLOCK_SIZE, end);
+            blockFill[block] += (uint32_t)(blockEnd - pos);
+            pos = blockEnd;
+        }
+        
+        if (offset <= info.bytesDownloaded && end > info.bytesDownloaded) {
+            info.bytesDownloaded = end;
+        }
+        // Pull the prefix across blocks other connections already completed
+        while (info.bytesDownloaded < info.totalSize &&
+               info.bytesDownloaded % JOURNAL_BLOCK_SIZE == 0) {
+            size_t block = info.bytesDownloaded / JOURNAL_BLOCK_SIZE;
+            if (blockFill[block] < blockLength(block)) break;
+            info.bytesDownloaded += blockLength(block);
+        }
+        bytesSinceCheckpoint += length;
+    }
+    
+    bool due() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return bytesSinceCheckpoint > 0 &&
+               (bytesSinceCheckpoint >= byteCadence ||
+                std::chrono::steady_clock::now() - lastCheckpoint >= interval);
+    }
+    
+    // The caller must have flushed the data file first, so everything marked
+    // so far is durable before the checkpoint that claims it.
+    bool checkpoint() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        
+        bytesSinceCheckpoint = 0;
+        lastCheckpoint = std::chrono::steady_clock::now();
+        if (journalSize >= JOURNAL_COMPACT_SIZE) return rewrite();
+        return append(encodeCheckpoint());
+    }
+    
+    // Deletes the journal once the download no longer needs it.
+    void discard() {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+        if (!path.empty()) DeleteFileA(path.c_str());
+    }
+};
+
 struct ClientConfig {
     std::string lastServer = "";
     int lastPort = 8080;
     bool enableCompression = true;
     std::string downloadFolder = ".";
+    int segments = 0;     // 0 = auto-tune, 1 = single stream
+    int maxSegments = 8;
+    int parallelDownloads = 3;
+    std::string durability = "interval";  // none, interval or always
+    int flushInterval = 5;                // Seconds between flushes for "interval"
+    int writeBuffers = 8;                 // WRITE_BLOCK_SIZE blocks per download
+    int checkpointInterval = 2;           // Seconds between resume checkpoints
+    int checkpointMB = 64;                // Or after this many megabytes, whichever is first
+    bool deltaSync = true;                // Update existing local copies with DELTA
+    bool chunkDedupe = true;              // Reuse chunks of earlier downloads
+    std::vector<std::string> peers;       // Extra servers ("ip:port") for swarm downloads
+    std::string traceFile = "";           // Chrome trace of sampled downloads, empty = off
+    double traceSample = 1.0;             // Fraction of downloads traced
+    
+    // Command-line overrides for this run only; save() never writes them
+    struct Overlay {
+        std::string downloadFolder;       // Empty = not overridden
+        int parallelDownloads = 0;        // 0 = not overridden
+        std::vector<std::string> peers;   // Empty = not overridden
+    } overlay;
+    
+    const std::string& activeDownloadFolder() const {
+        return overlay.downloadFolder.empty() ? downloadFolder : overlay.downloadFolder;
+    }
+    
+    int activeParallelDownloads() const {
+        return overlay.parallelDownloads > 0 ? overlay.parallelDownloads : parallelDownloads;
+    }
+    
+    const std::vector<std::string>& activePeers() const {
+        return overlay.peers.empty() ? peers : overlay.peers;
+    }
     
     void load() {
         std::ifstream file(CONFIG_FILE);
@@ -112,6 +471,26 @@ struct ClientConfig {
                 else if (key == "port") lastPort = std::stoi(value);
                 else if (key == "compression") enableCompression = (value == "true");
                 else if (key == "download_folder") downloadFolder = value;
+                else if (key == "segments") segments = std::stoi(value);
+                else if (key == "max_segments") maxSegments = std::stoi(value);
+                else if (key == "parallel_downloads") parallelDownloads = std::stoi(value);
+                else if (key == "durability") durability = value;
+                else if (key == "flush_interval") flushInterval = std::stoi(value);
+                else if (key == "write_buffers") writeBuffers = std::stoi(value);
+                else if (key == "checkpoint_interval") checkpointInterval = std::stoi(value);
+                else if (key == "checkpoint_mb") checkpointMB = std::stoi(value);
+                else if (key == "delta_sync") deltaSync = (value == "true");
+                else if (key == "chunk_dedupe") chunkDedupe = (value == "true");
+                else if (key == "trace_file") traceFile = value;
+                else if (key == "trace_sample") traceSample = std::stod(value);
+                else if (key == "peers") {
+                    peers.clear();
+                    std::istringstream list(value);
+                    std::string peer;
+                    while (std::getline(list, peer, ',')) {
+                        if (!peer.empty()) peers.push_back(peer);
+                    }
+                }
             }
         }
     }
@@ -123,253 +502,2313 @@ struct ClientConfig {
         file << "port=" << lastPort << "\n";
         file << "compression=" << (enableCompression ? "true" : "false") << "\n";
         file << "download_folder=" << downloadFolder << "\n";
+        file << "segments=" << segments << "\n";
+        file << "max_segments=" << maxSegments << "\n";
+        file << "parallel_downloads=" << parallelDownloads << "\n";
+        file << "durability=" << durability << "\n";
+        file << "flush_interval=" << flushInterval << "\n";
+        file << "write_buffers=" << writeBuffers << "\n";
+        file << "checkpoint_interval=" << checkpointInterval << "\n";
+        file << "checkpoint_mb=" << checkpointMB << "\n";
+        file << "delta_sync=" << (deltaSync ? "true" : "false") << "\n";
+        file << "chunk_dedupe=" << (chunkDedupe ? "true" : "false") << "\n";
+        file << "trace_file=" << traceFile << "\n";
+        file << "trace_sample=" << traceSample << "\n";
+        file << "peers=";
+        for (size_t i = 0; i < peers.size(); i++) {
+            file << (i > 0 ? "," : "") << peers[i];
+        }
+        file << "\n";
     }
 };
 
-class FileClient {
+// Reusable inflate state for COMPRESSED transfers. Every frame on the wire is an
+// independent zlib stream, so the z_stream is reset between frames instead of
+// being set up and torn down per chunk.
+class FrameInflater {
 private:
-    WSADATA wsaData;
-    bool wsaInitialized;
-    std::string serverIP;
-    int serverPort;
-    std::vector<FileEntry> availableFiles;
-    ClientConfig config;
+    z_stream stream;
+    bool initialized;
     
-    std::string calculateSHA256(const std::string& filepath, size_t maxBytes = 0) {
-        std::ifstream file(filepath, std::ios::binary);
-        if (!file) return "";
-        
-        EVP_MD_CTX* context = EVP_MD_CTX_new();
-        if (!context) return "";
-        
-        if (EVP_DigestInit_ex(context, EVP_sha256(), nullptr) != 1) {
-            EVP_MD_CTX_free(context);
-            return "";
+public:
+    FrameInflater() : initialized(false) {
+        std::memset(&stream, 0, sizeof(stream));
+        initialized = (inflateInit(&stream) == Z_OK);
+    }
+    
+    ~FrameInflater() {
+        if (initialized) inflateEnd(&stream);
+    }
+    
+    FrameInflater(const FrameInflater&) = delete;
+    FrameInflater& operator=(const FrameInflater&) = delete;
+    
+    bool valid() const { return initialized; }
+    
+    bool beginFrame(const char* data, size_t size) {
+        if (inflateReset(&stream) != Z_OK) return false;
+        stream.next_in = (Bytef*)data;
+        stream.avail_in = (uInt)size;
+        return true;
+    }
+    
+    // Inflates as much of the current frame as fits in out. Returns the number of
+    // bytes produced, or -1 if the frame is corrupt or truncated. frameDone is set
+    // once the end of the zlib stream has been reached.
+    long inflateInto(char* out, size_t capacity, bool& frameDone) {
+        stream.next_out = (Bytef*)out;
+        stream.avail_out = (uInt)capacity;
+        
+        int ret = inflate(&stream, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) return -1;
+        
+        frameDone = (ret == Z_STREAM_END);
+        return (long)(capacity - stream.avail_out);
+    }
+};
+
+enum class Durability { None, Interval, Always };
+
+Durability parseDurability(const std::string& value) {
+    if (value == "none") return Durability::None;
+    if (value == "always") return Durability::Always;
+    return Durability::Interval;
+}
+
+// Write-behind file writer. Receive loops fill large preallocated blocks in
+// place through a Stream and hand them to a background thread, which writes
+// each block with a single positional WriteFile and flushes according to the
+// durability policy. Producers only wait when every block is in flight, so
+// network reads are no longer tied to disk write latency.
+class DiskWriter {
+public:
+    class Stream;
+    
+private:
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t capacity;
+        size_t length;
+        size_t offset;
+        Stream* owner;
+    };
+    
+    HANDLE file;
+    std::vector<std::unique_ptr<Block>> blocks;
+    std::vector<Block*> freeBlocks;
+    std::deque<Block*> queue;
+    std::mutex mutex;
+    std::condition_variable queueReady;
+    std::condition_variable blockDone;
+    std::thread thread;
+    bool stopping;
+    std::atomic<bool> failed;
+    Durability durability;
+    std::chrono::milliseconds flushInterval;
+    ResumeJournal* journal;
+    Tracer::Handle trace;  // Of the thread that opened the file
+    
+    Block* acquireBlock() {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (freeBlocks.empty()) {
+            TraceSpan span("writeWait");
+            blockDone.wait(lock, [&] { return !freeBlocks.empty(); });
         }
-        
-        char buffer[CHUNK_SIZE];
-        size_t bytesProcessed = 0;
-        
-        while (file.read(buffer, CHUNK_SIZE) || file.gcount() > 0) {
-            size_t toProcess = file.gcount();
+        Block* block = freeBlocks.back();
+        freeBlocks.pop_back();
+        return block;
+    }
+    
+    void releaseBlock(Block* block) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            freeBlocks.push_back(block);
+        }
+        blockDone.notify_all();
+    }
+    
+    void submit(Block* block) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            block->owner->pending++;
+            queue.push_back(block);
+        }
+        queueReady.notify_one();
+    }
+    
+    bool writeBlock(const Block* block) {
+        size_t done = 0;
+        while (done < block->length) {
+            OVERLAPPED position = {};
+            uint64_t offset = block->offset + done;
+            position.Offset = (DWORD)(offset & 0xFFFFFFFF);
+            position.OffsetHigh = (DWORD)(offset >> 32);
             
-            if (maxBytes > 0) {
-                if (bytesProcessed + toProcess > maxBytes) {
-                    toProcess = maxBytes - bytesProcessed;
+            DWORD written = 0;
+            if (!WriteFile(file, block->data.get() + done, (DWORD)(block->length - done),
+                           &written, &position) || written == 0) {
+                return false;
+            }
+            done += written;
+        }
+        return true;
+    }
+    
+    void run() {
+        TraceLane lane(trace);
+        auto lastFlush = std::chrono::steady_clock::now();
+        bool dirty = false;
+        
+        while (true) {
+            Block* block = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                queueReady.wait_for(lock, flushInterval, [&] { return stopping || !queue.empty(); });
+                if (!queue.empty()) {
+                    block = queue.front();
+                    queue.pop_front();
+                } else if (stopping) {
+                    break;
                 }
             }
             
-            if (EVP_DigestUpdate(context, buffer, toProcess) != 1) {
-                EVP_MD_CTX_free(context);
-                return "";
+            if (block) {
+                bool ok;
+                {
+                    TraceSpan span("write");
+                    span.arg("bytes", block->length);
+                    ok = !failed && writeBlock(block);
+                }
+                if (!ok) failed = true;
+                dirty = true;
+                
+                if (ok && durability == Durability::Always) {
+                    FlushFileBuffers(file);
+                    dirty = false;
+                }
+                
+                // Data must reach the disk before a checkpoint claims it
+                if (ok && journal) {
+                    journal->markWritten(block->offset, block->length);
+                    if (journal->due()) {
+                        if (dirty) FlushFileBuffers(file);
+                        dirty = false;
+                        lastFlush = std::chrono::steady_clock::now();
+                        journal->checkpoint();
+                    }
+                }
+                
+                Stream* owner = block->owner;
+                if (ok && owner->onWritten) owner->onWritten(block->length);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (ok) owner->writtenBytes += block->length;
+                    owner->pending--;
+                    freeBlocks.push_back(block);
+                }
+                blockDone.notify_all();
             }
             
-            bytesProcessed += toProcess;
-            
-            if (maxBytes > 0 && bytesProcessed >= maxBytes) {
-                break;
+            auto now = std::chrono::steady_clock::now();
+            if (dirty && durability == Durability::Interval && now - lastFlush >= flushInterval) {
+                FlushFileBuffers(file);
+                dirty = false;
+                lastFlush = now;
             }
         }
+    }
+    
+public:
+    // Sequential writer over one region of the file. Blocks after the first are
+    // aligned to WRITE_BLOCK_SIZE, so the disk sees large aligned writes no
+    // matter how small the individual recv() calls were.
+    class Stream {
+    private:
+        friend class DiskWriter;
+        DiskWriter& writer;
+        Block* current;
+        size_t position;
+        std::atomic<size_t> writtenBytes;
+        int pending;  // Guarded by writer.mutex
+        std::function<void(size_t)> onWritten;
+        
+        void submitCurrent() {
+            if (!current) return;
+            if (current->length == 0) {
+                writer.releaseBlock(current);
+            } else {
+                writer.submit(current);
+            }
+            current = nullptr;
+        }
         
-        unsigned char hash[EVP_MAX_MD_SIZE];
-        unsigned int hashLen;
-        
-        if (EVP_DigestFinal_ex(context, hash, &hashLen) != 1) {
-            EVP_MD_CTX_free(context);
-            return "";
+    public:
+        Stream(DiskWriter& w, size_t offset, std::function<void(size_t)> callback = nullptr)
+            : writer(w), current(nullptr), position(offset), writtenBytes(0), pending(0),
+              onWritten(std::move(callback)) {}
+        
+        ~Stream() { sync(); }
+        
+        Stream(const Stream&) = delete;
+        Stream& operator=(const Stream&) = delete;
+        
+        // Returns write-ready memory at the current position; available is how
+        // much of it may be filled before calling commit().
+        char* buffer(size_t& available) {
+            if (!current) {
+                current = writer.acquireBlock();
+                current->owner = this;
+                current->offset = position;
+                current->length = 0;
+                current->capacity = WRITE_BLOCK_SIZE - position % WRITE_BLOCK_SIZE;
+            }
+            available = current->capacity - current->length;
+            return current->data.get() + current->length;
         }
         
-        EVP_MD_CTX_free(context);
+        void commit(size_t length) {
+            current->length += length;
+            position += length;
+            if (current->length == current->capacity) submitCurrent();
+        }
         
-        std::stringstream ss;
-        for (unsigned int i = 0; i < hashLen; i++) {
-            ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+        // Hands over any partial block and waits until everything is on disk.
+        void sync() {
+            submitCurrent();
+            std::unique_lock<std::mutex> lock(writer.mutex);
+            writer.blockDone.wait(lock, [&] { return pending == 0; });
         }
         
-        return ss.str();
-    }
+        size_t written() const { return writtenBytes; }
+    };
     
-    std::vector<char> decompressData(const char* data, size_t compressedSize, size_t originalSize) {
-        std::vector<char> decompressed(originalSize);
-        uLongf destLen = originalSize;
-        
-        if (uncompress((Bytef*)decompressed.data(), &destLen, 
-                      (const Bytef*)data, compressedSize) != Z_OK) {
-            return std::vector<char>();
+    DiskWriter(size_t blockCount, Durability policy, int flushSeconds)
+        : file(INVALID_HANDLE_VALUE), stopping(false), failed(false), durability(policy),
+          flushInterval(std::chrono::seconds(std::max(1, flushSeconds))), journal(nullptr) {
+        for (size_t i = 0; i < std::max<size_t>(blockCount, 2); i++) {
+            std::unique_ptr<Block> block(new Block());
+            block->data.reset(new char[WRITE_BLOCK_SIZE]);
+            freeBlocks.push_back(block.get());
+            blocks.push_back(std::move(block));
         }
-        
-        return decompressed;
     }
     
-    size_t getFileSize(const std::string& filepath) {
-        std::ifstream file(filepath, std::ios::binary | std::ios::ate);
-        if (!file) return 0;
-        return file.tellg();
-    }
+    ~DiskWriter() { close(); }
     
-    void showProgress(size_t current, size_t total, std::chrono::steady_clock::time_point startTime) {
-        double percent = (total > 0) ? (100.0 * current / total) : 0;
-        
-        auto now = std::chrono::steady_clock::now();
-        auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - startTime).count();
-        
-        double speed = (elapsed > 0) ? (current / (1024.0 * 1024.0 * elapsed)) : 0;
-        
-        int barWidth = 40;
-        int pos = (int)(barWidth * current / total);
-        
-        std::cout << "\r[";
-        for (int i = 0; i < barWidth; ++i) {
-            if (i < pos) std::cout << "=";
-            else if (i == pos) std::cout << ">";
-            else std::cout << " ";
-        }
-        std::cout << "] " << std::fixed << std::setprecision(1) << percent << "% "
-                  << std::setprecision(2) << speed << " MB/s " << std::flush;
-    }
+    DiskWriter(const DiskWriter&) = delete;
+    DiskWriter& operator=(const DiskWriter&) = delete;
     
-    std::string formatSize(size_t bytes) {
-        std::stringstream ss;
-        if (bytes < 1024) {
-            ss << bytes << " B";
-        } else if (bytes < 1024 * 1024) {
-            ss << std::fixed << std::setprecision(2) << (bytes / 1024.0) << " KB";
-        } else if (bytes < 1024 * 1024 * 1024) {
-            ss << std::fixed << std::setprecision(2) << (bytes / (1024.0 * 1024.0)) << " MB";
-        } else {
-            ss << std::fixed << std::setprecision(2) << (bytes / (1024.0 * 1024.0 * 1024.0)) << " GB";
-        }
-        return ss.str();
+    bool open(const std::string& path, bool truncate) {
+        file = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr,
+                           truncate ? CREATE_ALWAYS : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+        trace = Tracer::current();
+        thread = std::thread(&DiskWriter::run, this);
+        return true;
     }
     
-public:
-    FileClient() : wsaInitialized(false), serverPort(8080) {
-        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-            std::cerr << "WSAStartup failed\n";
-        } else {
-            wsaInitialized = true;
-        }
-        
-        config.load();
-        serverIP = config.lastServer;
-        serverPort = config.lastPort;
-        
-        if (config.downloadFolder.empty() || config.downloadFolder == ".") {
-            config.downloadFolder = fs::current_path().string();
-        }
-        
-        try {
-            fs::create_directories(config.downloadFolder);
-            fs::create_directories(RESUME_DIR);
-        } catch (...) {}
+    // Reserves disk space for the whole file up front without moving end-of-file,
+    // so the file is laid out in one go instead of growing piecemeal.
+    void preallocate(size_t size) {
+        FILE_ALLOCATION_INFO info;
+        info.AllocationSize.QuadPart = (LONGLONG)size;
+        SetFileInformationByHandle(file, FileAllocationInfo, &info, sizeof(info));
     }
     
-    ~FileClient() {
-        if (wsaInitialized) {
-            WSACleanup();
+    // Records completed blocks in a resume journal. Must be attached before any
+    // data is written and the journal must outlive close().
+    void attachJournal(ResumeJournal* resumeJournal) { journal = resumeJournal; }
+    
+    // Streams must have been synced (or destroyed) before closing.
+    bool close() {
+        if (file == INVALID_HANDLE_VALUE) return !failed;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
         }
+        queueReady.notify_one();
+        if (thread.joinable()) thread.join();
+        trace.reset();
+        
+        if (!failed && (durability != Durability::None || journal)) FlushFileBuffers(file);
+        if (!failed && journal) journal->checkpoint();
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+        return !failed;
     }
     
-    void setServer(const std::string& ip, int port) {
-        serverIP = ip;
-        serverPort = port;
+    bool ok() const { return !failed; }
+};
+
+bool recvAll(SOCKET sock, char* data, size_t length) {
+    size_t received = 0;
+    while (received < length) {
+        int n = recv(sock, data + received, (int)std::min(length - received, (size_t)CHUNK_SIZE), 0);
+        if (n <= 0) return false;
+        received += n;
+    }
+    return true;
+}
+
+bool sendAll(SOCKET sock, const char* data, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        int n = send(sock, data + sent, (int)std::min(length - sent, (size_t)CHUNK_SIZE), 0);
+        if (n == SOCKET_ERROR) return false;
+        sent += n;
+    }
+    return true;
+}
+
+// Reads a single '\n'-terminated response header without consuming any of the
+// payload that follows it on the stream. Whatever has arrived is peeked at in
+// one call and only the bytes up to the newline are taken, so a header costs
+// two recv calls rather than one per byte. Fails if the connection ends or the
+// line grows past maxLength before its newline.
+bool recvLine(SOCKET sock, std::string& line, size_t maxLength = 1024) {
+    line.clear();
+    char buffer[1024];
+    while (line.length() < maxLength) {
+        int wanted = (int)std::min(sizeof(buffer), maxLength - line.length());
+        int n = recv(sock, buffer, wanted, MSG_PEEK);
+        if (n <= 0) return false;
+        const char* newline = (const char*)memchr(buffer, '\n', n);
+        int take = newline ? (int)(newline - buffer) + 1 : n;
+        if (!recvAll(sock, buffer, take)) return false;
+        line.append(buffer, take);
+        if (newline) return true;
+    }
+    return false;
+}
+
+// Buffered reader for responses made of many small binary fields, so each
+// field does not cost a recv call of its own.
+class SocketReader {
+private:
+    SOCKET sock;
+    std::vector<char> buffer;
+    size_t pos;
+    size_t end;
+    
+public:
+    explicit SocketReader(SOCKET s) : sock(s), buffer(CHUNK_SIZE), pos(0), end(0) {}
+    
+    bool read(void* out, size_t length) {
+        char* dest = (char*)out;
+        while (length > 0) {
+            if (pos == end) {
+                int n = recv(sock, buffer.data(), (int)buffer.size(), 0);
+                if (n <= 0) return false;
+                pos = 0;
+                end = n;
+            }
+            size_t part = std::min(length, end - pos);
+            memcpy(dest, buffer.data() + pos, part);
+            pos += part;
+            dest += part;
+            length -= part;
+        }
+        return true;
+    }
+    
+    // Next '\n'-terminated line without the terminator.
+    bool readLine(std::string& line, size_t maxLength = 4096) {
+        line.clear();
+        char c;
+        while (line.length() < maxLength) {
+            if (!read(&c, 1)) return false;
+            if (c == '\n') break;
+            line += c;
+        }
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        return true;
+    }
+};
+
+// Progress and console output of one download running inside the download
+// queue. Queue workers run the regular download code; while a report is active
+// on a thread its progress is published here and its chatter is captured
+// instead of interleaving on the console.
+struct TransferReport {
+    std::atomic<size_t> received{0};
+    std::atomic<size_t> total{0};
+    bool permanentFailure = false;
+    std::ostringstream log;
+    std::string summary;  // One-line result shown after a successful batch
+};
+
+thread_local TransferReport* activeReport = nullptr;
+
+std::ostream& status() {
+    return activeReport ? static_cast<std::ostream&>(activeReport->log) : std::cout;
+}
+
+std::ostream& errors() {
+    return activeReport ? static_cast<std::ostream&>(activeReport->log) : std::cerr;
+}
+
+void markPermanentFailure() {
+    if (activeReport) activeReport->permanentFailure = true;
+}
+
+// Prints a transfer summary, or keeps it for the batch report when queued.
+void reportSummary(const std::string& summary) {
+    if (activeReport) activeReport->summary = summary;
+    else std::cout << summary << "\n";
+}
+
+// Case-insensitive wildcard match supporting '*' and '?'.
+bool globMatch(const std::string& pattern, const std::string& name) {
+    size_t p = 0, n = 0, starP = std::string::npos, starN = 0;
+    while (n < name.length()) {
+        if (p < pattern.length() && (pattern[p] == '?' ||
+            tolower((unsigned char)pattern[p]) == tolower((unsigned char)name[n]))) {
+            p++;
+            n++;
+        } else if (p < pattern.length() && pattern[p] == '*') {
+            starP = p++;
+            starN = n;
+        } else if (starP != std::string::npos) {
+            p = starP + 1;
+            n = ++starN;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.length() && pattern[p] == '*') p++;
+    return p == pattern.length();
+}
+
+struct Segment {
+    size_t written;  // Bytes before this offset are on disk
+    size_t next;     // Next offset handed out to the owning worker
+    size_t end;      // One past the last byte of the range
+    bool active;
+    size_t claimStart;  // Where next stood when the current owner claimed it
+    std::chrono::steady_clock::time_point claimedAt;
+};
+
+// Shared range table for segmented downloads. Workers claim idle ranges first;
+// once none are left they split the range expected to finish last, sized by
+// the two workers' throughput so both finish together. Near the end, a worker
+// at least twice as fast takes over a straggler's whole remainder.
+class SegmentScheduler {
+private:
+    std::mutex mutex;
+    std::vector<Segment> segments;
+    std::atomic<size_t> completedBytes;
+    size_t minSplit;
+    
+public:
+    SegmentScheduler(const std::vector<std::pair<size_t, size_t>>& pending,
+                     size_t totalSize, size_t minSplitSize)
+        : completedBytes(totalSize), minSplit(minSplitSize) {
+        for (const auto& range : pending) {
+            if (range.first >= range.second) continue;
+            segments.push_back({range.first, range.first, range.second, false, range.first, {}});
+            completedBytes -= range.second - range.first;
+        }
+    }
+    
+    // Bytes per second the current owner has achieved, or -1 if it has not
+    // held the range long enough to tell.
+    static double ownerRate(const Segment& seg, std::chrono::steady_clock::time_point now) {
+        double seconds = std::chrono::duration<double>(now - seg.claimedAt).count();
+        if (seconds < 0.5) return -1;
+        return (seg.next - seg.claimStart) / seconds;
+    }
+    
+    // Returns the index of the claimed segment, or -1 when nothing is left to
+    // hand out. start/end describe the range the worker should request;
+    // workerRate is the claiming worker's last observed throughput (0 if none).
+    int claim(size_t& start, size_t& end, double workerRate = 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        
+        for (size_t i = 0; i < segments.size(); i++) {
+            Segment& seg = segments[i];
+            if (!seg.active && seg.next < seg.end) {
+                seg.active = true;
+                seg.claimStart = seg.next;
+                seg.claimedAt = now;
+                start = seg.next;
+                end = seg.end;
+                return (int)i;
+            }
+        }
+        
+        // The victim is the range expected to finish last
+        int victim = -1;
+        double longest = 0;
+        for (size_t i = 0; i < segments.size(); i++) {
+            const Segment& seg = segments[i];
+            size_t left = seg.end - seg.next;
+            if (!seg.active || left == 0) continue;
+            double rate = ownerRate(seg, now);
+            double eta = rate > 0 ? left / rate : (rate < 0 ? left / 1e6 : 1e30);
+            if (eta > longest) {
+                longest = eta;
+                victim = (int)i;
+            }
+        }
+        if (victim < 0) return -1;
+        
+        Segment& seg = segments[victim];
+        size_t left = seg.end - seg.next;
+        double victimRate = ownerRate(seg, now);
+        size_t mid;
+        
+        if (left >= 2 * minSplit) {
+            // Give the thief a share proportional to its throughput
+            double share = (victimRate > 0 && workerRate > 0) ?
+                           workerRate / (workerRate + victimRate) : 0.5;
+            share = std::min(0.9, std::max(0.1, share));
+            mid = seg.next + (size_t)(left * (1.0 - share));
+            mid -= mid % CHUNK_SIZE;
+            if (mid <= seg.next) return -1;
+        } else if (victimRate >= 0 && workerRate > 2 * victimRate) {
+            // Endgame: re-request a straggler's remainder from a faster source
+            mid = seg.next;
+        } else {
+            return -1;
+        }
+        
+        Segment stolen = {mid, mid, seg.end, true, mid, now};
+        seg.end = mid;
+        segments.push_back(stolen);
+        
+        start = stolen.next;
+        end = stolen.end;
+        return (int)segments.size() - 1;
+    }
+    
+    // Reserves up to length bytes of the segment for writing. Returns how many
+    // may be written at pos; 0 means the range is finished (or was stolen).
+    size_t reserve(int index, size_t length, size_t& pos) {
+        std::lock_guard<std::mutex> lock(mutex);
+        Segment& seg = segments[index];
+        size_t allowed = std::min(length, seg.end - seg.next);
+        pos = seg.next;
+        seg.next += allowed;
+        return allowed;
+    }
+    
+    size_t remaining(int index) {
+        std::lock_guard<std::mutex> lock(mutex);
+        return segments[index].end - segments[index].next;
+    }
+    
+    void commit(int index, size_t length) {
+        std::lock_guard<std::mutex> lock(mutex);
+        segments[index].written += length;
+        completedBytes += length;
+    }
+    
+    // Gives the segment back; anything reserved but not committed is re-fetched.
+    void release(int index) {
+        std::lock_guard<std::mutex> lock(mutex);
+        segments[index].active = false;
+        segments[index].next = segments[index].written;
+    }
+    
+    std::vector<std::pair<size_t, size_t>> pendingRanges() {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<std::pair<size_t, size_t>> pending;
+        for (const auto& seg : segments) {
+            if (seg.written < seg.end) pending.push_back({seg.written, seg.end});
+        }
+        return pending;
+    }
+    
+    size_t completed() const { return completedBytes; }
+};
+
+std::string toHex(const unsigned char* data, size_t length) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(length * 2, '0');
+    for (size_t i = 0; i < length; i++) {
+        hex[2 * i] = digits[data[i] >> 4];
+        hex[2 * i + 1] = digits[data[i] & 0xF];
+    }
+    return hex;
+}
+
+struct ManifestChunk {
+    size_t offset;
+    uint32_t length;
+    std::string hash;  // Hex SHA-256
+};
+
+// Local chunk store. Instead of keeping a second copy of every chunk, it
+// records where each chunk of a finished deduplicated download lives (file and
+// offset), keyed by SHA-256. Locations are only hints: the bytes are hashed
+// again before reuse, so chunks of files edited or deleted since just miss.
+// Stored as .chunks/index, one "hash offset length path" line per chunk.
+class ChunkIndex {
+public:
+    struct Location {
+        std::string path;
+        size_t offset;
+        uint32_t length;
+    };
+    
+private:
+    std::mutex mutex;
+    std::unordered_map<std::string, Location> chunks;
+    bool loaded = false;
+    
+    static std::string indexPath() {
+        return (fs::path(CHUNK_STORE_DIR) / "index").string();
+    }
+    
+    void loadLocked() {
+        if (loaded) return;
+        loaded = true;
+        
+        std::ifstream file(indexPath());
+        if (!file) return;
+        
+        size_t lines = 0;
+        std::string line;
+        while (std::getline(file, line)) {
+            std::istringstream fields(line);
+            std::string hash;
+            Location location;
+            if (!(fields >> hash >> location.offset >> location.length)) continue;
+            std::getline(fields >> std::ws, location.path);
+            if (location.path.empty()) continue;
+            chunks[hash] = location;  // Later lines win
+            lines++;
+        }
+        
+        // Drop superseded lines once they make up most of the file
+        if (lines > 2 * chunks.size() + 1024) {
+            std::ofstream out(indexPath(), std::ios::trunc);
+            for (const auto& pair : chunks) {
+                out << pair.first << " " << pair.second.offset << " " << pair.second.length
+                    << " " << pair.second.path << "\n";
+            }
+        }
+    }
+    
+public:
+    bool find(const std::string& hash, Location& location) {
+        std::lock_guard<std::mutex> lock(mutex);
+        loadLocked();
+        auto it = chunks.find(hash);
+        if (it == chunks.end()) return false;
+        location = it->second;
+        return true;
+    }
+    
+    // Records every chunk of a completed file.
+    void add(const std::string& path, const std::vector<ManifestChunk>& manifest) {
+        std::lock_guard<std::mutex> lock(mutex);
+        loadLocked();
+        
+        std::ofstream out(indexPath(), std::ios::app);
+        for (const auto& chunk : manifest) {
+            chunks[chunk.hash] = {path, chunk.offset, chunk.length};
+            out << chunk.hash << " " << chunk.offset << " " << chunk.length << " " << path << "\n";
+        }
+    }
+};
+
+#ifdef TCP_FASTOPEN
+// Connects through ConnectEx with TCP_FASTOPEN set, so the request rides on
+// the SYN once the server has handed out a Fast Open cookie (and is sent
+// right after the handshake otherwise). Returns 1 when connected with the
+// request sent, 0 when ConnectEx is unavailable (the socket is still fresh)
+// and -1 on failure or timeout.
+int fastOpenConnect(SOCKET sock, const sockaddr_in& serverAddr, DWORD timeoutMs,
+                    const std::string& request) {
+    GUID connectExId = WSAID_CONNECTEX;
+    LPFN_CONNECTEX connectEx = nullptr;
+    DWORD bytes = 0;
+    if (WSAIoctl(sock, SIO_GET_EXTENSION_FUNCTION_POINTER, &connectExId, sizeof(connectExId),
+                 &connectEx, sizeof(connectEx), &bytes, nullptr, nullptr) == SOCKET_ERROR || !connectEx) {
+        return 0;
+    }
+    
+    DWORD fastOpen = 1;
+    if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, (char*)&fastOpen, sizeof(fastOpen)) == SOCKET_ERROR) {
+        return 0;
+    }
+    
+    // ConnectEx requires a bound socket
+    sockaddr_in local = {};
+    local.sin_family = AF_INET;
+    local.sin_addr.s_addr = INADDR_ANY;
+    local.sin_port = 0;
+    if (bind(sock, (sockaddr*)&local, sizeof(local)) == SOCKET_ERROR) return -1;
+    
+    WSAOVERLAPPED overlapped = {};
+    overlapped.hEvent = WSACreateEvent();
+    if (overlapped.hEvent == WSA_INVALID_EVENT) return -1;
+    
+    DWORD sent = 0;
+    bool connected = connectEx(sock, (sockaddr*)&serverAddr, sizeof(serverAddr),
+                               (void*)request.data(), (DWORD)request.size(), &sent, &overlapped) == TRUE;
+    if (!connected && WSAGetLastError() == ERROR_IO_PENDING) {
+        if (WaitForSingleObject(overlapped.hEvent, timeoutMs) == WAIT_OBJECT_0) {
+            DWORD flags = 0;
+            connected = WSAGetOverlappedResult(sock, &overlapped, &sent, FALSE, &flags) == TRUE;
+        } else {
+            // Cancels the connect; the OVERLAPPED must outlive its completion
+            closesocket(sock);
+            WaitForSingleObject(overlapped.hEvent, INFINITE);
+            WSACloseEvent(overlapped.hEvent);
+            return -2;
+        }
+    }
+    WSACloseEvent(overlapped.hEvent);
+    if (!connected) return -1;
+    
+    // Makes getpeername/shutdown and friends work on the connected socket
+    setsockopt(sock, SOL_SOCKET, SO_UPDATE_CONNECT_CONTEXT, nullptr, 0);
+    if (sent < request.size() && !sendAll(sock, request.data() + sent, request.size() - sent)) return -1;
+    return 1;
+}
+#endif
+
+// Connects to ip:port, giving up after timeoutMs. When a request is given and
+// TCP Fast Open is available it is sent as part of connecting and sent is
+// set; otherwise the caller sends it.
+SOCKET dialServer(const std::string& ip, int port, DWORD timeoutMs, const std::string& request, bool& sent) {
+    sent = false;
+    sockaddr_in serverAddr = {};
+    serverAddr.sin_family = AF_INET;
+    serverAddr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip.c_str(), &serverAddr.sin_addr) <= 0) return INVALID_SOCKET;
+    
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+    
+#ifdef TCP_FASTOPEN
+    if (!request.empty()) {
+        int result = fastOpenConnect(sock, serverAddr, timeoutMs, request);
+        if (result == 1) {
+            sent = true;
+            return sock;
+        }
+        if (result < 0) {
+            if (result == -1) closesocket(sock);
+            return INVALID_SOCKET;
+        }
+    }
+#endif
+    
+    // Non-blocking connect so the timeout applies to the handshake itself
+    u_long nonBlocking = 1;
+    ioctlsocket(sock, FIONBIO, &nonBlocking);
+    bool connected = (connect(sock, (sockaddr*)&serverAddr, sizeof(serverAddr)) == 0);
+    if (!connected && WSAGetLastError() == WSAEWOULDBLOCK) {
+        fd_set writable, failed;
+        FD_ZERO(&writable);
+        FD_ZERO(&failed);
+        FD_SET(sock, &writable);
+        FD_SET(sock, &failed);
+        timeval timeout = { (long)(timeoutMs / 1000), (long)(timeoutMs % 1000) * 1000 };
+        if (select((int)sock + 1, nullptr, &writable, &failed, &timeout) > 0 && FD_ISSET(sock, &writable)) {
+            int error = 0;
+            int length = sizeof(error);
+            connected = (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&error, &length) == 0 && error == 0);
+        }
+    }
+    nonBlocking = 0;
+    ioctlsocket(sock, FIONBIO, &nonBlocking);
+    
+    if (!connected) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+// Idle keep-alive connections per server. Servers keep a connection open
+// after a '\n'-terminated request whose reply has a known length, so handing
+// it back here lets the next request skip the handshake. A background thread
+// dials ahead of need when asked to prewarm a server.
+class ConnectionPool {
+private:
+    struct IdleConnection {
+        SOCKET sock;
+        std::chrono::steady_clock::time_point since;
+    };
+    
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::map<std::string, std::vector<IdleConnection>> idle;
+    std::deque<std::pair<std::string, int>> dialQueue;
+    std::thread dialer;
+    bool stopping = false;
+    
+    static std::string key(const std::string& ip, int port) {
+        return ip + ":" + std::to_string(port);
+    }
+    
+    // An idle connection should have nothing to read; if it is readable the
+    // server has closed it (or sent something it should not have).
+    static bool healthy(SOCKET sock) {
+        fd_set readable;
+        FD_ZERO(&readable);
+        FD_SET(sock, &readable);
+        timeval timeout = { 0, 0 };
+        return select((int)sock + 1, &readable, nullptr, nullptr, &timeout) == 0;
+    }
+    
+    void dialLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            wake.wait(lock, [this] { return stopping || !dialQueue.empty(); });
+            if (stopping) return;
+            
+            auto target = dialQueue.front();
+            dialQueue.pop_front();
+            lock.unlock();
+            bool sent;
+            SOCKET sock = dialServer(target.first, target.second, CONNECT_TIMEOUT_MS, "", sent);
+            if (sock != INVALID_SOCKET) give(target.first, target.second, sock);
+            lock.lock();
+        }
+    }
+    
+public:
+    ConnectionPool() : dialer(&ConnectionPool::dialLoop, this) {}
+    ~ConnectionPool() { shutdown(); }
+    
+    // A healthy idle connection to ip:port, or INVALID_SOCKET.
+    SOCKET take(const std::string& ip, int port) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = idle.find(key(ip, port));
+        if (it == idle.end()) return INVALID_SOCKET;
+        
+        auto now = std::chrono::steady_clock::now();
+        while (!it->second.empty()) {
+            IdleConnection connection = it->second.back();
+            it->second.pop_back();
+            if (now - connection.since < std::chrono::seconds(POOL_IDLE_SECONDS) && healthy(connection.sock)) {
+                return connection.sock;
+            }
+            closesocket(connection.sock);
+        }
+        return INVALID_SOCKET;
+    }
+    
+    // Hands back a connection whose last reply was read completely.
+    void give(const std::string& ip, int port, SOCKET sock) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& connections = idle[key(ip, port)];
+        if (stopping || connections.size() >= POOL_MAX_IDLE) {
+            closesocket(sock);
+            return;
+        }
+        connections.push_back({sock, std::chrono::steady_clock::now()});
+    }
+    
+    // Dials in the background until ip:port has count idle connections.
+    void prewarm(const std::string& ip, int port, int count) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = idle.find(key(ip, port));
+        int available = (it == idle.end()) ? 0 : (int)it->second.size();
+        for (const auto& target : dialQueue) {
+            if (target.first == ip && target.second == port) available++;
+        }
+        for (; available < count; available++) dialQueue.push_back({ip, port});
+        wake.notify_one();
+    }
+    
+    // Stops the dialer and closes every idle connection; called before
+    // WSACleanup.
+    void shutdown() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            dialQueue.clear();
+        }
+        wake.notify_one();
+        if (dialer.joinable()) dialer.join();
+        
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto& pair : idle) {
+            for (const auto& connection : pair.second) closesocket(connection.sock);
+        }
+        idle.clear();
+    }
+};
+
+// One server holding a copy of the file being downloaded. Swarm downloads
+// match copies across servers by SHA-256, so the name may differ per server.
+struct Source {
+    std::string ip;
+    int port;
+    std::string filename;
+    std::atomic<size_t> received{0};
+    
+    Source(const std::string& host, int p, const std::string& name)
+        : ip(host), port(p), filename(name) {}
+};
+
+typedef std::vector<std::unique_ptr<Source>> SourceList;
+
+// One LISTB response: a page of the catalog or the changes since a version.
+struct CatalogBatch {
+    uint64_t version = 0;
+    std::vector<FileEntry> entries;
+    std::vector<std::string> removed;
+    bool more = false;
+};
+
+enum CatalogStatus {
+    CATALOG_OK,
+    CATALOG_RESYNC,         // Server no longer has the changes since our version
+    CATALOG_UNSUPPORTED     // No answer or a server without LISTB
+};
+
+class FileClient {
+private:
+    WSADATA wsaData;
+    bool wsaInitialized;
+    std::string serverIP;
+    int serverPort;
+    std::vector<FileEntry> availableFiles;
+    std::string catalogSource;          // Server availableFiles was listed from
+    uint64_t catalogVersion = 0;        // Its catalog version at that point
+    ClientConfig config;
+    Tracer tracer;
+    ChunkIndex chunkIndex;
+    std::mutex peerMutex;
+    bool peersLoaded = false;
+    std::map<std::string, std::vector<FileEntry>> peerCatalogs;
+    ConnectionPool pool;
+    std::atomic<bool> compressionNoticeShown{false};
+    
+    std::string calculateSHA256(const std::string& filepath, size_t maxBytes = 0) {
+        std::ifstream file(filepath, std::ios::binary);
+        if (!file) return "";
+        
+        EVP_MD_CTX* context = EVP_MD_CTX_new();
+        if (!context) return "";
+        
+        if (EVP_DigestInit_ex(context, EVP_sha256(), nullptr) != 1) {
+            EVP_MD_CTX_free(context);
+            return "";
+        }
+        
+        char buffer[CHUNK_SIZE];
+        size_t bytesProcessed = 0;
+        
+        while (file.read(buffer, CHUNK_SIZE) || file.gcount() > 0) {
+            size_t toProcess = file.gcount();
+            
+            if (maxBytes > 0) {
+                if (bytesProcessed + toProcess > maxBytes) {
+                    toProcess = maxBytes - bytesProcessed;
+                }
+            }
+            
+            if (EVP_DigestUpdate(context, buffer, toProcess) != 1) {
+                EVP_MD_CTX_free(context);
+                return "";
+            }
+            
+            bytesProcessed += toProcess;
+            
+            if (maxBytes > 0 && bytesProcessed >= maxBytes) {
+                break;
+            }
+        }
+        
+        unsigned char hash[EVP_MAX_MD_SIZE];
+        unsigned int hashLen;
+        
+        if (EVP_DigestFinal_ex(context, hash, &hashLen) != 1) {
+            EVP_MD_CTX_free(context);
+            return "";
+        }
+        
+        EVP_MD_CTX_free(context);
+        
+        std::stringstream ss;
+        for (unsigned int i = 0; i < hashLen; i++) {
+            ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+        }
+        
+        return ss.str();
+    }
+    
+    size_t getFileSize(const std::string& filepath) const {
+        std::ifstream file(filepath, std::ios::binary | std::ios::ate);
+        if (!file) return 0;
+        return file.tellg();
+    }
+    
+    void showProgress(size_t current, size_t total, std::chrono::steady_clock::time_point startTime) {
+        if (activeReport) {
+            activeReport->received = current;
+            activeReport->total = total;
+            return;
+        }
+        
+        double percent = (total > 0) ? (100.0 * current / total) : 0;
+        
+        auto now = std::chrono::steady_clock::now();
+        auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(now - startTime).count();
+        
+        double speed = (elapsed > 0) ? (current / (1024.0 * 1024.0 * elapsed)) : 0;
+        
+        int barWidth = 40;
+        int pos = (int)(barWidth * current / total);
+        
+        std::cout << "\r[";
+        for (int i = 0; i < barWidth; ++i) {
+            if (i < pos) std::cout << "=";
+            else if (i == pos) std::cout << ">";
+            else std::cout << " ";
+        }
+        std::cout << "] " << std::fixed << std::setprecision(1) << percent << "% "
+                  << std::setprecision(2) << speed << " MB/s " << std::flush;
+    }
+    
+    static std::string lastLine(const std::string& text) {
+        std::istringstream lines(text);
+        std::string line, last;
+        while (std::getline(lines, line)) {
+            line.erase(line.find_last_not_of(" \r\t") + 1);
+            if (!line.empty()) last = line;
+        }
+        return last;
+    }
+    
+    std::string formatSize(size_t bytes) {
+        std::stringstream ss;
+        if (bytes < 1024) {
+            ss << bytes << " B";
+        } else if (bytes < 1024 * 1024) {
+            ss << std::fixed << std::setprecision(2) << (bytes / 1024.0) << " KB";
+        } else if (bytes < 1024 * 1024 * 1024) {
+            ss << std::fixed << std::setprecision(2) << (bytes / (1024.0 * 1024.0)) << " MB";
+        } else {
+            ss << std::fixed << std::setprecision(2) << (bytes / (1024.0 * 1024.0 * 1024.0)) << " GB";
+        }
+        return ss.str();
+    }
+    
+    // Sends request on a pooled connection to ip:port, or on a new one (with
+    // TCP Fast Open where available), and reads the response header line.
+    // A pooled connection the server closed in the meantime is replaced by a
+    // fresh one once. recvTimeoutMs applies to every later read (0 = none).
+    // Hand the socket back with releaseConnection only after reading the
+    // whole reply; otherwise close it.
+    SOCKET openRequest(const std::string& ip, int port, const std::string& request,
+                       std::string& header, DWORD recvTimeoutMs = 0) {
+        for (int attempt = 0; attempt < 2; attempt++) {
+            SOCKET sock = (attempt == 0) ? pool.take(ip, port) : INVALID_SOCKET;
+            bool reused = (sock != INVALID_SOCKET);
+            bool sent = false;
+            if (!reused) sock = dialServer(ip, port, CONNECT_TIMEOUT_MS, request, sent);
+            if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+            
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&recvTimeoutMs, sizeof(recvTimeoutMs));
+            if ((sent || sendAll(sock, request.data(), request.size())) && recvLine(sock, header)) {
+                return sock;
+            }
+            closesocket(sock);
+            if (!reused) break;
+        }
+        return INVALID_SOCKET;
+    }
+    
+    void releaseConnection(const std::string& ip, int port, SOCKET sock) {
+        pool.give(ip, port, sock);
+    }
+    
+    const FileEntry* findEntry(const std::string& filename) const {
+        for (const auto& file : availableFiles) {
+            if (file.filename == filename) return &file;
+        }
+        return nullptr;
+    }
+    
+    // Fetches one claimed range over its own connection, writing it at its
+    // offset through the shared writer. Returns false if the connection failed
+    // before the range was done. rate is set to the throughput achieved.
+    bool fetchSegment(Source& source, SegmentScheduler& scheduler, int index,
+                      size_t start, size_t end, DiskWriter& writer, double& rate) {
+        std::stringstream request;
+        request << "GET " << source.filename << " OFFSET " << start << " LENGTH " << (end - start) << "\n";
+        
+        // A stalled source must not hold its worker forever once the range
+        // has been handed to someone else
+        std::string response;
+        SOCKET sock;
+        {
+            TraceSpan span("request");
+            sock = openRequest(source.ip, source.port, request.str(), response, SEGMENT_RECV_TIMEOUT_MS);
+        }
+        if (sock == INVALID_SOCKET) return false;
+        if (response.find("OK:") != 0 || response.find(":RAW") == std::string::npos) {
+            closesocket(sock);
+            return false;
+        }
+        
+        DiskWriter::Stream stream(writer, start, [&scheduler, index](size_t length) {
+            scheduler.commit(index, length);
+        });
+        
+        auto started = std::chrono::steady_clock::now();
+        size_t fetched = 0;
+        size_t received = 0;
+        bool finished = false;
+        while (!finished && writer.ok()) {
+            size_t available;
+            char* out = stream.buffer(available);
+            TraceSpan recvSpan("recv");
+            int n = recv(sock, out, (int)available, 0);
+            if (n <= 0) break;
+            recvSpan.arg("bytes", n);
+            recvSpan.end();
+            received += n;
+            
+            size_t pos;
+            size_t allowed = scheduler.reserve(index, n, pos);
+            stream.commit(allowed);
+            fetched += allowed;
+            source.received += allowed;
+            finished = (scheduler.remaining(index) == 0);
+        }
+        
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        if (seconds > 0 && fetched > 0) rate = fetched / seconds;
+        
+        // A range cut short by a takeover leaves the rest of the reply unread
+        if (received == end - start) {
+            releaseConnection(source.ip, source.port, sock);
+        } else {
+            closesocket(sock);
+        }
+        stream.sync();
+        return finished;
+    }
+    
+    void segmentWorker(Source& source, SegmentScheduler& scheduler, DiskWriter& writer) {
+        int failures = 0;
+        double rate = 0;
+        
+        while (failures <= SEGMENT_RETRIES && writer.ok()) {
+            size_t start, end;
+            int index = scheduler.claim(start, end, rate);
+            if (index < 0) break;
+            
+            if (!fetchSegment(source, scheduler, index, start, end, writer, rate)) {
+                failures++;
+            }
+            scheduler.release(index);
+        }
+    }
+    
+    int maxSegmentWorkers() const {
+        int initialWorkers = (config.segments <= 0) ? 2 : config.segments;
+        return std::max(initialWorkers, config.maxSegments);
+    }
+    
+    // Fetches everything the scheduler still has pending over parallel ranged
+    // GETs, spread over every source. With segments=0 each source starts with
+    // two connections and more are added while aggregate throughput keeps
+    // improving, up to max_segments per source. Returns the number of
+    // connections used.
+    int runSegmentWorkers(SourceList& sources, SegmentScheduler& scheduler,
+                          DiskWriter& writer, size_t totalSize) {
+        bool autoTune = (config.segments <= 0);
+        int initialWorkers = autoTune ? 2 : config.segments;
+        int maxWorkers = maxSegmentWorkers() * (int)sources.size();
+        
+        std::vector<std::thread> workers;
+        std::atomic<int> liveWorkers(0);
+        Tracer::Handle trace = Tracer::current();
+        auto spawnWorker = [&]() {
+            Source* source = sources[workers.size() % sources.size()].get();
+            liveWorkers++;
+            workers.emplace_back([&, source]() {
+                TraceLane lane(trace);
+                segmentWorker(*source, scheduler, writer);
+                liveWorkers--;
+            });
+        };
+        for (int i = 0; i < initialWorkers * (int)sources.size(); i++) spawnWorker();
+        
+        auto startTime = std::chrono::steady_clock::now();
+        auto lastCheck = startTime;
+        size_t lastBytes = scheduler.completed();
+        double bestRate = 0;
+        
+        while (liveWorkers > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            showProgress(scheduler.completed(), totalSize, startTime);
+            
+            auto now = std::chrono::steady_clock::now();
+            double interval = std::chrono::duration<double>(now - lastCheck).count();
+            if (interval < 2.0) continue;
+            
+            size_t done = scheduler.completed();
+            double rate = (done - lastBytes) / interval;
+            
+            // Additive increase while each extra connection still buys >10%
+            if (autoTune && (int)workers.size() < maxWorkers && totalSize - done > 2 * MIN_SEGMENT_SPLIT) {
+                if (rate > bestRate * 1.1) {
+                    bestRate = rate;
+                    spawnWorker();
+                } else {
+                    autoTune = false;
+                }
+            }
+            
+            lastCheck = now;
+            lastBytes = done;
+        }
+        
+        for (auto& worker : workers) worker.join();
+        showProgress(scheduler.completed(), totalSize, startTime);
+        
+        if (sources.size() > 1) {
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+            status() << "\n";
+            for (const auto& source : sources) {
+                status() << "  " << source->ip << ":" << source->port << "  "
+                          << formatSize(source->received) << " ("
+                          << formatSize((size_t)(source->received / std::max(seconds, 0.001))) << "/s)\n";
+            }
+        }
+        return (int)workers.size();
+    }
+    
+    // Deduped, segmented and swarm downloads fetch RAW ranges, so they are
+    // only used with compression off. Says so once, the first time it matters.
+    void noteCompressionLimits(std::ostream& out) {
+        if (compressionNoticeShown.exchange(true)) return;
+        out << ANSI_YELLOW << "Note: Compression is on, so segmented, swarm and deduplicated downloads are off.\n"
+            << ANSI_RESET;
+    }
+    
+    bool shouldSegment(const FileEntry* entry) const {
+        return entry && (config.segments != 1 || !config.activePeers().empty()) &&
+               entry->filesize >= SEGMENT_THRESHOLD;
+    }
+    
+    // Splits the file into ranges fetched over several connections at once.
+    bool downloadSegmented(const FileEntry& entry, const std::string& savePath, bool resume) {
+        const std::string& filename = entry.filename;
+        size_t totalSize = entry.filesize;
+        
+        ResumeInfo resumeInfo;
+        std::vector<std::pair<size_t, size_t>> pending;
+        
+        if (resume && fs::exists(savePath) && resumeInfo.load(savePath) &&
+            resumeInfo.filename == filename && resumeInfo.serverIP == serverIP &&
+            resumeInfo.serverPort == serverPort && resumeInfo.totalSize == totalSize &&
+            resumeInfo.expectedHash == entry.sha256) {
+            // Completed blocks past the prefix only exist in a preallocated file
+            size_t onDisk = getFileSize(savePath);
+            if (onDisk == totalSize) {
+                pending = resumeInfo.pendingRanges();
+            } else if (onDisk >= resumeInfo.bytesDownloaded) {
+                pending.push_back({resumeInfo.bytesDownloaded, totalSize});
+            }
+        }
+        
+        if (pending.empty()) {
+            try {
+                fs::remove(savePath);
+                resumeInfo.remove(savePath);
+            } catch (...) {}
+            resumeInfo = ResumeInfo();
+            pending.push_back({0, totalSize});
+        } else {
+            size_t left = 0;
+            for (const auto& range : pending) left += range.second - range.first;
+            status() << "\nFound partial download (" << formatSize(totalSize - left) << ")\n";
+            status() << "Resuming " << pending.size() << " segment(s), "
+                      << formatSize(left) << " remaining...\n";
+        }
+        
+        try {
+            { std::ofstream create(savePath, std::ios::binary | std::ios::app); }
+            fs::resize_file(savePath, totalSize);
+        } catch (...) {
+            errors() << "ERROR: Cannot create file\n";
+            markPermanentFailure();
+            return false;
+        }
+        
+        resumeInfo.filename = filename;
+        resumeInfo.expectedHash = entry.sha256;
+        resumeInfo.totalSize = totalSize;
+        resumeInfo.serverIP = serverIP;
+        resumeInfo.serverPort = serverPort;
+        
+        SegmentScheduler scheduler(pending, totalSize, MIN_SEGMENT_SPLIT);
+        SourceList sources = findSources(entry);
+        
+        ResumeJournal journal(resumeInfo, config.checkpointInterval, config.checkpointMB);
+        bool journaled = journal.begin(savePath);
+        if (!journaled) {
+            errors() << ANSI_YELLOW << "WARNING: Cannot write resume journal\n" << ANSI_RESET;
+        }
+        
+        // Every worker holds one block while filling it, so size the pool past that
+        DiskWriter writer(std::max(config.writeBuffers, maxSegmentWorkers() * (int)sources.size() + 2),
+                          parseDurability(config.durability), config.flushInterval);
+        if (!writer.open(savePath, false)) {
+            errors() << "ERROR: Cannot create file\n";
+            markPermanentFailure();
+            return false;
+        }
+        writer.preallocate(totalSize);
+        if (journaled) writer.attachJournal(&journal);
+        
+        status() << "\nDownloading " << filename << " in segments";
+        if (sources.size() > 1) status() << " from " << sources.size() << " sources";
+        status() << "...\n";
+        int connections = runSegmentWorkers(sources, scheduler, writer, totalSize);
+        writer.close();
+        status() << "\n";
+        
+        // The writer already recorded the final checkpoint when it closed
+        if (scheduler.completed() < totalSize) {
+            errors() << ANSI_YELLOW << "WARNING: Download incomplete ("
+                      << formatSize(totalSize - scheduler.completed()) << " remaining)\n" << ANSI_RESET;
+            status() << "Partial file saved. Run download again to resume.\n";
+            return false;
+        }
+        
+        status() << "Used " << connections << " connection(s)\n";
+        
+        if (!entry.sha256.empty() && !verifyChecksum(savePath, entry.sha256)) {
+            status() << ANSI_YELLOW << "WARNING: Checksum mismatch! File may be corrupted.\n" << ANSI_RESET;
+            journal.discard();
+            try {
+                fs::remove(savePath);
+            } catch (...) {}
+            return false;
+        }
+        
+        journal.discard();
+        return true;
+    }
+    
+    bool shouldDedupe(const FileEntry* entry, const std::string& savePath, bool resume) const {
+        if (!entry || !config.chunkDedupe) return false;
+        if (resume && fs::exists(ResumeInfo::journalPath(savePath))) return false;
+        return entry->filesize >= DEDUPE_THRESHOLD;
+    }
+    
+    // Fetches the server's chunk list for a file. Fails on servers that do not
+    // chunk, in which case the caller downloads normally.
+    bool fetchManifest(const FileEntry& entry, std::vector<ManifestChunk>& manifest) {
+        std::string response;
+        SOCKET sock = openRequest(serverIP, serverPort, "MANIFEST " + entry.filename + "\n", response);
+        if (sock == INVALID_SOCKET) return false;
+        if (response.find("OK:") != 0 ||
+            response.find(":MANIFEST") == std::string::npos) {
+            closesocket(sock);
+            return false;
+        }
+        
+        size_t count = 0;
+        try {
+            count = std::stoull(response.substr(3));
+        } catch (...) {
+            closesocket(sock);
+            return false;
+        }
+        
+        const size_t entrySize = sizeof(uint32_t) + SHA256_DIGEST_LENGTH;
+        if (count == 0 || count > entry.filesize) {
+            closesocket(sock);
+            return false;
+        }
+        
+        std::vector<unsigned char> data(count * entrySize);
+        if (!recvAll(sock, (char*)data.data(), data.size())) {
+            closesocket(sock);
+            return false;
+        }
+        releaseConnection(serverIP, serverPort, sock);
+        
+        manifest.clear();
+        manifest.reserve(count);
+        size_t offset = 0;
+        for (size_t i = 0; i < count; i++) {
+            const unsigned char* item = data.data() + i * entrySize;
+            ManifestChunk chunk;
+            std::memcpy(&chunk.length, item, sizeof(chunk.length));
+            chunk.offset = offset;
+            chunk.hash = toHex(item + sizeof(uint32_t), SHA256_DIGEST_LENGTH);
+            offset += chunk.length;
+            manifest.push_back(chunk);
+        }
+        return offset == entry.filesize;
+    }
+    
+    // Builds the file from chunks already present in earlier downloads and
+    // fetches only the missing ranges, over parallel connections as with
+    // segmented downloads. The resume journal covers both, so an interrupted
+    // run resumes through the regular resume path.
+    bool downloadDeduped(const FileEntry& entry, const std::string& savePath,
+                         const std::vector<ManifestChunk>& manifest) {
+        const std::string& filename = entry.filename;
+        size_t totalSize = entry.filesize;
+        std::string targetPath = fs::absolute(savePath).string();
+        
+        try {
+            fs::remove(savePath);
+            { std::ofstream create(savePath, std::ios::binary); }
+            fs::resize_file(savePath, totalSize);
+        } catch (...) {
+            errors() << "ERROR: Cannot create file\n";
+            markPermanentFailure();
+            return false;
+        }
+        
+        ResumeInfo resumeInfo;
+        resumeInfo.filename = filename;
+        resumeInfo.expectedHash = entry.sha256;
+        resumeInfo.totalSize = totalSize;
+        resumeInfo.serverIP = serverIP;
+        resumeInfo.serverPort = serverPort;
+        
+        SourceList sources = findSources(entry);
+        ResumeJournal journal(resumeInfo, config.checkpointInterval, config.checkpointMB);
+        bool journaled = journal.begin(savePath);
+        
+        DiskWriter writer(std::max(config.writeBuffers, maxSegmentWorkers() * (int)sources.size() + 2),
+                          parseDurability(config.durability), config.flushInterval);
+        if (!writer.open(savePath, false)) {
+            errors() << "ERROR: Cannot create file\n";
+            markPermanentFailure();
+            return false;
+        }
+        writer.preallocate(totalSize);
+        if (journaled) writer.attachJournal(&journal);
+        
+        status() << "\nChecking local chunk store for " << filename << " ("
+                  << manifest.size() << " chunks)...\n";
+        
+        std::vector<std::pair<size_t, size_t>> pending;
+        size_t reusedBytes = 0;
+        size_t reusedChunks = 0;
+        {
+            std::unique_ptr<DiskWriter::Stream> run;
+            size_t runEnd = 0;
+            std::ifstream source;
+            std::string sourcePath;
+            std::vector<char> data;
+            
+            for (const auto& chunk : manifest) {
+                ChunkIndex::Location location;
+                bool reused = false;
+                
+                if (chunkIndex.find(chunk.hash, location) && location.length == chunk.length &&
+                    location.path != targetPath) {
+                    if (location.path != sourcePath) {
+                        source.close();
+                        source.clear();
+                        source.open(location.path, std::ios::binary);
+                        sourcePath = location.path;
+                    }
+                    
+                    data.resize(chunk.length);
+                    source.clear();
+                    source.seekg((std::streamoff)location.offset);
+                    unsigned char digest[SHA256_DIGEST_LENGTH];
+                    if (source.read(data.data(), chunk.length) &&
+                        SHA256((const unsigned char*)data.data(), chunk.length, digest) &&
+                        toHex(digest, sizeof(digest)) == chunk.hash) {
+                        if (!run || runEnd != chunk.offset) {
+                            run.reset();
+                            run.reset(new DiskWriter::Stream(writer, chunk.offset));
+                        }
+                        size_t copied = 0;
+                        while (copied < chunk.length) {
+                            size_t available;
+                            char* out = run->buffer(available);
+                            size_t part = std::min(available, chunk.length - copied);
+                            std::memcpy(out, data.data() + copied, part);
+                            run->commit(part);
+                            copied += part;
+                        }
+                        runEnd = chunk.offset + chunk.length;
+                        reused = true;
+                    }
+                }
+                
+                if (reused) {
+                    reusedBytes += chunk.length;
+                    reusedChunks++;
+                } else if (!pending.empty() && pending.back().second == chunk.offset) {
+                    pending.back().second += chunk.length;
+                } else {
+                    pending.push_back({chunk.offset, chunk.offset + chunk.length});
+                }
+            }
+        }
+        
+        size_t fetched = totalSize - reusedBytes;
+        status() << "Reusing " << reusedChunks << "/" << manifest.size() << " chunks ("
+                  << formatSize(reusedBytes) << "), downloading " << formatSize(fetched)
+                  << " in " << pending.size() << " range(s)...\n";
+        
+        SegmentScheduler scheduler(pending, totalSize, MIN_SEGMENT_SPLIT);
+        if (!pending.empty()) {
+            runSegmentWorkers(sources, scheduler, writer, totalSize);
+            status() << "\n";
+        }
+        writer.close();
+        
+        if (scheduler.completed() < totalSize) {
+            errors() << ANSI_YELLOW << "WARNING: Download incomplete ("
+                      << formatSize(totalSize - scheduler.completed()) << " remaining)\n" << ANSI_RESET;
+            status() << "Partial file saved. Run download again to resume.\n";
+            return false;
+        }
+        
+        if (!entry.sha256.empty() && !verifyChecksum(savePath, entry.sha256)) {
+            status() << ANSI_YELLOW << "WARNING: Checksum mismatch! File may be corrupted.\n" << ANSI_RESET;
+            journal.discard();
+            try {
+                fs::remove(savePath);
+            } catch (...) {}
+            return false;
+        }
+        
+        journal.discard();
+        chunkIndex.add(targetPath, manifest);
+        
+        std::ostringstream summary;
+        summary << "Dedupe: reused " << reusedChunks << "/" << manifest.size() << " chunks, "
+                << formatSize(reusedBytes) << " saved (" << std::fixed << std::setprecision(1)
+                << (100.0 * reusedBytes / totalSize) << "%)";
+        if (fetched > 0) {
+            summary << ", dedupe ratio " << std::setprecision(2) << (double)totalSize / fetched << ":1";
+        }
+        reportSummary(summary.str());
+        return true;
+    }
+    
+    // An existing local copy with no partial download in progress is updated
+    // with DELTA instead of being downloaded again from scratch.
+    bool shouldDelta(const FileEntry* entry, const std::string& savePath, bool resume) const {
+        if (!entry || !resume || !config.deltaSync || !fs::exists(savePath)) return false;
+        if (fs::exists(ResumeInfo::journalPath(savePath))) return false;
+        size_t localSize = getFileSize(savePath);
+        uint32_t blockSize = deltaBlockSize(std::max(localSize, entry->filesize));
+        // The server refuses more signatures than its file has blocks
+        return localSize >= DELTA_MIN_BLOCK && localSize / blockSize <= deltaMaxBlocks(entry->filesize, blockSize);
+    }
+    
+    // Sends signatures of the local copy's blocks, rebuilds the current version
+    // from matched local blocks plus literal data into a temp file, verifies it
+    // and swaps it in. Falls back to a full download if the result is wrong.
+    bool downloadDelta(const FileEntry& entry, const std::string& savePath) {
+        const std::string& filename = entry.filename;
+        size_t localSize = getFileSize(savePath);
+        uint32_t blockSize = deltaBlockSize(std::max(localSize, entry.filesize));
+        uint32_t blockCount = (uint32_t)std::min<size_t>(localSize / blockSize, DELTA_MAX_BLOCKS);
+        
+        status() << "\nFound local copy of " << filename << " (" << formatSize(localSize) << ")\n";
+        status() << "Computing block signatures... " << std::flush;
+        
+        std::vector<BlockSignature> signatures(blockCount);
+        std::string localHash;
+        {
+            std::ifstream local(savePath, std::ios::binary);
+            EVP_MD_CTX* context = EVP_MD_CTX_new();
+            if (!local || !context || EVP_DigestInit_ex(context, EVP_sha256(), nullptr) != 1) {
+                if (context) EVP_MD_CTX_free(context);
+                errors() << "ERROR: Cannot read local copy\n";
+                return false;
+            }
+            
+            std::vector<char> block(blockSize);
+            for (size_t i = 0; local.read(block.data(), blockSize) || local.gcount() > 0; i++) {
+                size_t got = local.gcount();
+                EVP_DigestUpdate(context, block.data(), got);
+                if (got == blockSize && i < blockCount) {
+                    RollingChecksum rolling;
+                    rolling.init(block.data(), blockSize);
+                    signatures[i].weak = rolling.value();
+                    strongHash(block.data(), blockSize, signatures[i].strong);
+                }
+            }
+            
+            unsigned char hash[EVP_MAX_MD_SIZE];
+            unsigned int hashLen = 0;
+            EVP_DigestFinal_ex(context, hash, &hashLen);
+            EVP_MD_CTX_free(context);
+            
+            std::stringstream ss;
+            for (unsigned int i = 0; i < hashLen; i++) {
+                ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+            }
+            localHash = ss.str();
+        }
+        status() << "done\n";
+        
+        if (localSize == entry.filesize && !entry.sha256.empty() && localHash == entry.sha256) {
+            reportSummary("Local copy is already up to date");
+            return true;
+        }
+        
+        std::string request = "DELTA " + filename + " " + std::to_string(blockSize) + " " +
+                              std::to_string(blockCount) + "\n";
+        std::string response;
+        SOCKET sock = openRequest(serverIP, serverPort, request, response);
+        if (sock == INVALID_SOCKET) {
+            errors() << "ERROR: Connection failed\n";
+            return false;
+        }
+        
+        if (response.find("ERROR") == 0) {
+            closesocket(sock);
+            if (response.find("Invalid delta") != std::string::npos) {
+                // The file shrank since it was listed
+                status() << ANSI_YELLOW << "WARNING: Delta refused, downloading full file\n" << ANSI_RESET;
+                return downloadFile(filename, savePath, false);
+            }
+            errors() << "Server error: " << response;
+            if (response.find("not found") != std::string::npos) {
+                markPermanentFailure();
+            }
+            return false;
+        }
+        
+        if (response.find("OK:") != 0 || response.find(":DELTA") == std::string::npos) {
+            errors() << "ERROR: Unexpected response format\n";
+            closesocket(sock);
+            return false;
+        }
+        size_t totalSize = std::stoull(response.substr(3));
+        
+        if (!sendAll(sock, (const char*)signatures.data(), signatures.size() * sizeof(BlockSignature))) {
+            errors() << "ERROR: Failed to send block signatures\n";
+            closesocket(sock);
+            return false;
+        }
+        
+        std::string tempPath = savePath + ".delta";
+        std::ifstream basis(savePath, std::ios::binary);
+        DiskWriter writer(config.writeBuffers, parseDurability(config.durability), config.flushInterval);
+        if (!basis || !writer.open(tempPath, true)) {
+            errors() << "ERROR: Cannot create file\n";
+            markPermanentFailure();
+            closesocket(sock);
+            return false;
+        }
+        writer.preallocate(totalSize);
+        
+        status() << "Updating " << filename << " with delta transfer...\n";
+        
+        auto startTime = std::chrono::steady_clock::now();
+        size_t written = 0;
+        size_t literalBytes = 0;
+        bool finished = false;
+        bool corrupt = false;
+        
+        {
+            DiskWriter::Stream stream(writer, 0);
+            
+            while (!finished && !corrupt && writer.ok()) {
+                char op;
+                if (!recvAll(sock, &op, 1)) break;
+                
+                if (op == DELTA_END) {
+                    finished = true;
+                } else if (op == DELTA_MATCH) {
+                    uint32_t run[2];
+                    if (!recvAll(sock, (char*)run, sizeof(run))) break;
+                    size_t length = (size_t)run[1] * blockSize;
+                    if ((size_t)run[0] + run[1] > blockCount || written + length > totalSize) {
+                        corrupt = true;
+                        break;
+                    }
+                    
+                    basis.seekg((std::streamoff)run[0] * blockSize);
+                    while (length > 0) {
+                        size_t available;
+                        char* out = stream.buffer(available);
+                        size_t part = std::min(available, length);
+                        if (!basis.read(out, part)) {
+                            corrupt = true;
+                            break;
+                        }
+                        stream.commit(part);
+                        written += part;
+                        length -= part;
+                    }
+                } else if (op == DELTA_LITERAL) {
+                    uint32_t length;
+                    if (!recvAll(sock, (char*)&length, sizeof(length))) break;
+                    if (length > DELTA_MAX_LITERAL || written + length > totalSize) {
+                        corrupt = true;
+                        break;
+                    }
+                    
+                    bool received = true;
+                    while (length > 0 && received) {
+                        size_t available;
+                        char* out = stream.buffer(available);
+                        size_t part = std::min(available, (size_t)length);
+                        received = recvAll(sock, out, part);
+                        if (received) {
+                            stream.commit(part);
+                            written += part;
+                            literalBytes += part;
+                            length -= (uint32_t)part;
+                        }
+                    }
+                    if (!received) break;
+                } else {
+                    corrupt = true;
+                }
+                
+                showProgress(written, totalSize, startTime);
+            }
+            
+            stream.sync();
+        }
+        
+        bool writeOk = writer.close();
+        basis.close();
+        if (finished) {
+            releaseConnection(serverIP, serverPort, sock);
+        } else {
+            closesocket(sock);
+        }
+        status() << "\n";
+        
+        if (!finished || corrupt || !writeOk || written != totalSize) {
+            try {
+                fs::remove(tempPath);
+            } catch (...) {}
+            if (corrupt) errors() << "ERROR: Invalid delta stream\n";
+            else if (!writeOk) errors() << "ERROR: Writing to disk failed\n";
+            else errors() << "ERROR: Delta transfer incomplete\n";
+            return false;
+        }
+        
+        if (!entry.sha256.empty() && !verifyChecksum(tempPath, entry.sha256)) {
+            status() << ANSI_YELLOW << "WARNING: Delta result does not match, downloading full file\n" << ANSI_RESET;
+            try {
+                fs::remove(tempPath);
+            } catch (...) {}
+            return downloadFile(filename, savePath, false);
+        }
+        
+        if (!MoveFileExA(tempPath.c_str(), savePath.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+            errors() << "ERROR: Cannot replace " << savePath << "\n";
+            return false;
+        }
+        
+        size_t transferred = literalBytes + signatures.size() * sizeof(BlockSignature);
+        std::ostringstream summary;
+        summary << "Delta sync: " << formatSize(literalBytes) << " of " << formatSize(totalSize)
+                << " downloaded, " << formatSize(totalSize - literalBytes) << " reused from local copy";
+        if (totalSize > 0 && transferred < totalSize) {
+            summary << " (" << std::fixed << std::setprecision(1)
+                    << (100.0 * (totalSize - transferred) / totalSize) << "% saved)";
+        }
+        reportSummary(summary.str());
+        return true;
+    }
+    
+public:
+    FileClient() : wsaInitialized(false), serverPort(8080) {
+        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+            std::cerr << "WSAStartup failed\n";
+        } else {
+            wsaInitialized = true;
+        }
+        
+        config.load();
+        serverIP = config.lastServer;
+        serverPort = config.lastPort;
+        if (!config.traceFile.empty() && !tracer.start(config.traceFile, config.traceSample, "client", 2)) {
+            std::cerr << "Cannot open trace file: " << config.traceFile << "\n";
+        }
+        
+        if (config.downloadFolder.empty() || config.downloadFolder == ".") {
+            config.downloadFolder = fs::current_path().string();
+        }
+        
+        try {
+            fs::create_directories(config.downloadFolder);
+            fs::create_directories(RESUME_DIR);
+            fs::create_directories(CHUNK_STORE_DIR);
+        } catch (...) {}
+    }
+    
+    ~FileClient() {
+        pool.shutdown();
+        if (wsaInitialized) {
+            WSACleanup();
+        }
+    }
+    
+    void setServer(const std::string& ip, int port) {
+        serverIP = ip;
+        serverPort = port;
         config.lastServer = ip;
         config.lastPort = port;
         config.save();
     }
     
-    bool testConnection() {
+    // Bounded by a real connect timeout; the connection is kept for the file
+    // list that usually follows.
+    bool testConnection() {
+        if (!wsaInitialized) return false;
+        
+        bool sent;
+        SOCKET sock = dialServer(serverIP, serverPort, 3000, "", sent);
+        if (sock == INVALID_SOCKET) return false;
+        releaseConnection(serverIP, serverPort, sock);
+        return true;
+    }
+    
+    // Sends one LISTB request and decodes the record stream that follows the
+    // "OK:<version>:..." header.
+    CatalogStatus requestCatalog(const std::string& ip, int port, const std::string& request,
+                                 CatalogBatch& batch) {
+        std::string header;
+        SOCKET sock = openRequest(ip, port, request + "\n", header);
+        if (sock == INVALID_SOCKET) return CATALOG_UNSUPPORTED;
+        if (header.find("RESYNC:") == 0) {
+            releaseConnection(ip, port, sock);
+            return CATALOG_RESYNC;
+        }
+        if (header.find("OK:") != 0) {
+            closesocket(sock);
+            return CATALOG_UNSUPPORTED;
+        }
+        
+        try {
+            batch.version = std::stoull(header.substr(3));
+        } catch (...) {
+            closesocket(sock);
+            return CATALOG_UNSUPPORTED;
+        }
+        
+        SocketReader reader(sock);
+        bool complete = false;
+        char type;
+        while (reader.read(&type, 1)) {
+            if (type == 'E') {
+                char more = 0;
+                complete = reader.read(&more, 1);
+                batch.more = (more != 0);
+                break;
+            }
+            if (type != 'F' && type != 'R') break;
+            
+            uint16_t nameLength = 0;
+            if (!reader.read(&nameLength, sizeof(nameLength))) break;
+            std::string name(nameLength, '\0');
+            if (!reader.read(&name[0], nameLength)) break;
+            
+            if (type == 'R') {
+                batch.removed.push_back(name);
+                continue;
+            }
+            
+            uint64_t size = 0;
+            unsigned char hashLength = 0;
+            unsigned char hash[256];
+            if (!reader.read(&size, sizeof(size)) || !reader.read(&hashLength, 1) ||
+                !reader.read(hash, hashLength)) break;
+            
+            FileEntry entry;
+            entry.filename = name;
+            entry.filesize = (size_t)size;
+            entry.sha256 = toHex(hash, hashLength);
+            batch.entries.push_back(entry);
+        }
+        if (complete) {
+            releaseConnection(ip, port, sock);
+        } else {
+            closesocket(sock);
+        }
+        return complete ? CATALOG_OK : CATALOG_UNSUPPORTED;
+    }
+    
+    // Applies a LISTB SINCE batch to a catalog kept sorted by name.
+    static void applyCatalogChanges(std::vector<FileEntry>& files, const CatalogBatch& changes) {
+        if (changes.entries.empty() && changes.removed.empty()) return;
+        
+        std::unordered_map<std::string, size_t> index;
+        for (size_t i = 0; i < files.size(); i++) index[files[i].filename] = i;
+        
+        std::vector<bool> dropped(files.size(), false);
+        for (const auto& name : changes.removed) {
+            auto it = index.find(name);
+            if (it != index.end()) dropped[it->second] = true;
+        }
+        for (const auto& entry : changes.entries) {
+            auto it = index.find(entry.filename);
+            if (it != index.end()) {
+                files[it->second] = entry;
+                dropped[it->second] = false;
+            } else {
+                index[entry.filename] = files.size();
+                files.push_back(entry);
+                dropped.push_back(false);
+            }
+        }
+        
+        size_t kept = 0;
+        for (size_t i = 0; i < files.size(); i++) {
+            if (dropped[i]) continue;
+            if (kept != i) files[kept] = std::move(files[i]);
+            kept++;
+        }
+        files.resize(kept);
+        std::sort(files.begin(), files.end(), [](const FileEntry& a, const FileEntry& b) {
+            return a.filename < b.filename;
+        });
+    }
+    
+    // Pages through the whole catalog with LISTB, then asks for the changes
+    // made since the first page so files added or removed while paging are
+    // not missed. Pages come in the server's catalog order; if the server
+    // loses track of the cursor (RESYNC) paging starts over.
+    CatalogStatus fetchPagedCatalog(const std::string& ip, int port,
+                                    std::vector<FileEntry>& files, uint64_t& version) {
+        std::vector<FileEntry> listed;
+        std::string cursor;
+        uint64_t firstVersion = 0;
+        uint64_t lastVersion = 0;
+        int restarts = 0;
+        
+        while (true) {
+            CatalogBatch page;
+            std::string request = "LISTB LIMIT 10000";
+            if (!cursor.empty()) request += " CURSOR " + cursor;
+            CatalogStatus status = requestCatalog(ip, port, request, page);
+            if (status == CATALOG_RESYNC && !cursor.empty() && restarts++ < 3) {
+                listed.clear();
+                cursor.clear();
+                continue;
+            }
+            if (status != CATALOG_OK) return status;
+            
+            if (cursor.empty()) firstVersion = page.version;
+            lastVersion = page.version;
+            for (auto& entry : page.entries) listed.push_back(std::move(entry));
+            if (!page.more || listed.empty()) break;
+            cursor = listed.back().filename;
+        }
+        
+        std::sort(listed.begin(), listed.end(), [](const FileEntry& a, const FileEntry& b) {
+            return a.filename < b.filename;
+        });
+        if (lastVersion != firstVersion) {
+            CatalogBatch changes;
+            CatalogStatus status = requestCatalog(ip, port, "LISTB SINCE " + std::to_string(firstVersion), changes);
+            if (status != CATALOG_OK) return status;
+            applyCatalogChanges(listed, changes);
+            lastVersion = changes.version;
+        }
+        
+        files = std::move(listed);
+        version = lastVersion;
+        return CATALOG_OK;
+    }
+    
+    // Catalog of any server: the paged binary listing when the server
+    // supports it, the text LIST otherwise.
+    bool fetchCatalog(const std::string& ip, int port, std::vector<FileEntry>& files) {
+        uint64_t version = 0;
+        if (fetchPagedCatalog(ip, port, files, version) == CATALOG_OK) return true;
+        return fetchTextCatalog(ip, port, files);
+    }
+    
+    // Reads a text LIST response from a server into files. The response is read
+    // until the server closes the connection, so large catalogs are not cut off.
+    bool fetchTextCatalog(const std::string& ip, int port, std::vector<FileEntry>& files) {
+        // Not newline-terminated: the text listing is read until the server closes
+        std::string response;
+        SOCKET sock = openRequest(ip, port, "LIST", response);
+        if (sock == INVALID_SOCKET) return false;
+        
+        char buffer[8192];
+        int bytesRead;
+        while ((bytesRead = recv(sock, buffer, sizeof(buffer), 0)) > 0) {
+            response.append(buffer, bytesRead);
+        }
+        closesocket(sock);
+        if (response.empty()) return false;
+        
+        files.clear();
+        std::istringstream iss(response);
+        std::string line;
+        
+        while (std::getline(iss, line)) {
+            if (line.empty() || line.find("Available files") != std::string::npos) {
+                continue;
+            }
+            
+            size_t colon1 = line.find(':');
+            size_t colon2 = line.find(':', colon1 + 1);
+            
+            if (colon1 != std::string::npos && colon2 != std::string::npos) {
+                try {
+                    FileEntry entry;
+                    entry.filename = line.substr(0, colon1);
+                    
+                    std::string sizeStr = line.substr(colon1 + 1, colon2 - colon1 - 1);
+                    entry.filesize = std::stoull(sizeStr);
+                    
+                    entry.sha256 = line.substr(colon2 + 1);
+                    entry.sha256.erase(entry.sha256.find_last_not_of(" \n\r\t") + 1);
+                    
+                    files.push_back(entry);
+                } catch (...) {
+                    continue;
+                }
+            }
+        }
+        return true;
+    }
+    
+    // The primary server plus every configured peer that lists a file with the
+    // same SHA-256 and size. Peer catalogs are fetched once per file list refresh.
+    SourceList findSources(const FileEntry& entry) {
+        SourceList sources;
+        sources.emplace_back(new Source(serverIP, serverPort, entry.filename));
+        if (config.activePeers().empty() || entry.sha256.empty()) return sources;
+        
+        std::lock_guard<std::mutex> lock(peerMutex);
+        if (!peersLoaded) {
+            peerCatalogs.clear();
+            for (const auto& peer : config.activePeers()) {
+                std::vector<FileEntry> files;
+                size_t colon = peer.rfind(':');
+                if (colon == std::string::npos) continue;
+                try {
+                    if (fetchCatalog(peer.substr(0, colon), std::stoi(peer.substr(colon + 1)), files)) {
+                        peerCatalogs[peer] = files;
+                    }
+                } catch (...) {}
+            }
+            peersLoaded = true;
+        }
+        
+        std::string primary = serverIP + ":" + std::to_string(serverPort);
+        for (const auto& pair : peerCatalogs) {
+            if (pair.first == primary) continue;
+            for (const auto& file : pair.second) {
+                if (file.sha256 == entry.sha256 && file.filesize == entry.filesize) {
+                    size_t colon = pair.first.rfind(':');
+                    sources.emplace_back(new Source(pair.first.substr(0, colon),
+                                                    std::stoi(pair.first.substr(colon + 1)),
+                                                    file.filename));
+                    break;
+                }
+            }
+        }
+        return sources;
+    }
+    
+    bool listFiles() {
         if (!wsaInitialized) return false;
         
-        SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (sock == INVALID_SOCKET) return false;
-        
-        sockaddr_in serverAddr;
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(serverPort);
-        
-        if (inet_pton(AF_INET, serverIP.c_str(), &serverAddr.sin_addr) <= 0) {
-            closesocket(sock);
-            return false;
+        {
+            std::lock_guard<std::mutex> lock(peerMutex);
+            peersLoaded = false;
         }
         
-        DWORD timeout = 3000;
-        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
-        
-        bool connected = (connect(sock, (sockaddr*)&serverAddr, sizeof(serverAddr)) != SOCKET_ERROR);
-        closesocket(sock);
+        // Browsing usually ends in a download; have its connections ready
+        pool.prewarm(serverIP, serverPort, PREDIAL_CONNECTIONS);
+        
+        // Refreshing the same server only transfers what changed since the
+        // last listing.
+        std::string source = serverIP + ":" + std::to_string(serverPort);
+        if (source == catalogSource) {
+            CatalogBatch changes;
+            CatalogStatus status = requestCatalog(serverIP, serverPort,
+                                                  "LISTB SINCE " + std::to_string(catalogVersion), changes);
+            if (status == CATALOG_OK) {
+                applyCatalogChanges(availableFiles, changes);
+                catalogVersion = changes.version;
+                return true;
+            }
+        }
         
-        return connected;
+        catalogSource.clear();
+        std::vector<FileEntry> files;
+        uint64_t version = 0;
+        if (fetchPagedCatalog(serverIP, serverPort, files, version) == CATALOG_OK) {
+            availableFiles = std::move(files);
+            catalogSource = source;
+            catalogVersion = version;
+            return true;
+        }
+        return fetchTextCatalog(serverIP, serverPort, availableFiles);
     }
     
-    bool listFiles() {
+    // Lists only the files matching one of the patterns, letting the server
+    // search its catalog instead of sending all of it. False if the server
+    // cannot search or a pattern matches more than one reply holds; the
+    // caller then lists everything and matches locally.
+    bool listMatching(const std::vector<std::string>& patterns) {
         if (!wsaInitialized) return false;
         
-        SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (sock == INVALID_SOCKET) return false;
-        
-        sockaddr_in serverAddr;
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(serverPort);
-        
-        if (inet_pton(AF_INET, serverIP.c_str(), &serverAddr.sin_addr) <= 0) {
-            closesocket(sock);
-            return false;
+        std::vector<FileEntry> files;
+        for (const auto& pattern : patterns) {
+            CatalogBatch batch;
+            if (requestCatalog(serverIP, serverPort, "LISTB LIMIT 10000 MATCH GLOB " + pattern, batch) != CATALOG_OK ||
+                batch.more) {
+                return false;
+            }
+            for (auto& entry : batch.entries) files.push_back(std::move(entry));
         }
-        
-        if (connect(sock, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-            closesocket(sock);
-            return false;
+        std::sort(files.begin(), files.end(), [](const FileEntry& a, const FileEntry& b) {
+            return a.filename < b.filename;
+        });
+        files.erase(std::unique(files.begin(), files.end(), [](const FileEntry& a, const FileEntry& b) {
+            return a.filename == b.filename;
+        }), files.end());
+        
+        // Only part of the catalog, so the next refresh lists all of it
+        availableFiles = std::move(files);
+        catalogSource.clear();
+        return true;
+    }
+    
+    // Prints the entries of a change batch and, with patterns, downloads new
+    // files that match one of them.
+    void applyWatchedChanges(const CatalogBatch& changes, const std::vector<std::string>& patterns) {
+        for (const auto& name : changes.removed) {
+            std::cout << "[WATCH] - " << name << "\n";
+        }
+        for (const auto& entry : changes.entries) {
+            std::cout << "[WATCH] + " << entry.filename << " (" << formatSize(entry.filesize) << ")\n";
+        }
+        applyCatalogChanges(availableFiles, changes);
+        catalogVersion = std::max(catalogVersion, changes.version);
+        
+        std::vector<int> queued;
+        for (const auto& entry : changes.entries) {
+            for (size_t i = 0; i < availableFiles.size(); i++) {
+                if (availableFiles[i].filename != entry.filename) continue;
+                for (const auto& pattern : patterns) {
+                    if (globMatch(pattern, entry.filename)) {
+                        queued.push_back((int)i);
+                        break;
+                    }
+                }
+                break;
+            }
+        }
+        if (!queued.empty()) downloadMany(queued);
+    }
+    
+    // Brings availableFiles up to date after (re)subscribing or a RESYNC.
+    bool catchUpCatalog(const std::vector<std::string>& patterns) {
+        if (!catalogSource.empty()) {
+            CatalogBatch changes;
+            if (requestCatalog(serverIP, serverPort, "LISTB SINCE " + std::to_string(catalogVersion),
+                               changes) == CATALOG_OK) {
+                applyWatchedChanges(changes, patterns);
+                return true;
+            }
         }
+        catalogSource.clear();
+        if (!listFiles()) return false;
+        std::cout << "[WATCH] Catalog reloaded: " << availableFiles.size() << " files\n";
+        return true;
+    }
+    
+    // Follows the server's catalog over a SUBSCRIBE connection instead of
+    // polling LIST. Reconnects with backoff and catches up with LISTB SINCE
+    // after every reconnect, so no change is missed. Runs until the process
+    // is stopped; returns false only if the server has no SUBSCRIBE support.
+    bool watchCatalog(const std::vector<std::string>& patterns) {
+        if (!wsaInitialized) return false;
         
-        std::string request = "LIST";
-        send(sock, request.c_str(), (int)request.length(), 0);
+        catalogSource.clear();
+        int backoff = 1;
+        bool subscribed = false;
         
-        char buffer[8192];
-        int bytesRead = recv(sock, buffer, sizeof(buffer) - 1, 0);
-        if (bytesRead > 0) {
-            buffer[bytesRead] = '\0';
-            std::string response(buffer);
-            
-            availableFiles.clear();
-            std::istringstream iss(response);
-            std::string line;
+        while (true) {
+            std::string header;
+            SOCKET sock = openRequest(serverIP, serverPort, "SUBSCRIBE\n", header);
             
-            while (std::getline(iss, line)) {
-                if (line.empty() || line.find("Available files") != std::string::npos) {
-                    continue;
+            if (header.find("OK:") != 0 || header.find(":SUBSCRIBED") == std::string::npos) {
+                if (sock != INVALID_SOCKET) closesocket(sock);
+                if (!subscribed && !header.empty() && header.find("ERROR: Too many subscribers") != 0) {
+                    std::cerr << "ERROR: Server does not support SUBSCRIBE\n";
+                    return false;
                 }
+                std::cout << "[WATCH] Server unavailable, retrying in " << backoff << "s\n";
+                std::this_thread::sleep_for(std::chrono::seconds(backoff));
+                backoff = std::min(backoff * 2, WATCH_MAX_BACKOFF_SECONDS);
+                continue;
+            }
+            
+            // Subscribed first and listed second: anything that changes in
+            // between arrives both ways, and applying it twice is harmless.
+            subscribed = true;
+            backoff = 1;
+            std::cout << "[WATCH] Subscribed to " << serverIP << ":" << serverPort << "\n";
+            if (!catchUpCatalog(patterns)) {
+                closesocket(sock);
+                continue;
+            }
+            
+            // The server pings while idle, so a silent connection is a dead one
+            DWORD timeout = WATCH_RECV_TIMEOUT_MS;
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout));
+            
+            SocketReader reader(sock);
+            std::string line;
+            while (reader.readLine(line)) {
+                std::istringstream iss(line);
+                std::string event;
+                uint64_t version = 0;
+                iss >> event >> version;
                 
-                size_t colon1 = line.find(':');
-                size_t colon2 = line.find(':', colon1 + 1);
-                
-                if (colon1 != std::string::npos && colon2 != std::string::npos) {
-                    try {
-                        FileEntry entry;
-                        entry.filename = line.substr(0, colon1);
-                        
-                        std::string sizeStr = line.substr(colon1 + 1, colon2 - colon1 - 1);
-                        entry.filesize = std::stoull(sizeStr);
-                        
-                        entry.sha256 = line.substr(colon2 + 1);
-                        entry.sha256.erase(entry.sha256.find_last_not_of(" \n\r\t") + 1);
-                        
-                        availableFiles.push_back(entry);
-                    } catch (...) {
-                        continue;
-                    }
+                if (event == "ADD") {
+                    size_t size = 0;
+                    iss >> size;
+                    std::string name;
+                    std::getline(iss >> std::ws, name);
+                    std::cout << "[WATCH] Hashing " << name << " (" << formatSize(size) << ")\n";
+                } else if (event == "HASHED") {
+                    CatalogBatch changes;
+                    FileEntry entry;
+                    iss >> entry.filesize >> entry.sha256;
+                    std::getline(iss >> std::ws, entry.filename);
+                    changes.version = version;
+                    changes.entries.push_back(entry);
+                    applyWatchedChanges(changes, patterns);
+                } else if (event == "REMOVE") {
+                    CatalogBatch changes;
+                    std::string name;
+                    std::getline(iss >> std::ws, name);
+                    changes.version = version;
+                    changes.removed.push_back(name);
+                    applyWatchedChanges(changes, patterns);
+                } else if (event == "RESYNC") {
+                    std::cout << "[WATCH] Fell behind, catching up\n";
+                    if (!catchUpCatalog(patterns)) break;
                 }
             }
-            
             closesocket(sock);
-            return true;
+            std::cout << "[WATCH] Connection lost, reconnecting\n";
         }
-        
-        closesocket(sock);
-        return false;
     }
     
-    int showFileMenu() {
+    int showFileMenu(std::vector<int>& marked) {
+        marked.clear();
         if (availableFiles.empty()) {
             std::cout << "\nNo files available. Connect to server and refresh file list.\n";
             std::cout << "Press any key to continue...";
@@ -378,6 +2817,7 @@ public:
         }
         
         Menu fileMenu("Available Files - " + serverIP + ":" + std::to_string(serverPort), 12);
+        fileMenu.enableMultiSelect();
         
         for (const auto& file : availableFiles) {
             std::string desc = formatSize(file.filesize) + " - SHA256: " + 
@@ -385,57 +2825,96 @@ public:
             fileMenu.addItem(file.filename, desc);
         }
         
-        return fileMenu.show();
+        int choice = fileMenu.show();
+        if (choice >= 0) marked = fileMenu.getChecked();
+        return choice;
+    }
+    
+    std::vector<int> matchFiles(const std::string& pattern) const {
+        std::vector<int> matches;
+        for (size_t i = 0; i < availableFiles.size(); i++) {
+            if (globMatch(pattern, availableFiles[i].filename)) matches.push_back((int)i);
+        }
+        return matches;
     }
     
     bool verifyChecksum(const std::string& filepath, const std::string& expectedHash) {
-        std::cout << "Verifying checksum... " << std::flush;
+        TraceSpan span("verifyChecksum");
+        status() << "Verifying checksum... " << std::flush;
         std::string actualHash = calculateSHA256(filepath);
         
         if (actualHash == expectedHash) {
-            std::cout << "OK\n";
+            status() << "OK\n";
             return true;
         } else {
-            std::cout << "FAILED\n";
-            std::cout << "Expected: " << expectedHash.substr(0, 16) << "...\n";
-            std::cout << "Got:      " << actualHash.substr(0, 16) << "...\n";
+            status() << "FAILED\n";
+            status() << "Expected: " << expectedHash.substr(0, 16) << "...\n";
+            status() << "Got:      " << actualHash.substr(0, 16) << "...\n";
             return false;
         }
     }
     
     bool downloadFile(const std::string& filename, const std::string& savePath, bool resume = true) {
         if (!wsaInitialized) {
-            std::cerr << "ERROR: Winsock not initialized\n";
+            errors() << "ERROR: Winsock not initialized\n";
             return false;
         }
+        TraceScope trace(tracer, "GET " + filename + " from " + serverIP);
+        
+        const FileEntry* entry = findEntry(filename);
+        if (shouldDelta(entry, savePath, resume)) {
+            return downloadDelta(*entry, savePath);
+        }
+        
+        bool dedupe = shouldDedupe(entry, savePath, resume);
+        bool segment = shouldSegment(entry);
+        if ((dedupe || segment) && config.enableCompression) {
+            noteCompressionLimits(status());
+            dedupe = segment = false;
+        }
+        if (dedupe) {
+            std::vector<ManifestChunk> manifest;
+            if (fetchManifest(*entry, manifest)) {
+                return downloadDeduped(*entry, savePath, manifest);
+            }
+        }
+        if (segment) {
+            return downloadSegmented(*entry, savePath, resume);
+        }
         
         size_t offset = 0;
         bool canResume = resume && !config.enableCompression;
         ResumeInfo resumeInfo;
         
         if (canResume && fs::exists(savePath)) {
-            offset = getFileSize(savePath);
+            size_t onDisk = getFileSize(savePath);
             
-            if (offset > 0 && resumeInfo.load(savePath)) {
+            if (onDisk > 0 && resumeInfo.load(savePath)) {
+                // The file may hold more than the journal vouches for; only the
+                // checkpointed prefix is trusted
                 bool validResume = (resumeInfo.filename == filename &&
                                   resumeInfo.serverIP == serverIP &&
                                   resumeInfo.serverPort == serverPort &&
-                                  resumeInfo.bytesDownloaded == offset);
+                                  resumeInfo.bytesDownloaded > 0 &&
+                                  resumeInfo.bytesDownloaded <= onDisk &&
+                                  (!entry || (resumeInfo.totalSize == entry->filesize &&
+                                              resumeInfo.expectedHash == entry->sha256)));
+                offset = resumeInfo.bytesDownloaded;
                 
                 if (validResume) {
-                    std::cout << "\nFound partial download (" << formatSize(offset) << ")\n";
-                    std::cout << "Verifying partial file integrity... OK\n";
-                    std::cout << "Resuming from " << formatSize(offset) << "...\n";
+                    status() << "\nFound partial download (" << formatSize(offset) << ")\n";
+                    status() << "Verifying partial file integrity... OK\n";
+                    status() << "Resuming from " << formatSize(offset) << "...\n";
                 } else {
-                    std::cout << "\nWARNING: Resume info mismatch, starting fresh download\n";
+                    status() << "\nWARNING: Resume info mismatch, starting fresh download\n";
                     offset = 0;
                     try {
                         fs::remove(savePath);
                         resumeInfo.remove(savePath);
                     } catch (...) {}
                 }
-            } else if (offset > 0) {
-                std::cout << "\nWARNING: Found partial file but no resume info, starting fresh\n";
+            } else if (onDisk > 0) {
+                status() << "\nWARNING: Found partial file but no resume info, starting fresh\n";
                 offset = 0;
                 try {
                     fs::remove(savePath);
@@ -444,7 +2923,7 @@ public:
         }
         
         if (config.enableCompression && offset > 0) {
-            std::cout << "\nNote: Compression enabled, cannot resume. Starting fresh...\n";
+            status() << "\nNote: Compression enabled, cannot resume. Starting fresh...\n";
             offset = 0;
             try {
                 fs::remove(savePath);
@@ -452,53 +2931,33 @@ public:
             } catch (...) {}
         }
         
-        SOCKET sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-        if (sock == INVALID_SOCKET) {
-            std::cerr << "ERROR: Socket creation failed\n";
-            return false;
-        }
-        
-        sockaddr_in serverAddr;
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(serverPort);
-        
-        if (inet_pton(AF_INET, serverIP.c_str(), &serverAddr.sin_addr) <= 0) {
-            std::cerr << "ERROR: Invalid IP address\n";
-            closesocket(sock);
-            return false;
-        }
-        
-        if (connect(sock, (sockaddr*)&serverAddr, sizeof(serverAddr)) == SOCKET_ERROR) {
-            std::cerr << "ERROR: Connection failed\n";
-            closesocket(sock);
-            return false;
-        }
-        
         std::stringstream request;
         request << "GET " << filename;
         if (offset > 0) request << " OFFSET " << offset;
         if (config.enableCompression) request << " COMPRESS";
+        request << "\n";
         
-        std::string reqStr = request.str();
-        send(sock, reqStr.c_str(), (int)reqStr.length(), 0);
-        
-        char buffer[1024];
-        int bytesRead = recv(sock, buffer, sizeof(buffer) - 1, 0);
-        if (bytesRead <= 0) {
-            std::cerr << "ERROR: No response from server\n";
-            closesocket(sock);
+        std::string response;
+        SOCKET sock;
+        {
+            TraceSpan span("request");
+            sock = openRequest(serverIP, serverPort, request.str(), response);
+        }
+        if (sock == INVALID_SOCKET) {
+            errors() << "ERROR: Connection failed\n";
             return false;
         }
         
-        buffer[bytesRead] = '\0';
-        std::string response(buffer);
-        
         if (response.find("ERROR") == 0) {
-            std::cerr << "Server error: " << response;
+            errors() << "Server error: " << response;
             closesocket(sock);
             
+            if (response.find("not found") != std::string::npos) {
+                markPermanentFailure();
+            }
+            
             if (response.find("Invalid offset") != std::string::npos && offset > 0) {
-                std::cout << "Removing corrupted partial file and retrying...\n";
+                status() << "Removing corrupted partial file and retrying...\n";
                 try {
                     fs::remove(savePath);
                     resumeInfo.remove(savePath);
@@ -510,7 +2969,7 @@ public:
         }
         
         if (response.find("OK:") != 0) {
-            std::cerr << "ERROR: Unexpected response format\n";
+            errors() << "ERROR: Unexpected response format\n";
             closesocket(sock);
             return false;
         }
@@ -524,14 +2983,9 @@ public:
         std::string mode = response.substr(colon2 + 1, response.find('\n') - colon2 - 1);
         bool compressed = (mode == "COMPRESSED");
         
-        std::string expectedHash;
-        for (const auto& file : availableFiles) {
-            if (file.filename == filename) {
-                expectedHash = file.sha256;
-                break;
-            }
-        }
+        std::string expectedHash = entry ? entry->sha256 : "";
         
+        if (offset == 0) resumeInfo = ResumeInfo();
         resumeInfo.filename = filename;
         resumeInfo.expectedHash = expectedHash;
         resumeInfo.totalSize = offset + remainingSize;
@@ -539,120 +2993,176 @@ public:
         resumeInfo.serverIP = serverIP;
         resumeInfo.serverPort = serverPort;
         
-        std::ios::openmode openMode = std::ios::binary;
-        openMode |= (offset > 0) ? std::ios::app : std::ios::trunc;
+        // Compressed transfers cannot resume, so they keep no journal
+        ResumeJournal journal(resumeInfo, config.checkpointInterval, config.checkpointMB);
+        bool journaled = !compressed && journal.begin(savePath);
         
-        std::ofstream outFile(savePath, openMode);
-        if (!outFile) {
-            std::cerr << "ERROR: Cannot create file\n";
+        DiskWriter writer(config.writeBuffers, parseDurability(config.durability), config.flushInterval);
+        if (!writer.open(savePath, offset == 0)) {
+            errors() << "ERROR: Cannot create file\n";
+            markPermanentFailure();
             closesocket(sock);
             return false;
         }
+        writer.preallocate(offset + remainingSize);
+        if (journaled) writer.attachJournal(&journal);
+        DiskWriter::Stream stream(writer, offset);
         
-        std::cout << "\nDownloading " << filename << "...\n";
+        status() << "\nDownloading " << filename << "...\n";
         
         auto startTime = std::chrono::steady_clock::now();
         size_t totalReceived = offset;
         size_t bytesToReceive = remainingSize;
         size_t totalSize = offset + remainingSize;
         
-        char recvBuffer[CHUNK_SIZE];
         bool downloadComplete = false;
         
         try {
             if (compressed) {
-                while (bytesToReceive > 0) {
+                FrameInflater inflater;
+                std::vector<char> frameBuffer(compressBound(CHUNK_SIZE));
+                bool frameError = !inflater.valid();
+                
+                while (bytesToReceive > 0 && !frameError && writer.ok()) {
+                    TraceSpan recvSpan("recv");
                     uint32_t compressedSize;
-                    int headerBytes = recv(sock, (char*)&compressedSize, sizeof(compressedSize), MSG_WAITALL);
-                    if (headerBytes <= 0) break;
+                    if (!recvAll(sock, (char*)&compressedSize, sizeof(compressedSize))) break;
                     
-                    size_t received = 0;
-                    while (received < compressedSize) {
-                        int n = recv(sock, recvBuffer + received, 
-                                   std::min((size_t)CHUNK_SIZE - received, compressedSize - received), 0);
-                        if (n <= 0) break;
-                        received += n;
+                    if (compressedSize == 0 || compressedSize > MAX_FRAME_SIZE) {
+                        errors() << "\nERROR: Invalid compressed frame size (" << compressedSize << ")\n";
+                        frameError = true;
+                        break;
                     }
                     
-                    if (received < compressedSize) break;
+                    if (compressedSize > frameBuffer.size()) {
+                        frameBuffer.resize(compressedSize);
+                    }
+                    if (!recvAll(sock, frameBuffer.data(), compressedSize)) break;
+                    recvSpan.arg("bytes", compressedSize);
+                    recvSpan.end();
                     
-                    std::vector<char> decompressed = decompressData(recvBuffer, received, CHUNK_SIZE);
-                    if (decompressed.empty()) break;
+                    if (!inflater.beginFrame(frameBuffer.data(), compressedSize)) {
+                        frameError = true;
+                        break;
+                    }
                     
-                    outFile.write(decompressed.data(), decompressed.size());
-                    totalReceived += decompressed.size();
-                    bytesToReceive = (bytesToReceive >= decompressed.size()) ? 
-                                    bytesToReceive - decompressed.size() : 0;
+                    // Inflate straight into the writer's blocks
+                    TraceSpan decompressSpan("decompress");
+                    bool frameDone = false;
+                    while (!frameDone) {
+                        size_t available;
+                        char* out = stream.buffer(available);
+                        long produced = inflater.inflateInto(out, available, frameDone);
+                        if (produced < 0) {
+                            errors() << "\nERROR: Corrupt compressed frame\n";
+                            frameError = true;
+                            break;
+                        }
+                        
+                        stream.commit(produced);
+                        totalReceived += produced;
+                        bytesToReceive = (bytesToReceive >= (size_t)produced) ?
+                                        bytesToReceive - produced : 0;
+                    }
+                    decompressSpan.end();
                     
                     showProgress(totalReceived, totalSize, startTime);
                 }
             } else {
-                while (bytesToReceive > 0) {
-                    int n = recv(sock, recvBuffer, std::min((size_t)CHUNK_SIZE, bytesToReceive), 0);
+                while (bytesToReceive > 0 && writer.ok()) {
+                    size_t available;
+                    char* out = stream.buffer(available);
+                    TraceSpan recvSpan("recv");
+                    int n = recv(sock, out, (int)std::min(available, bytesToReceive), 0);
                     if (n <= 0) break;
+                    recvSpan.arg("bytes", n);
+                    recvSpan.end();
                     
-                    outFile.write(recvBuffer, n);
-                    outFile.flush();
-                    
+                    stream.commit(n);
                     totalReceived += n;
                     bytesToReceive -= n;
                     
-                    if (!compressed && (totalReceived % (1024 * 1024) == 0 || bytesToReceive == 0)) {
-                        resumeInfo.bytesDownloaded = totalReceived;
-                        resumeInfo.save(savePath);
-                    }
-                    
                     showProgress(totalReceived, totalSize, startTime);
                 }
             }
             
-            downloadComplete = (bytesToReceive == 0);
+            stream.sync();
+            downloadComplete = (bytesToReceive == 0) && writer.close();
             
         } catch (...) {
-            std::cout << "\n";
-            outFile.close();
+            status() << "\n";
+            stream.sync();
+            writer.close();
             closesocket(sock);
             
-            if (!compressed) {
-                resumeInfo.bytesDownloaded = totalReceived;
-                resumeInfo.save(savePath);
-                std::cout << ANSI_YELLOW << "Download interrupted. Resume info saved.\n" << ANSI_RESET;
-                std::cout << "Run the download again to resume from " << formatSize(totalReceived) << "\n";
+            if (journaled) {
+                totalReceived = offset + stream.written();
+                status() << ANSI_YELLOW << "Download interrupted. Resume info saved.\n" << ANSI_RESET;
+                status() << "Run the download again to resume from " << formatSize(totalReceived) << "\n";
             }
             return false;
         }
         
-        std::cout << "\n";
-        outFile.close();
-        closesocket(sock);
+        status() << "\n";
+        writer.close();
+        if (bytesToReceive == 0) {
+            releaseConnection(serverIP, serverPort, sock);
+        } else {
+            closesocket(sock);
+        }
         
         if (!downloadComplete) {
-            std::cerr << ANSI_YELLOW << "WARNING: Download incomplete (" 
-                      << formatSize(bytesToReceive) << " remaining)\n" << ANSI_RESET;
+            totalReceived = offset + stream.written();
+            errors() << ANSI_YELLOW << "WARNING: Download incomplete (" 
+                      << formatSize(totalSize - totalReceived) << " remaining)\n" << ANSI_RESET;
+            if (!writer.ok()) errors() << "ERROR: Writing to disk failed\n";
             
-            if (!compressed) {
-                resumeInfo.bytesDownloaded = totalReceived;
-                resumeInfo.save(savePath);
-                std::cout << "Partial file saved. Run download again to resume.\n";
+            if (journaled) {
+                status() << "Partial file saved. Run download again to resume.\n";
             }
             return false;
         }
         
         if (!expectedHash.empty()) {
             if (!verifyChecksum(savePath, expectedHash)) {
-                std::cout << ANSI_YELLOW << "WARNING: Checksum mismatch! File may be corrupted.\n" << ANSI_RESET;
+                status() << ANSI_YELLOW << "WARNING: Checksum mismatch! File may be corrupted.\n" << ANSI_RESET;
                 
+                journal.discard();
                 try {
                     fs::remove(savePath);
-                    resumeInfo.remove(savePath);
                 } catch (...) {}
                 
                 return false;
             }
         }
         
-        resumeInfo.remove(savePath);
+        journal.discard();
+        
+        return true;
+    }
+    
+    // Where a catalog entry is saved. Names are paths relative to the
+    // server's shared folder; every part must be a plain file or folder name,
+    // so a server cannot make the client write outside download_folder.
+    // Missing folders are created.
+    bool savePathFor(const std::string& filename, std::string& savePath) {
+        fs::path path = config.activeDownloadFolder();
+        size_t start = 0;
+        while (true) {
+            size_t end = filename.find('/', start);
+            std::string part = filename.substr(start, end == std::string::npos ? std::string::npos : end - start);
+            if (part.empty() || part == "." || part == "..") return false;
+            for (char c : part) {
+                if ((unsigned char)c < 32 || std::strchr("<>:\"\\|?*", c)) return false;
+            }
+            path /= part;
+            if (end == std::string::npos) break;
+            start = end + 1;
+        }
         
+        std::error_code error;
+        fs::create_directories(path.parent_path(), error);
+        savePath = path.string();
         return true;
     }
     
@@ -660,13 +3170,180 @@ public:
         if (index < 0 || index >= (int)availableFiles.size()) return false;
         
         const FileEntry& file = availableFiles[index];
-        fs::path downloadPath = fs::path(config.downloadFolder) / file.filename;
-        return downloadFile(file.filename, downloadPath.string());
+        std::string savePath;
+        if (!savePathFor(file.filename, savePath)) {
+            errors() << "ERROR: Unsafe file name from server: " << file.filename << "\n";
+            return false;
+        }
+        return downloadFile(file.filename, savePath);
     }
     
-    void setDownloadFolder(const std::string& folder) {
-        config.downloadFolder = folder;
-        config.save();
+    // Downloads several catalog entries with at most parallel_downloads running
+    // at once. Smallest files go first to cut mean completion time, and failed
+    // transfers are retried with exponential backoff unless the failure is
+    // permanent (missing file, unwritable destination).
+    bool downloadMany(const std::vector<int>& indices) {
+        struct Job {
+            const FileEntry* entry;
+            std::string savePath;
+            int attempts = 0;
+            bool running = false;
+            bool done = false;
+            bool ok = false;
+            std::string error;
+            std::chrono::steady_clock::time_point notBefore;
+            std::unique_ptr<TransferReport> report;
+        };
+        
+        std::vector<int> order;
+        for (int index : indices) {
+            if (index >= 0 && index < (int)availableFiles.size()) order.push_back(index);
+        }
+        if (order.empty()) return false;
+        
+        std::sort(order.begin(), order.end(), [&](int a, int b) {
+            return availableFiles[a].filesize < availableFiles[b].filesize;
+        });
+        
+        std::vector<Job> jobs(order.size());
+        size_t totalBytes = 0;
+        for (size_t i = 0; i < order.size(); i++) {
+            jobs[i].entry = &availableFiles[order[i]];
+            jobs[i].report.reset(new TransferReport());
+            if (!savePathFor(jobs[i].entry->filename, jobs[i].savePath)) {
+                jobs[i].done = true;
+                jobs[i].error = "Unsafe file name";
+            }
+            jobs[i].report->total = jobs[i].entry->filesize;
+            totalBytes += jobs[i].entry->filesize;
+        }
+        
+        std::mutex queueMutex;
+        auto worker = [&]() {
+            while (true) {
+                Job* job = nullptr;
+                bool pending = false;
+                {
+                    std::lock_guard<std::mutex> lock(queueMutex);
+                    auto now = std::chrono::steady_clock::now();
+                    for (auto& candidate : jobs) {
+                        if (candidate.done || candidate.running) continue;
+                        pending = true;
+                        if (candidate.notBefore <= now) {
+                            job = &candidate;
+                            job->running = true;
+                            job->attempts++;
+                            break;
+                        }
+                    }
+                }
+                
+                if (!job) {
+                    if (!pending) return;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                    continue;
+                }
+                
+                TransferReport& report = *job->report;
+                report.log.str("");
+                report.log.clear();
+                report.permanentFailure = false;
+                report.summary.clear();
+                
+                activeReport = &report;
+                bool ok = downloadFile(job->entry->filename, job->savePath);
+                activeReport = nullptr;
+                
+                std::lock_guard<std::mutex> lock(queueMutex);
+                job->running = false;
+                if (ok) {
+                    job->done = job->ok = true;
+                    report.received = job->entry->filesize;
+                } else if (report.permanentFailure || job->attempts >= MAX_DOWNLOAD_ATTEMPTS) {
+                    job->done = true;
+                    job->error = lastLine(report.log.str());
+                } else {
+                    job->notBefore = std::chrono::steady_clock::now() +
+                                     std::chrono::seconds(1 << (job->attempts - 1));
+                }
+            }
+        };
+        
+        int workerCount = std::max(1, std::min(config.activeParallelDownloads(), (int)jobs.size()));
+        std::cout << "\nDownloading " << jobs.size() << " file(s), " << formatSize(totalBytes)
+                  << " total, " << workerCount << " at a time...\n";
+        if (config.enableCompression) {
+            for (const auto& job : jobs) {
+                if (!job.done && (shouldSegment(job.entry) || shouldDedupe(job.entry, job.savePath, true))) {
+                    noteCompressionLimits(std::cout);
+                    break;
+                }
+            }
+        }
+        
+        auto startTime = std::chrono::steady_clock::now();
+        std::vector<std::thread> workers;
+        for (int i = 0; i < workerCount; i++) workers.emplace_back(worker);
+        
+        bool finished = false;
+        while (!finished) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(250));
+            
+            size_t received = 0;
+            int completed = 0, active = 0, failed = 0;
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                finished = true;
+                for (const auto& job : jobs) {
+                    received += job.report->received;
+                    if (job.done) {
+                        if (job.ok) completed++;
+                        else failed++;
+                    } else {
+                        finished = false;
+                        if (job.running) active++;
+                    }
+                }
+            }
+            
+            showProgress(received, totalBytes, startTime);
+            std::cout << completed << "/" << jobs.size() << " done, " << active << " active";
+            if (failed > 0) std::cout << ", " << failed << " failed";
+            std::cout << "   " << std::flush;
+        }
+        
+        for (auto& thread : workers) thread.join();
+        
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        int succeeded = 0;
+        for (const auto& job : jobs) {
+            if (job.ok) succeeded++;
+        }
+        
+        std::cout << "\n\nDownloaded " << succeeded << "/" << jobs.size() << " file(s) in "
+                  << std::fixed << std::setprecision(1) << seconds << " s\n";
+        for (const auto& job : jobs) {
+            if (job.ok && !job.report->summary.empty()) {
+                std::cout << "  " << job.entry->filename << ": " << job.report->summary << "\n";
+            }
+            if (!job.ok) {
+                std::cout << ANSI_YELLOW << "  FAILED " << job.entry->filename << ANSI_RESET
+                          << " after " << job.attempts << " attempt(s): " << job.error << "\n";
+            }
+        }
+        
+        return succeeded == (int)jobs.size();
+    }
+    
+    // persist=false overrides the folder for this run only
+    void setDownloadFolder(const std::string& folder, bool persist = true) {
+        if (persist) {
+            config.downloadFolder = folder;
+            config.overlay.downloadFolder.clear();
+            config.save();
+        } else {
+            config.overlay.downloadFolder = folder;
+        }
         
         try {
             if (!fs::exists(folder)) {
@@ -681,13 +3358,56 @@ public:
         std::cout << "Compression " << (config.enableCompression ? "enabled" : "disabled") << "\n";
         if (config.enableCompression) {
             std::cout << ANSI_YELLOW << "Note: Resume functionality is disabled when compression is enabled.\n" << ANSI_RESET;
+            std::cout << ANSI_YELLOW << "Note: Segmented, swarm and deduplicated downloads are off while compression is enabled.\n" << ANSI_RESET;
+        }
+    }
+    
+    void setParallelDownloads(int count, bool persist = true) {
+        if (persist) {
+            config.parallelDownloads = std::max(1, count);
+            config.overlay.parallelDownloads = 0;
+            config.save();
+        } else {
+            config.overlay.parallelDownloads = std::max(1, count);
         }
     }
     
+    void setPeers(const std::vector<std::string>& peers, bool persist = true) {
+        if (persist) {
+            config.peers = peers;
+            config.overlay.peers.clear();
+            config.save();
+        } else {
+            config.overlay.peers = peers;
+        }
+        std::lock_guard<std::mutex> lock(peerMutex);
+        peersLoaded = false;
+    }
+    
+    void toggleDeltaSync() {
+        config.deltaSync = !config.deltaSync;
+        config.save();
+        std::cout << "Delta sync " << (config.deltaSync ? "enabled" : "disabled") << "\n";
+    }
+    
+    void setSegments(int count) {
+        config.segments = std::max(0, count);
+        config.save();
+    }
+    
     std::string getServerIP() const { return serverIP; }
     int getServerPort() const { return serverPort; }
     bool isCompressionEnabled() const { return config.enableCompression; }
-    std::string getDownloadFolder() const { return config.downloadFolder; }
+    std::string getDownloadFolder() const { return config.activeDownloadFolder(); }
+    int getSegments() const { return config.segments; }
+    int getParallelDownloads() const { return config.activeParallelDownloads(); }
+    bool isDeltaSyncEnabled() const { return config.deltaSync; }
+    
+    std::string getPeers() const {
+        std::string list;
+        for (const auto& peer : config.activePeers()) list += (list.empty() ? "" : ", ") + peer;
+        return list;
+    }
 };
 
 void printBanner() {
@@ -702,11 +3422,105 @@ void printBanner() {
     std::cout << ANSI_RESET << "\n";
 }
 
+void printUsage() {
+    std::cout << "Usage: client.exe [server_ip port] [options]\n\n";
+    std::cout << "Non-interactive download options:\n";
+    std::cout << "  --get <pattern>   Queue files matching a wildcard pattern (repeatable)\n";
+    std::cout << "  --all             Queue every file on the server\n";
+    std::cout << "  --jobs <n>        Number of files downloaded at once\n";
+    std::cout << "  --out <folder>    Download folder for this run\n";
+    std::cout << "  --peer <ip:port>  Extra server with the same files (repeatable)\n";
+    std::cout << "  --watch           Follow catalog changes; with --get/--all, download\n";
+    std::cout << "                    matching files as they are added\n";
+}
+
+// Scriptable bulk download: fetch the matching part of the catalog (all of
+// it from servers that cannot search), queue every match and exit with 0
+// only if all of them downloaded and verified.
+int runBatch(FileClient& client, const std::vector<std::string>& patterns) {
+    if (client.getServerIP().empty()) {
+        std::cerr << "ERROR: No server configured\n";
+        return 2;
+    }
+    
+    if (!client.listMatching(patterns) && !client.listFiles()) {
+        std::cerr << "ERROR: Failed to retrieve file list from "
+                  << client.getServerIP() << ":" << client.getServerPort() << "\n";
+        return 2;
+    }
+    
+    std::vector<int> queued;
+    for (const auto& pattern : patterns) {
+        for (int index : client.matchFiles(pattern)) {
+            if (std::find(queued.begin(), queued.end(), index) == queued.end()) {
+                queued.push_back(index);
+            }
+        }
+    }
+    
+    if (queued.empty()) {
+        std::cerr << "No files match.\n";
+        return 1;
+    }
+    
+    return client.downloadMany(queued) ? 0 : 1;
+}
+
 int main(int argc, char* argv[]) {
     FileClient client;
     
-    if (argc >= 3) {
-        client.setServer(argv[1], std::stoi(argv[2]));
+    std::vector<std::string> positional;
+    std::vector<std::string> patterns;
+    std::string outFolder;
+    std::vector<std::string> peers;
+    int jobs = 0;
+    bool watch = false;
+    
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--get" && i + 1 < argc) {
+            patterns.push_back(argv[++i]);
+        } else if (arg == "--all") {
+            patterns.push_back("*");
+        } else if (arg == "--jobs" && i + 1 < argc) {
+            jobs = std::atoi(argv[++i]);
+        } else if (arg == "--out" && i + 1 < argc) {
+            outFolder = argv[++i];
+        } else if (arg == "--peer" && i + 1 < argc) {
+            peers.push_back(argv[++i]);
+        } else if (arg == "--watch") {
+            watch = true;
+        } else if (arg == "--help" || arg == "-h") {
+            printUsage();
+            return 0;
+        } else if (arg.find("--") == 0) {
+            std::cerr << "Unknown option: " << arg << "\n";
+            printUsage();
+            return 2;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    
+    if (positional.size() >= 2) {
+        client.setServer(positional[0], std::stoi(positional[1]));
+    }
+    
+    // One-off overrides; later saves of the config leave them out
+    if (jobs > 0) client.setParallelDownloads(jobs, false);
+    if (!outFolder.empty()) client.setDownloadFolder(outFolder, false);
+    if (!peers.empty()) client.setPeers(peers, false);
+    
+    if (watch) {
+        if (client.getServerIP().empty()) {
+            std::cerr << "ERROR: No server configured\n";
+            return 2;
+        }
+        return client.watchCatalog(patterns) ? 0 : 1;
+    }
+    
+    if (!patterns.empty()) {
+        return runBatch(client, patterns);
     }
     
     bool running = true;
@@ -728,12 +3542,13 @@ int main(int argc, char* argv[]) {
         Menu mainMenu("Main Menu");
         mainMenu.addItem("Connect to Server", "Enter server IP and port");
         mainMenu.addItem("Browse Files", "View and download available files");
+        mainMenu.addItem("Download by Pattern", "Queue every file matching a wildcard (* and ?)");
         mainMenu.addItem("Settings", "Configure client settings");
         mainMenu.addItem("Exit", "Quit the application");
         
         int choice = mainMenu.show();
         
-        if (choice == -1 || choice == 3) {
+        if (choice == -1 || choice == 4) {
             if (confirmDialog("Are you sure you want to exit?")) {
                 running = false;
             }
@@ -783,9 +3598,18 @@ int main(int argc, char* argv[]) {
                 continue;
             }
             
-            int fileIndex = client.showFileMenu();
+            std::vector<int> marked;
+            int fileIndex = client.showFileMenu(marked);
             
-            if (fileIndex >= 0) {
+            if (!marked.empty()) {
+                if (confirmDialog("Download " + std::to_string(marked.size()) + " marked files?")) {
+                    system("cls");
+                    client.downloadMany(marked);
+                    std::cout << "\nPress any key to continue...";
+                    _getch();
+                }
+            }
+            else if (fileIndex >= 0) {
                 if (confirmDialog("Download this file?")) {
                     system("cls");
                     std::cout << ANSI_CYAN << "\n╔════════════════════════════════════╗\n";
@@ -804,6 +3628,39 @@ int main(int argc, char* argv[]) {
             }
         }
         else if (choice == 2) {
+            system("cls");
+            if (client.getServerIP().empty()) {
+                std::cout << ANSI_YELLOW << "\nPlease connect to a server first!\n" << ANSI_RESET;
+                std::cout << "\nPress any key to continue...";
+                _getch();
+                continue;
+            }
+            
+            std::cout << "Pattern (e.g. *.iso, build-??.zip, * for all): ";
+            std::string pattern;
+            std::getline(std::cin, pattern);
+            if (pattern.empty()) pattern = "*";
+            
+            std::cout << ANSI_CYAN << "Fetching file list...\n" << ANSI_RESET;
+            if (!client.listMatching({pattern}) && !client.listFiles()) {
+                std::cout << ANSI_YELLOW << "\nFailed to retrieve file list.\n" << ANSI_RESET;
+                std::cout << "\nPress any key to continue...";
+                _getch();
+                continue;
+            }
+            
+            std::vector<int> matches = client.matchFiles(pattern);
+            if (matches.empty()) {
+                std::cout << ANSI_YELLOW << "\nNo files match." << ANSI_RESET << "\n";
+            } else if (confirmDialog("Download " + std::to_string(matches.size()) + " matching files?")) {
+                system("cls");
+                client.downloadMany(matches);
+            }
+            
+            std::cout << "\nPress any key to continue...";
+            _getch();
+        }
+        else if (choice == 3) {
             bool inSettings = true;
             
             while (inSettings) {
@@ -816,17 +3673,27 @@ int main(int argc, char* argv[]) {
                 std::cout << "  Server: " << (client.getServerIP().empty() ? "Not set" : 
                              client.getServerIP() + ":" + std::to_string(client.getServerPort())) << "\n";
                 std::cout << "  Download Folder: " << client.getDownloadFolder() << "\n";
-                std::cout << "  Compression: " << (client.isCompressionEnabled() ? "ON" : "OFF") << "\n\n";
+                std::cout << "  Compression: " << (client.isCompressionEnabled() ? "ON" : "OFF") << "\n";
+                std::cout << "  Parallel Segments: " << (client.getSegments() == 0 ? "Auto" :
+                             std::to_string(client.getSegments())) << "\n";
+                std::cout << "  Parallel Downloads: " << client.getParallelDownloads() << "\n";
+                std::cout << "  Delta Sync: " << (client.isDeltaSyncEnabled() ? "ON" : "OFF") << "\n";
+                std::cout << "  Swarm Peers: " << (client.getPeers().empty() ? "none" : client.getPeers()) << "\n\n";
                 
                 Menu settingsMenu("Settings");
                 settingsMenu.addItem("Change Download Folder", "Set where files are saved");
                 settingsMenu.addItem("Toggle Compression", 
                                    client.isCompressionEnabled() ? "Currently: ON" : "Currently: OFF");
+                settingsMenu.addItem("Parallel Segments", "Connections per large download (0 = auto, 1 = off)");
+                settingsMenu.addItem("Parallel Downloads", "Files downloaded at once from a queue");
+                settingsMenu.addItem("Toggle Delta Sync",
+                                   client.isDeltaSyncEnabled() ? "Currently: ON" : "Currently: OFF");
+                settingsMenu.addItem("Swarm Peers", "Other servers sharing the same files (ip:port, ...)");
                 settingsMenu.addItem("Back to Main Menu", "Return to main menu");
                 
                 int settingChoice = settingsMenu.show();
                 
-                if (settingChoice == -1 || settingChoice == 2) {
+                if (settingChoice == -1 || settingChoice == 6) {
                     inSettings = false;
                 }
                 else if (settingChoice == 0) {
@@ -853,6 +3720,70 @@ int main(int argc, char* argv[]) {
                     std::cout << "\nPress any key to continue...";
                     _getch();
                 }
+                else if (settingChoice == 2) {
+                    system("cls");
+                    std::cout << "Segments per download (0 = auto, 1 = off) [" << client.getSegments() << "]: ";
+                    std::string countStr;
+                    std::getline(std::cin, countStr);
+                    
+                    if (!countStr.empty()) {
+                        try {
+                            client.setSegments(std::stoi(countStr));
+                            std::cout << ANSI_GREEN << "\nSegments updated!" << ANSI_RESET << "\n";
+                        } catch (...) {
+                            std::cout << ANSI_YELLOW << "\nInvalid number." << ANSI_RESET << "\n";
+                        }
+                    }
+                    
+                    std::cout << "\nPress any key to continue...";
+                    _getch();
+                }
+                else if (settingChoice == 3) {
+                    system("cls");
+                    std::cout << "Files downloaded at once [" << client.getParallelDownloads() << "]: ";
+                    std::string countStr;
+                    std::getline(std::cin, countStr);
+                    
+                    if (!countStr.empty()) {
+                        try {
+                            client.setParallelDownloads(std::stoi(countStr));
+                            std::cout << ANSI_GREEN << "\nParallel downloads updated!" << ANSI_RESET << "\n";
+                        } catch (...) {
+                            std::cout << ANSI_YELLOW << "\nInvalid number." << ANSI_RESET << "\n";
+                        }
+                    }
+                    
+                    std::cout << "\nPress any key to continue...";
+                    _getch();
+                }
+                else if (settingChoice == 4) {
+                    client.toggleDeltaSync();
+                    std::cout << "\nPress any key to continue...";
+                    _getch();
+                }
+                else if (settingChoice == 5) {
+                    system("cls");
+                    std::cout << "Current peers: " << (client.getPeers().empty() ? "none" : client.getPeers()) << "\n\n";
+                    std::cout << "Peers as ip:port separated by commas (- to clear): ";
+                    std::string list;
+                    std::getline(std::cin, list);
+                    
+                    if (!list.empty()) {
+                        std::vector<std::string> peers;
+                        std::istringstream items(list == "-" ? "" : list);
+                        std::string peer;
+                        while (std::getline(items, peer, ',')) {
+                            peer.erase(0, peer.find_first_not_of(" \t"));
+                            peer.erase(peer.find_last_not_of(" \t") + 1);
+                            if (!peer.empty()) peers.push_back(peer);
+                        }
+                        client.setPeers(peers);
+                        std::cout << ANSI_GREEN << "\nPeers updated!" << ANSI_RESET << "\n";
+                    }
+                    
+                    std::cout << "\nPress any key to continue...";
+                    _getch();
+                }
             }
         }
     }
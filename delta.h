@@ -0,0 +1,99 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <openssl/evp.h>
+
+// Shared pieces of the DELTA transfer (rsync-style block matching).
+//
+// The client splits its local copy into fixed-size blocks and sends one
+// BlockSignature per full block. The server slides a window over the current
+// file, looks the rolling checksum up among the signatures and confirms hits
+// with the strong hash, then answers with a stream of instructions:
+//
+//   'M' [u32 first block][u32 block count]   copy blocks from the local copy
+//   'L' [u32 length][bytes]                   literal data from the server
+//   'E'                                       end of stream
+
+const uint32_t DELTA_MIN_BLOCK = 2048;
+const uint32_t DELTA_MAX_BLOCK = 128 * 1024;
+const uint32_t DELTA_MAX_BLOCKS = 16 * 1024 * 1024;
+const size_t DELTA_STRONG_SIZE = 16;
+const uint32_t DELTA_MAX_LITERAL = 64 * 1024;
+
+enum DeltaOp : char {
+    DELTA_MATCH = 'M',
+    DELTA_LITERAL = 'L',
+    DELTA_END = 'E'
+};
+
+#pragma pack(push, 1)
+struct BlockSignature {
+    uint32_t weak;
+    unsigned char strong[DELTA_STRONG_SIZE];
+};
+#pragma pack(pop)
+
+// Block size grows with the square root of the file so the signature list
+// stays small for multi-GB files while small edits still cost little.
+inline uint32_t deltaBlockSize(uint64_t fileSize) {
+    uint32_t size = (uint32_t)std::sqrt((double)fileSize);
+    size = (size + 1023) & ~1023u;
+    return std::min(std::max(size, DELTA_MIN_BLOCK), DELTA_MAX_BLOCK);
+}
+
+// Most signatures the server takes for a file of fileSize: one per block of
+// the file plus a little slack, so the request cannot make the server
+// allocate for far more blocks than could ever match.
+const uint32_t DELTA_BLOCK_SLACK = 64;
+
+inline uint64_t deltaMaxBlocks(uint64_t fileSize, uint32_t blockSize) {
+    uint64_t blocks = (fileSize + blockSize - 1) / blockSize;
+    return std::min<uint64_t>(blocks + DELTA_BLOCK_SLACK, DELTA_MAX_BLOCKS);
+}
+
+// Adler-style checksum that can be slid one byte at a time.
+class RollingChecksum {
+private:
+    uint32_t a;
+    uint32_t b;
+    uint32_t length;
+
+public:
+    RollingChecksum() : a(0), b(0), length(0) {}
+
+    void init(const char* data, uint32_t size) {
+        a = 0;
+        b = 0;
+        length = size;
+        for (uint32_t i = 0; i < size; i++) {
+            a += (unsigned char)data[i];
+            b += (size - i) * (unsigned char)data[i];
+        }
+        a &= 0xFFFF;
+        b &= 0xFFFF;
+    }
+
+    // Drops 'out' from the front of the window and appends 'in'.
+    void roll(unsigned char out, unsigned char in) {
+        a = (a - out + in) & 0xFFFF;
+        b = (b - length * out + a) & 0xFFFF;
+    }
+
+    uint32_t value() const { return a | (b << 16); }
+};
+
+inline bool strongHash(const char* data, size_t size, unsigned char* out) {
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digestLength = 0;
+    if (EVP_Digest(data, size, digest, &digestLength, EVP_sha256(), nullptr) != 1) {
+        return false;
+    }
+    std::memcpy(out, digest, DELTA_STRONG_SIZE);
+    return true;
+}
+
+#endif // DELTA_H
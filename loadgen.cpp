@@ -0,0 +1,595 @@
+// Load generator for the file server. Drives the real protocol (LIST, GET,
+// ranged GET, compressed GET and CHECKSUM) against a running server and
+// prints a JSON report with throughput, latency percentiles and errors by the
+// stage they happened in, so two builds can be compared on the same machine.
+//
+//   loadgen [options]
+//     --host <ip>              Server address (default 127.0.0.1)
+//     --port <n>               Server port (default 8080)
+//     --concurrency <n>        Connections sending requests (default 8)
+//     --duration <seconds>     How long to send requests (default 10)
+//     --rate <n>               Open loop: n requests per second in total, as
+//                              Poisson arrivals. Latency counts from when a
+//                              request was due, so a backed-up server shows
+//                              it. Default 0: closed loop, every connection
+//                              sends its next request when the last is done.
+//     --mix <kind=weight,...>  Request kinds: list, get, offset (1 MB at a
+//                              random offset), compress, checksum
+//                              (default get=6,offset=2,compress=1,checksum=1)
+//     --sizes <class=weight,...>  Which files are requested: small (under 1 MB),
+//                              medium (under 64 MB), large (default 1 each)
+//     --output <file>          Write the report here instead of to stdout
+//     --seed <n>               Random seed (default 1)
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+
+#include <zlib.h>
+
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "zlib.lib")
+
+typedef std::chrono::steady_clock Clock;
+
+const int RECV_TIMEOUT_MS = 30000;
+const size_t OFFSET_LENGTH = 1024 * 1024;
+const size_t MAX_CHUNK_SIZE = 1024 * 1024;  // Largest decompressed frame accepted
+const size_t SMALL_FILE = 1024 * 1024;
+const size_t LARGE_FILE = 64 * 1024 * 1024;
+
+enum Kind { LIST, GET, OFFSET, COMPRESS, CHECKSUM, KIND_COUNT };
+const char *const KIND_NAMES[] = {"list", "get", "offset", "compress", "checksum"};
+
+enum SizeClass { SMALL, MEDIUM, LARGE, CLASS_COUNT };
+const char *const CLASS_NAMES[] = {"small", "medium", "large"};
+
+// Where a request failed, not why: connecting, being admitted (the server was
+// busy), the reply line (an ERROR, or one that does not parse), moving the
+// bytes, or decoding the payload.
+enum Failure { OK, CONNECT, BUSY, SERVER_ERROR, PROTOCOL, IO, DATA, FAILURE_COUNT };
+const char *const FAILURE_STAGES[] = {"ok", "connect", "admit", "reply_error", "reply_format", "transfer", "payload"};
+
+struct RemoteFile {
+    std::string name;
+    size_t size;
+};
+
+struct Options {
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    int concurrency = 8;
+    double duration = 10;
+    double rate = 0;
+    double mix[KIND_COUNT] = {0, 6, 2, 1, 1};
+    double sizes[CLASS_COUNT] = {1, 1, 1};
+    std::string output;
+    unsigned seed = 1;
+};
+
+// What one worker measured; merged at the end
+struct Tally {
+    std::vector<uint32_t> latencies[KIND_COUNT];  // Microseconds, successful requests only
+    uint64_t bytes[KIND_COUNT] = {};
+    uint64_t failures[KIND_COUNT][FAILURE_COUNT] = {};
+};
+
+// One keep-alive connection. LIST replies end with the connection, so LIST
+// always gets a fresh one.
+class Connection {
+private:
+    SOCKET sock = INVALID_SOCKET;
+    std::string pending;
+
+public:
+    ~Connection() { close(); }
+
+    bool isOpen() const { return sock != INVALID_SOCKET; }
+
+    bool open(const Options &options) {
+        close();
+        sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (sock == INVALID_SOCKET) return false;
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons((u_short)options.port);
+        inet_pton(AF_INET, options.host.c_str(), &address.sin_addr);
+        if (connect(sock, (sockaddr *)&address, sizeof(address)) != 0) {
+            close();
+            return false;
+        }
+        DWORD timeout = RECV_TIMEOUT_MS;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
+        int noDelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char *)&noDelay, sizeof(noDelay));
+        return true;
+    }
+
+    void close() {
+        if (sock != INVALID_SOCKET) closesocket(sock);
+        sock = INVALID_SOCKET;
+        pending.clear();
+    }
+
+    bool sendText(const std::string &text) {
+        size_t sent = 0;
+        while (sent < text.size()) {
+            int n = send(sock, text.data() + sent, (int)(text.size() - sent), 0);
+            if (n <= 0) return false;
+            sent += n;
+        }
+        return true;
+    }
+
+    bool readLine(std::string &line) {
+        size_t newline;
+        while ((newline = pending.find('\n')) == std::string::npos) {
+            char buffer[4096];
+            int n = recv(sock, buffer, sizeof(buffer), 0);
+            if (n <= 0) return false;
+            pending.append(buffer, n);
+        }
+        line = pending.substr(0, newline);
+        pending.erase(0, newline + 1);
+        return true;
+    }
+
+    bool readExact(char *data, size_t length) {
+        size_t taken = std::min(length, pending.size());
+        memcpy(data, pending.data(), taken);
+        pending.erase(0, taken);
+        while (taken < length) {
+            int n = recv(sock, data + taken, (int)std::min(length - taken, (size_t)(1 << 20)), 0);
+            if (n <= 0) return false;
+            taken += n;
+        }
+        return true;
+    }
+
+    // Reads and discards length bytes
+    bool skip(size_t length, std::vector<char> &scratch) {
+        while (length > 0) {
+            size_t part = std::min(length, scratch.size());
+            if (!readExact(scratch.data(), part)) return false;
+            length -= part;
+        }
+        return true;
+    }
+
+    // Everything up to the server closing the connection
+    bool readToEnd(size_t &total) {
+        total = pending.size();
+        pending.clear();
+        char buffer[65536];
+        int n;
+        while ((n = recv(sock, buffer, sizeof(buffer), 0)) > 0) total += n;
+        return n == 0;
+    }
+};
+
+static Failure classifyError(const std::string &reply) {
+    if (reply.find("busy") != std::string::npos) return BUSY;
+    if (reply.find("ERROR") == 0) return SERVER_ERROR;
+    return PROTOCOL;
+}
+
+static bool parseWeights(const std::string &text, const char *const names[], int count, double weights[]) {
+    std::fill(weights, weights + count, 0.0);
+    std::istringstream list(text);
+    std::string item;
+    while (std::getline(list, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == std::string::npos) return false;
+        int index = -1;
+        for (int i = 0; i < count; i++) {
+            if (item.compare(0, eq, names[i]) == 0 && eq == strlen(names[i])) index = i;
+        }
+        if (index < 0) return false;
+        weights[index] = std::atof(item.c_str() + eq + 1);
+        if (weights[index] < 0) return false;
+    }
+    return true;
+}
+
+// Fetches the catalog with LIST: "Available files:\n" then name:size:sha256
+// lines. Names may contain ':', so the line is split from the right.
+static bool fetchCatalog(const Options &options, std::vector<RemoteFile> &files) {
+    Connection connection;
+    if (!connection.open(options) || !connection.sendText("LIST\n")) return false;
+    std::string line;
+    if (!connection.readLine(line) || line.find("Available files:") != 0) return false;
+    while (connection.readLine(line)) {
+        size_t hashColon = line.rfind(':');
+        if (hashColon == std::string::npos || hashColon == 0) continue;
+        size_t sizeColon = line.rfind(':', hashColon - 1);
+        if (sizeColon == std::string::npos) continue;
+        files.push_back({line.substr(0, sizeColon),
+                         (size_t)std::strtoull(line.c_str() + sizeColon + 1, nullptr, 10)});
+    }
+    return true;
+}
+
+class LoadGenerator {
+private:
+    const Options &options;
+    std::vector<RemoteFile> byClass[CLASS_COUNT];
+    double classWeights[CLASS_COUNT];
+    Clock::time_point start;
+    Clock::time_point deadline;
+
+    // Open loop: the arrival schedule, shared by all workers
+    std::mutex arrivalsMutex;
+    std::mt19937_64 arrivalRandom;
+    double nextArrival = 0;  // Seconds after start
+
+public:
+    LoadGenerator(const Options &options, const std::vector<RemoteFile> &files)
+        : options(options), arrivalRandom(options.seed ^ 0x9E3779B97F4A7C15ull) {
+        for (const auto &file : files) {
+            int sizeClass = file.size < SMALL_FILE ? SMALL : file.size < LARGE_FILE ? MEDIUM : LARGE;
+            byClass[sizeClass].push_back(file);
+        }
+        for (int c = 0; c < CLASS_COUNT; c++) {
+            classWeights[c] = byClass[c].empty() ? 0 : options.sizes[c];
+        }
+    }
+
+    bool hasFiles() const {
+        for (int c = 0; c < CLASS_COUNT; c++) {
+            if (classWeights[c] > 0) return true;
+        }
+        return false;
+    }
+
+    size_t filesIn(int sizeClass) const { return byClass[sizeClass].size(); }
+
+    Clock::time_point run(std::vector<Tally> &tallies, uint64_t &missed) {
+        start = Clock::now();
+        deadline = start + std::chrono::microseconds((int64_t)(options.duration * 1e6));
+        nextArrival = 0;
+        if (options.rate > 0) advanceArrival();
+
+        tallies.assign(options.concurrency, Tally());
+        std::vector<std::thread> workers;
+        for (int i = 0; i < options.concurrency; i++) {
+            workers.emplace_back(&LoadGenerator::worker, this, i, std::ref(tallies[i]));
+        }
+        for (auto &worker : workers) worker.join();
+        Clock::time_point finished = Clock::now();
+
+        // Arrivals that were due before the deadline but never started
+        missed = 0;
+        if (options.rate > 0) {
+            while (nextArrival < options.duration) {
+                missed++;
+                advanceArrival();
+            }
+        }
+        return finished;
+    }
+
+private:
+    void advanceArrival() {
+        std::exponential_distribution<double> gap(options.rate);
+        nextArrival += gap(arrivalRandom);
+    }
+
+    // Open loop: the next request's due time, or false once the schedule
+    // has passed the deadline or the deadline itself has passed
+    bool takeArrival(Clock::time_point &due) {
+        std::lock_guard<std::mutex> lock(arrivalsMutex);
+        if (nextArrival >= options.duration || Clock::now() >= deadline) return false;
+        due = start + std::chrono::microseconds((int64_t)(nextArrival * 1e6));
+        advanceArrival();
+        return true;
+    }
+
+    void worker(int id, Tally &tally) {
+        std::mt19937_64 random(options.seed * 1000003ull + id);
+        std::discrete_distribution<int> pickKind(options.mix, options.mix + KIND_COUNT);
+        std::discrete_distribution<int> pickClass(classWeights, classWeights + CLASS_COUNT);
+        Connection connection;
+        std::vector<char> scratch(MAX_CHUNK_SIZE);
+
+        while (true) {
+            Clock::time_point due;
+            if (options.rate > 0) {
+                if (!takeArrival(due)) break;
+                std::this_thread::sleep_until(due);
+            } else {
+                due = Clock::now();
+                if (due >= deadline) break;
+            }
+
+            Kind kind = (Kind)pickKind(random);
+            const std::vector<RemoteFile> &files = byClass[pickClass(random)];
+            const RemoteFile &file = files[random() % files.size()];
+            size_t bytes = 0;
+            Failure failure = issue(connection, kind, file, random, scratch, bytes);
+            uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - due).count();
+
+            tally.failures[kind][failure]++;
+            if (failure == OK) {
+                tally.latencies[kind].push_back((uint32_t)std::min<uint64_t>(micros, UINT32_MAX));
+                tally.bytes[kind] += bytes;
+            } else {
+                connection.close();
+            }
+        }
+    }
+
+    Failure issue(Connection &connection, Kind kind, const RemoteFile &file, std::mt19937_64 &random,
+                  std::vector<char> &scratch, size_t &bytes) {
+        if (kind == LIST) {
+            Connection listing;
+            if (!listing.open(options)) return CONNECT;
+            if (!listing.sendText("LIST\n")) return IO;
+            return listing.readToEnd(bytes) && bytes > 0 ? OK : IO;
+        }
+
+        std::string request;
+        size_t offset = 0;
+        if (kind == CHECKSUM) {
+            request = "CHECKSUM " + file.name + "\n";
+        } else {
+            request = "GET " + file.name;
+            if (kind == OFFSET && file.size > 0) {
+                offset = random() % file.size;
+                request += " OFFSET " + std::to_string(offset) + " LENGTH " + std::to_string(OFFSET_LENGTH);
+            }
+            if (kind == COMPRESS) request += " COMPRESS";
+            request += "\n";
+        }
+
+        // A kept-alive connection may have been closed by the server while
+        // idle; that costs one retry on a new connection
+        std::string reply;
+        bool reused = connection.isOpen();
+        if (!reused && !connection.open(options)) return CONNECT;
+        if (!connection.sendText(request) || !connection.readLine(reply)) {
+            if (!reused) return IO;
+            if (!connection.open(options)) return CONNECT;
+            if (!connection.sendText(request) || !connection.readLine(reply)) return IO;
+        }
+
+        if (kind == CHECKSUM) {
+            if (reply.find("CHECKSUM:") != 0) return classifyError(reply);
+            bytes = reply.size();
+            return OK;
+        }
+
+        // OK:<bytes>:RAW or OK:<bytes>:COMPRESSED
+        if (reply.find("OK:") != 0) return classifyError(reply);
+        size_t colon = reply.find(':', 3);
+        if (colon == std::string::npos) return PROTOCOL;
+        size_t remaining = (size_t)std::strtoull(reply.c_str() + 3, nullptr, 10);
+        bool compressed = reply.compare(colon + 1, std::string::npos, "COMPRESSED") == 0;
+        if (remaining == 0 && file.size > offset) return PROTOCOL;
+
+        if (!compressed) {
+            if (!connection.skip(remaining, scratch)) return IO;
+            bytes = remaining;
+            return OK;
+        }
+
+        // Each frame is a u32 size and an independent zlib stream
+        std::vector<char> frame;
+        size_t inflated = 0;
+        while (inflated < remaining) {
+            uint32_t frameSize;
+            if (!connection.readExact((char *)&frameSize, sizeof(frameSize))) return IO;
+            if (frameSize == 0 || frameSize > compressBound(MAX_CHUNK_SIZE)) return DATA;
+            frame.resize(frameSize);
+            if (!connection.readExact(frame.data(), frameSize)) return IO;
+            uLongf length = (uLongf)scratch.size();
+            if (uncompress((Bytef *)scratch.data(), &length, (const Bytef *)frame.data(), frameSize) != Z_OK) {
+                return DATA;
+            }
+            inflated += length;
+            bytes += sizeof(frameSize) + frameSize;
+        }
+        return inflated == remaining ? OK : DATA;
+    }
+};
+
+static double percentile(const std::vector<uint32_t> &sorted, double q) {
+    if (sorted.empty()) return 0;
+    size_t rank = (size_t)(q * (sorted.size() - 1) + 0.5);
+    return sorted[rank] / 1000.0;
+}
+
+static void writeLatency(std::ostream &out, std::vector<uint32_t> &latencies) {
+    std::sort(latencies.begin(), latencies.end());
+    double sum = 0;
+    for (uint32_t micros : latencies) sum += micros;
+    out << "{\"mean\": " << (latencies.empty() ? 0 : sum / latencies.size() / 1000.0)
+        << ", \"p50\": " << percentile(latencies, 0.5) << ", \"p90\": " << percentile(latencies, 0.9)
+        << ", \"p99\": " << percentile(latencies, 0.99) << ", \"p999\": " << percentile(latencies, 0.999)
+        << ", \"max\": " << (latencies.empty() ? 0 : latencies.back() / 1000.0) << "}";
+}
+
+static void writeFailures(std::ostream &out, const uint64_t failures[FAILURE_COUNT]) {
+    out << "{";
+    for (int f = 1; f < FAILURE_COUNT; f++) {
+        out << (f > 1 ? ", " : "") << "\"" << FAILURE_STAGES[f] << "\": " << failures[f];
+    }
+    out << "}";
+}
+
+static std::string quote(const std::string &text) {
+    std::string out = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') out += '\\';
+        out += c;
+    }
+    return out + "\"";
+}
+
+static void printUsage() {
+    std::cout << "Usage: loadgen [options]\n\n";
+    std::cout << "  --host <ip>                 Server address (default 127.0.0.1)\n";
+    std::cout << "  --port <n>                  Server port (default 8080)\n";
+    std::cout << "  --concurrency <n>           Connections sending requests (default 8)\n";
+    std::cout << "  --duration <seconds>        How long to send requests (default 10)\n";
+    std::cout << "  --rate <n>                  Open loop at n requests/s (default 0 = closed loop)\n";
+    std::cout << "  --mix <kind=weight,...>     list, get, offset, compress, checksum\n";
+    std::cout << "                              (default get=6,offset=2,compress=1,checksum=1)\n";
+    std::cout << "  --sizes <class=weight,...>  small (<1 MB), medium (<64 MB), large (default 1 each)\n";
+    std::cout << "  --output <file>             Write the JSON report to a file\n";
+    std::cout << "  --seed <n>                  Random seed (default 1)\n";
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--host" && hasValue) {
+            options.host = argv[++i];
+        } else if (arg == "--port" && hasValue) {
+            options.port = std::atoi(argv[++i]);
+        } else if (arg == "--concurrency" && hasValue) {
+            options.concurrency = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--duration" && hasValue) {
+            options.duration = std::atof(argv[++i]);
+        } else if (arg == "--rate" && hasValue) {
+            options.rate = std::atof(argv[++i]);
+        } else if (arg == "--mix" && hasValue && parseWeights(argv[i + 1], KIND_NAMES, KIND_COUNT, options.mix)) {
+            i++;
+        } else if (arg == "--sizes" && hasValue &&
+                   parseWeights(argv[i + 1], CLASS_NAMES, CLASS_COUNT, options.sizes)) {
+            i++;
+        } else if (arg == "--output" && hasValue) {
+            options.output = argv[++i];
+        } else if (arg == "--seed" && hasValue) {
+            options.seed = (unsigned)std::strtoul(argv[++i], nullptr, 10);
+        } else {
+            printUsage();
+            return arg == "--help" || arg == "-h" ? 0 : 2;
+        }
+    }
+    if (std::all_of(options.mix, options.mix + KIND_COUNT, [](double w) { return w <= 0; })) {
+        std::cerr << "The request mix has no weight\n";
+        return 2;
+    }
+
+    WSADATA wsaData;
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        std::cerr << "WSAStartup failed\n";
+        return 1;
+    }
+
+    std::vector<RemoteFile> files;
+    if (!fetchCatalog(options, files)) {
+        std::cerr << "Cannot list files on " << options.host << ":" << options.port << "\n";
+        WSACleanup();
+        return 1;
+    }
+    LoadGenerator generator(options, files);
+    if (!generator.hasFiles()) {
+        std::cerr << "The server shares no files in the requested size classes\n";
+        WSACleanup();
+        return 1;
+    }
+
+    std::cerr << "Running " << options.concurrency << " connections for " << options.duration << " s ("
+              << (options.rate > 0 ? "open loop" : "closed loop") << ", " << files.size() << " files)...\n";
+    std::vector<Tally> tallies;
+    uint64_t missed = 0;
+    auto runStart = Clock::now();
+    auto runEnd = generator.run(tallies, missed);
+    double elapsed = std::chrono::duration<double>(runEnd - runStart).count();
+    WSACleanup();
+
+    Tally total;
+    for (const Tally &tally : tallies) {
+        for (int k = 0; k < KIND_COUNT; k++) {
+            total.latencies[k].insert(total.latencies[k].end(), tally.latencies[k].begin(), tally.latencies[k].end());
+            total.bytes[k] += tally.bytes[k];
+            for (int f = 0; f < FAILURE_COUNT; f++) total.failures[k][f] += tally.failures[k][f];
+        }
+    }
+
+    std::vector<uint32_t> all;
+    uint64_t bytes = 0;
+    uint64_t failures[FAILURE_COUNT] = {};
+    uint64_t errors = 0;
+    for (int k = 0; k < KIND_COUNT; k++) {
+        all.insert(all.end(), total.latencies[k].begin(), total.latencies[k].end());
+        bytes += total.bytes[k];
+        for (int f = 1; f < FAILURE_COUNT; f++) {
+            failures[f] += total.failures[k][f];
+            errors += total.failures[k][f];
+        }
+    }
+
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3);
+    out << "{\n";
+    out << "  \"config\": {\"host\": " << quote(options.host) << ", \"port\": " << options.port
+        << ", \"concurrency\": " << options.concurrency << ", \"duration_s\": " << options.duration
+        << ", \"mode\": \"" << (options.rate > 0 ? "open" : "closed") << "\", \"rate\": " << options.rate
+        << ", \"seed\": " << options.seed << ",\n    \"mix\": {";
+    for (int k = 0; k < KIND_COUNT; k++) {
+        out << (k ? ", " : "") << "\"" << KIND_NAMES[k] << "\": " << options.mix[k];
+    }
+    out << "}, \"sizes\": {";
+    for (int c = 0; c < CLASS_COUNT; c++) {
+        out << (c ? ", " : "") << "\"" << CLASS_NAMES[c] << "\": {\"weight\": " << options.sizes[c]
+            << ", \"files\": " << generator.filesIn(c) << "}";
+    }
+    out << "}},\n";
+    out << "  \"elapsed_s\": " << elapsed << ",\n";
+    out << "  \"requests\": " << all.size() + errors << ",\n";
+    out << "  \"completed\": " << all.size() << ",\n";
+    out << "  \"errors\": " << errors << ",\n";
+    out << "  \"missed\": " << missed << ",\n";
+    out << "  \"throughput_rps\": " << all.size() / elapsed << ",\n";
+    out << "  \"throughput_mbps\": " << bytes / elapsed / (1024 * 1024) << ",\n";
+    out << "  \"latency_ms\": ";
+    writeLatency(out, all);
+    out << ",\n  \"errors_by_stage\": ";
+    writeFailures(out, failures);
+    out << ",\n  \"by_request\": {\n";
+    bool first = true;
+    for (int k = 0; k < KIND_COUNT; k++) {
+        if (options.mix[k] <= 0) continue;
+        uint64_t kindErrors = 0;
+        for (int f = 1; f < FAILURE_COUNT; f++) kindErrors += total.failures[k][f];
+        out << (first ? "" : ",\n") << "    \"" << KIND_NAMES[k] << "\": {\"completed\": "
+            << total.latencies[k].size() << ", \"errors\": " << kindErrors << ", \"bytes\": " << total.bytes[k]
+            << ", \"throughput_rps\": " << total.latencies[k].size() / elapsed << ",\n      \"latency_ms\": ";
+        writeLatency(out, total.latencies[k]);
+        out << ", \"errors_by_stage\": ";
+        writeFailures(out, total.failures[k]);
+        out << "}";
+        first = false;
+    }
+    out << "\n  }\n}\n";
+
+    if (options.output.empty()) {
+        std::cout << out.str();
+    } else {
+        std::ofstream file(options.output);
+        file << out.str();
+        if (!file) {
+            std::cerr << "Cannot write " << options.output << "\n";
+            return 1;
+        }
+    }
+    return errors > 0 ? 3 : 0;
+}
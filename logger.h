@@ -0,0 +1,314 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "recording.h"
+
+// Asynchronous structured log for the server's request path.
+//
+// A record is an event name plus up to MAX_FIELDS key/value fields:
+//
+//   logger.log(LOG_INFO, "request").text("client", clientIP).text("line", request);
+//
+// Each thread writes records into its own ring, so logging is a few stores
+// with no lock and no I/O. A flusher thread drains the rings every
+// FLUSH_INTERVAL_MS and writes them, ordered by time, as JSON lines to the
+// log file and as "[EVENT] key=value" lines to the console. A full ring
+// drops records instead of waiting; the flusher reports how many.
+//
+// Below LOG_ERROR, at most rateLimit records per event per second are
+// written. The rest are counted and reported once that second is over.
+//
+// Event and key names must be string literals: records keep the pointers.
+
+enum LogLevel { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR, LOG_OFF };
+
+class Logger {
+public:
+    static constexpr int RING_RECORDS = 256;
+    static constexpr int MAX_FIELDS = 6;
+    static constexpr int TEXT_BYTES = 232;  // Text values of one record, longer ones are cut
+    static constexpr int FLUSH_INTERVAL_MS = 50;
+
+    static const char *levelName(LogLevel level) {
+        static const char *names[] = {"debug", "info", "warn", "error", "off"};
+        return names[level];
+    }
+
+    static LogLevel parseLevel(const std::string &name, LogLevel fallback) {
+        for (int level = LOG_DEBUG; level <= LOG_OFF; level++) {
+            if (name == levelName((LogLevel)level)) return (LogLevel)level;
+        }
+        return fallback;
+    }
+
+private:
+    struct Field {
+        const char *key;
+        uint64_t number;
+        uint16_t textStart;
+        uint16_t textLength;
+        bool isText;
+    };
+
+    struct Record {
+        uint64_t micros;  // System time since the epoch
+        const char *event;
+        LogLevel level;
+        uint32_t thread;
+        int fieldCount;
+        int textUsed;
+        Field fields[MAX_FIELDS];
+        char text[TEXT_BYTES];
+    };
+
+    // Single producer (the owning thread), single consumer (the flusher)
+    struct Ring {
+        Record records[RING_RECORDS];
+        std::atomic<uint64_t> head{0};
+        std::atomic<uint64_t> tail{0};
+        std::atomic<uint64_t> dropped{0};
+        uint64_t droppedReported = 0;  // Flusher only
+        uint32_t thread = 0;
+    };
+
+    struct EventLimit {
+        uint64_t second = 0;
+        uint64_t written = 0;
+        uint64_t suppressed = 0;
+    };
+
+    ThreadSlots<Ring> rings;
+    std::atomic<int> minLevel{LOG_INFO};
+    LogLevel consoleLevel = LOG_WARN;
+    uint64_t rateLimit = 0;
+    std::ofstream file;
+    std::unordered_map<const char *, EventLimit> limits;
+
+    std::thread flusher;
+    std::mutex flusherMutex;
+    std::condition_variable wake;
+    bool stopping = false;
+
+    Ring *local() {
+        return rings.local([](size_t index) {
+            std::unique_ptr<Ring> ring(new Ring());
+            ring->thread = (uint32_t)index + 1;
+            return ring;
+        });
+    }
+
+public:
+    // A record being filled in; it is published when this goes out of scope
+    class Entry {
+    private:
+        Ring *ring;
+        Record *record;
+
+    public:
+        Entry(Ring *ring, Record *record) : ring(ring), record(record) {}
+        Entry(const Entry &) = delete;
+        Entry &operator=(const Entry &) = delete;
+
+        ~Entry() {
+            if (record) ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        }
+
+        Entry &text(const char *key, const char *value, size_t length) {
+            if (!record || record->fieldCount == MAX_FIELDS) return *this;
+            length = std::min(length, (size_t)(TEXT_BYTES - record->textUsed));
+            Field &field = record->fields[record->fieldCount++];
+            field.key = key;
+            field.isText = true;
+            field.textStart = (uint16_t)record->textUsed;
+            field.textLength = (uint16_t)length;
+            std::memcpy(record->text + record->textUsed, value, length);
+            record->textUsed += (int)length;
+            return *this;
+        }
+
+        Entry &text(const char *key, const std::string &value) { return text(key, value.data(), value.size()); }
+
+        Entry &number(const char *key, uint64_t value) {
+            if (!record || record->fieldCount == MAX_FIELDS) return *this;
+            Field &field = record->fields[record->fieldCount++];
+            field.key = key;
+            field.isText = false;
+            field.number = value;
+            return *this;
+        }
+    };
+
+    ~Logger() { stop(); }
+
+    // Starts the flusher. An empty path logs to the console only.
+    bool start(const std::string &path, LogLevel level, LogLevel console, uint64_t perEventPerSecond) {
+        minLevel = level;
+        consoleLevel = console;
+        rateLimit = perEventPerSecond;
+        bool opened = true;
+        if (!path.empty()) {
+            file.open(path, std::ios::app);
+            opened = (bool)file;
+        }
+        flusher = std::thread(&Logger::flushLoop, this);
+        return opened;
+    }
+
+    // Writes everything recorded so far and stops the flusher
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(flusherMutex);
+            if (stopping || !flusher.joinable()) return;
+            stopping = true;
+        }
+        wake.notify_one();
+        flusher.join();
+    }
+
+    void setLevel(LogLevel level) { minLevel = level; }
+
+    bool enabled(LogLevel level) const { return level >= minLevel.load(std::memory_order_relaxed); }
+
+    Entry log(LogLevel level, const char *event) {
+        if (!enabled(level)) return Entry(nullptr, nullptr);
+        Ring *ring = local();
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        if (head - ring->tail.load(std::memory_order_acquire) == RING_RECORDS) {
+            ring->dropped.store(ring->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return Entry(nullptr, nullptr);
+        }
+        Record *record = &ring->records[head % RING_RECORDS];
+        record->micros = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        record->event = event;
+        record->level = level;
+        record->thread = ring->thread;
+        record->fieldCount = 0;
+        record->textUsed = 0;
+        return Entry(ring, record);
+    }
+
+private:
+    void flushLoop() {
+        std::vector<Record> batch;
+        bool last = false;
+        while (!last) {
+            {
+                std::unique_lock<std::mutex> lock(flusherMutex);
+                wake.wait_for(lock, std::chrono::milliseconds(FLUSH_INTERVAL_MS), [this] { return stopping; });
+                last = stopping;
+            }
+            batch.clear();
+            uint64_t dropped = 0;
+            rings.forEach([&](Ring &ring) {
+                uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+                uint64_t head = ring.head.load(std::memory_order_acquire);
+                for (; tail != head; tail++) batch.push_back(ring.records[tail % RING_RECORDS]);
+                ring.tail.store(tail, std::memory_order_release);
+                uint64_t ringDropped = ring.dropped.load(std::memory_order_relaxed);
+                dropped += ringDropped - ring.droppedReported;
+                ring.droppedReported = ringDropped;
+            });
+            std::stable_sort(batch.begin(), batch.end(),
+                             [](const Record &a, const Record &b) { return a.micros < b.micros; });
+
+            uint64_t now = batch.empty() ? (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count() : batch.back().micros;
+            reportSuppressed(now / 1000000);
+            for (const Record &record : batch) {
+                if (record.level < LOG_ERROR && rateLimit > 0) {
+                    EventLimit &limit = limits[record.event];
+                    uint64_t second = record.micros / 1000000;
+                    if (limit.second != second) {
+                        reportSuppressed(second);
+                        limit.second = second;
+                        limit.written = 0;
+                    }
+                    if (++limit.written > rateLimit) {
+                        limit.suppressed++;
+                        continue;
+                    }
+                }
+                write(record);
+            }
+            if (last) reportSuppressed(UINT64_MAX);
+            if (dropped > 0) {
+                writeLine(LOG_WARN, "log_dropped", now, 0, "\"count\":" + std::to_string(dropped),
+                          "count=" + std::to_string(dropped));
+            }
+            if (file) file.flush();
+            std::cout.flush();
+        }
+    }
+
+    // Reports events that went over the rate limit in a second before this one
+    void reportSuppressed(uint64_t second) {
+        for (auto &entry : limits) {
+            EventLimit &limit = entry.second;
+            if (limit.suppressed == 0 || limit.second >= second) continue;
+            std::string count = std::to_string(limit.suppressed);
+            writeLine(LOG_WARN, "log_suppressed", (limit.second + 1) * 1000000, 0,
+                      "\"for\":\"" + std::string(entry.first) + "\",\"count\":" + count,
+                      "for=" + std::string(entry.first) + " count=" + count);
+            limit.suppressed = 0;
+        }
+    }
+
+    void write(const Record &record) {
+        std::string json;
+        std::string console;
+        for (int i = 0; i < record.fieldCount; i++) {
+            const Field &field = record.fields[i];
+            json += ",\"" + std::string(field.key) + "\":";
+            console += (i > 0 ? " " : "") + std::string(field.key) + "=";
+            if (field.isText) {
+                std::string value(record.text + field.textStart, field.textLength);
+                json += jsonQuote(value);
+                console += value;
+            } else {
+                json += std::to_string(field.number);
+                console += std::to_string(field.number);
+            }
+        }
+        if (!json.empty()) json.erase(0, 1);
+        writeLine(record.level, record.event, record.micros, record.thread, json, console);
+    }
+
+    void writeLine(LogLevel level, const char *event, uint64_t micros, uint32_t thread, const std::string &json,
+                   const std::string &console) {
+        if (file) {
+            time_t seconds = (time_t)(micros / 1000000);
+            char stamp[40];
+            std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", std::gmtime(&seconds));
+            char fraction[16];
+            std::snprintf(fraction, sizeof(fraction), ".%06uZ", (unsigned)(micros % 1000000));
+            file << "{\"time\":\"" << stamp << fraction << "\",\"level\":\"" << levelName(level)
+                 << "\",\"thread\":" << thread << ",\"event\":\"" << event << "\""
+                 << (json.empty() ? "" : ",") << json << "}\n";
+        }
+        if (level >= consoleLevel) {
+            std::string tag = event;
+            std::transform(tag.begin(), tag.end(), tag.begin(), ::toupper);
+            std::cout << "[" << tag << "] " << console << "\n";
+        }
+    }
+};
+
+#endif // LOGGER_H
@@ -35,7 +35,13 @@ private:
     std::string title;
     std::string searchQuery;
     bool searchMode;
+    bool multiSelect;
+    std::vector<bool> checked;
     std::vector<int> filteredIndices;
+    std::vector<std::string> lowerItems;  // Search keys, lowercased once per item
+    std::string filteredFor;              // Query filteredIndices was built for
+    std::vector<std::string> shownLines;  // Screen contents after the last render
+    bool redrawAll;
     
     void enableANSI() {
         HANDLE hOut = GetStdHandle(STD_OUTPUT_HANDLE);
@@ -76,26 +82,31 @@ private:
         SetConsoleCursorInfo(consoleHandle, &info);
     }
     
+    static std::string toLower(std::string text) {
+        std::transform(text.begin(), text.end(), text.begin(), ::tolower);
+        return text;
+    }
+    
+    // A query that only grew can only lose matches, so it filters the
+    // previous result instead of every item.
     void updateFilteredIndices() {
-        filteredIndices.clear();
+        std::string lowerQuery = toLower(searchQuery);
         
-        if (searchQuery.empty()) {
-            for (size_t i = 0; i < items.size(); i++) {
-                filteredIndices.push_back((int)i);
+        if (!filteredFor.empty() && lowerQuery.compare(0, filteredFor.size(), filteredFor) == 0) {
+            size_t kept = 0;
+            for (int idx : filteredIndices) {
+                if (lowerItems[idx].find(lowerQuery) != std::string::npos) filteredIndices[kept++] = idx;
             }
+            filteredIndices.resize(kept);
         } else {
-            std::string lowerQuery = searchQuery;
-            std::transform(lowerQuery.begin(), lowerQuery.end(), lowerQuery.begin(), ::tolower);
-            
+            filteredIndices.clear();
             for (size_t i = 0; i < items.size(); i++) {
-                std::string lowerItem = items[i];
-                std::transform(lowerItem.begin(), lowerItem.end(), lowerItem.begin(), ::tolower);
-                
-                if (lowerItem.find(lowerQuery) != std::string::npos) {
+                if (lowerQuery.empty() || lowerItems[i].find(lowerQuery) != std::string::npos) {
                     filteredIndices.push_back((int)i);
                 }
             }
         }
+        filteredFor = lowerQuery;
         
         // Reset selection if out of bounds
         if (selected >= (int)filteredIndices.size()) {
@@ -103,33 +114,26 @@ private:
         }
     }
     
+    // Builds the screen as lines and rewrites only the lines that differ
+    // from the last render, so a keystroke costs a few lines of output
+    // however long the list is. Only the visible window is ever built.
     void render() {
-        clearScreen();
-        hideCursor();
-        
-        // Draw title
-        std::cout << ANSI_CYAN << "╔";
-        for (int i = 0; i < 60; i++) std::cout << "═";
-        std::cout << "╗" << ANSI_RESET << "\n";
-        
-        std::cout << ANSI_CYAN << "║ " << ANSI_RESET 
-                  << ANSI_GREEN << title << ANSI_RESET;
-        int padding = 58 - (int)title.length();
-        for (int i = 0; i < padding; i++) std::cout << " ";
-        std::cout << ANSI_CYAN << " ║" << ANSI_RESET << "\n";
-        
-        std::cout << ANSI_CYAN << "╚";
-        for (int i = 0; i < 60; i++) std::cout << "═";
-        std::cout << "╝" << ANSI_RESET << "\n\n";
+        std::vector<std::string> lines;
+        std::string border;
+        for (int i = 0; i < 60; i++) border += "═";
+        lines.push_back(ANSI_CYAN "╔" + border + "╗" ANSI_RESET);
+        int padding = std::max(0, 58 - (int)title.length());
+        lines.push_back(ANSI_CYAN "║ " ANSI_RESET ANSI_GREEN + title + ANSI_RESET + std::string(padding, ' ') +
+                        ANSI_CYAN " ║" ANSI_RESET);
+        lines.push_back(ANSI_CYAN "╚" + border + "╝" ANSI_RESET);
+        lines.push_back("");
         
         // Search bar
         if (searchMode || !searchQuery.empty()) {
-            std::cout << ANSI_YELLOW << "Search: " << ANSI_RESET 
-                      << searchQuery;
-            if (searchMode) std::cout << "▌";
-            std::cout << "\n";
-            std::cout << ANSI_GRAY << "   " << filteredIndices.size() 
-                      << " of " << items.size() << " items" << ANSI_RESET << "\n\n";
+            lines.push_back(ANSI_YELLOW "Search: " ANSI_RESET + searchQuery + (searchMode ? "▌" : ""));
+            lines.push_back(ANSI_GRAY "   " + std::to_string(filteredIndices.size()) + " of " +
+                            std::to_string(items.size()) + " items" ANSI_RESET);
+            lines.push_back("");
         }
         
         // Calculate visible range
@@ -140,6 +144,10 @@ private:
             scrollOffset = selected - maxVisible + 1;
         }
         
+        if (scrollOffset > 0) {
+            lines.push_back(ANSI_GRAY "     ▲ More items above" ANSI_RESET);
+        }
+        
         // Draw items
         int endIdx = std::min(scrollOffset + maxVisible, (int)filteredIndices.size());
         
@@ -147,55 +155,69 @@ private:
             int actualIdx = filteredIndices[i];
             bool isSelected = (i == selected);
             
-            if (isSelected) {
-                std::cout << ANSI_HIGHLIGHT << " ► ";
-            } else {
-                std::cout << "   ";
+            std::string line = isSelected ? ANSI_HIGHLIGHT " ► " : "   ";
+            if (multiSelect) {
+                line += checked[actualIdx] ? "[x] " : "[ ] ";
             }
-            
-            std::cout << items[actualIdx];
-            
+            line += items[actualIdx];
             if (isSelected) {
-                std::cout << ANSI_RESET;
+                line += ANSI_RESET;
             }
-            
-            std::cout << "\n";
+            lines.push_back(line);
             
             // Show description if available and selected
             if (isSelected && actualIdx < (int)descriptions.size() && 
                 !descriptions[actualIdx].empty()) {
-                std::cout << ANSI_GRAY << "     " << descriptions[actualIdx] 
-                          << ANSI_RESET << "\n";
+                lines.push_back(ANSI_GRAY "     " + descriptions[actualIdx] + ANSI_RESET);
             }
         }
         
-        // Scroll indicators
-        if (scrollOffset > 0) {
-            moveCursor(0, 5);
-            std::cout << ANSI_GRAY << "     ▲ More items above" << ANSI_RESET;
-        }
         if (endIdx < (int)filteredIndices.size()) {
-            std::cout << "\n" << ANSI_GRAY << "     ▼ More items below" << ANSI_RESET;
+            lines.push_back(ANSI_GRAY "     ▼ More items below" ANSI_RESET);
         }
         
         // Controls hint
-        std::cout << "\n\n" << ANSI_GRAY;
-        std::cout << "  [↑↓] Navigate  [Enter] Select  [/] Search  ";
-        std::cout << "[Esc] " << (searchMode ? "Cancel Search" : "Exit");
-        std::cout << ANSI_RESET << "\n";
+        lines.push_back("");
+        std::string hint = ANSI_GRAY "  [↑↓] Navigate  [Enter] Select  [/] Search  ";
+        if (multiSelect) hint += "[Space] Mark  [A] Mark All  ";
+        hint += std::string("[Esc] ") + (searchMode ? "Cancel Search" : "Exit") + ANSI_RESET;
+        lines.push_back(hint);
+        
+        // Lines are cut at the window edge rather than wrapped, so each one
+        // stays on its own row
+        std::string out = "\033[?7l";
+        if (redrawAll) {
+            out += "\033[2J";
+            shownLines.clear();
+            redrawAll = false;
+        }
+        for (size_t row = 0; row < lines.size(); row++) {
+            if (row < shownLines.size() && shownLines[row] == lines[row]) continue;
+            out += "\033[" + std::to_string(row + 1) + ";1H" + lines[row] + "\033[K";
+        }
+        if (lines.size() < shownLines.size()) {
+            out += "\033[" + std::to_string(lines.size() + 1) + ";1H\033[J";
+        }
+        out += "\033[" + std::to_string(lines.size() + 1) + ";1H\033[?7h";
+        std::cout << out << std::flush;
+        shownLines.swap(lines);
     }
     
 public:
     Menu(const std::string& t, int maxVis = 15) 
         : title(t), selected(0), scrollOffset(0), 
-          maxVisible(maxVis), searchMode(false) {
+          maxVisible(maxVis), searchMode(false), multiSelect(false), redrawAll(true) {
         enableANSI();
     }
     
     void addItem(const std::string& item, const std::string& desc = "") {
         items.push_back(item);
         descriptions.push_back(desc);
-        updateFilteredIndices();
+        checked.push_back(false);
+        lowerItems.push_back(toLower(item));
+        if (lowerItems.back().find(filteredFor) != std::string::npos) {
+            filteredIndices.push_back((int)items.size() - 1);
+        }
     }
     
     void setItems(const std::vector<std::string>& newItems, 
@@ -205,8 +227,12 @@ public:
         if (descriptions.size() < items.size()) {
             descriptions.resize(items.size());
         }
+        checked.assign(items.size(), false);
+        lowerItems.clear();
+        for (const auto& item : items) lowerItems.push_back(toLower(item));
         selected = 0;
         scrollOffset = 0;
+        filteredFor.clear();
         updateFilteredIndices();
     }
     
@@ -216,7 +242,8 @@ public:
             return -1;
         }
         
-        updateFilteredIndices();
+        hideCursor();
+        redrawAll = true;
         
         while (true) {
             render();
@@ -264,6 +291,21 @@ public:
                         searchMode = true;
                         break;
                         
+                    case ' ':
+                        if (multiSelect && !searchMode) {
+                            if (!filteredIndices.empty()) {
+                                int idx = filteredIndices[selected];
+                                checked[idx] = !checked[idx];
+                            }
+                            break;
+                        }
+                        if (searchMode) {
+                            searchQuery += ' ';
+                            updateFilteredIndices();
+                            selected = 0;
+                        }
+                        break;
+                        
                     case KEY_BACKSPACE:
                         if (searchMode && !searchQuery.empty()) {
                             searchQuery.pop_back();
@@ -272,6 +314,13 @@ public:
                         break;
                         
                     default:
+                        // Mark or unmark everything currently shown
+                        if (multiSelect && !searchMode && (key == 'a' || key == 'A')) {
+                            bool allChecked = true;
+                            for (int idx : filteredIndices) allChecked = allChecked && checked[idx];
+                            for (int idx : filteredIndices) checked[idx] = !allChecked;
+                            break;
+                        }
                         // Printable characters for search
                         if (searchMode && key >= 32 && key <= 126) {
                             searchQuery += (char)key;
@@ -284,9 +333,24 @@ public:
         }
     }
     
+    // Lets the user mark several items with Space before pressing Enter.
+    void enableMultiSelect() { multiSelect = true; }
+    
+    std::vector<int> getChecked() const {
+        std::vector<int> result;
+        for (size_t i = 0; i < checked.size(); i++) {
+            if (checked[i]) result.push_back((int)i);
+        }
+        return result;
+    }
+    
     void clear() {
         items.clear();
         descriptions.clear();
+        checked.clear();
+        lowerItems.clear();
+        filteredIndices.clear();
+        filteredFor.clear();
         selected = 0;
         scrollOffset = 0;
         searchQuery.clear();
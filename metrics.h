@@ -0,0 +1,278 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "recording.h"
+
+// Counters, gauges and latency histograms for the STATS request.
+//
+// Every thread records into its own shard, a plain array of 64-bit cells
+// that only that thread writes, so recording is a load and a store with no
+// lock and no shared cache line. Readers add the shards up. A shard is handed
+// back when its thread exits and reused by the next new thread, so the count
+// of shards follows the peak number of threads, not the total.
+//
+// Histograms use HDR-style log-linear buckets: exact below 8, then 8 buckets
+// per power of two, so any recorded value is known to within 12.5%. Values
+// from 2^40 up share the last bucket.
+//
+// Everything is registered up front, before any thread records. Names follow
+// Prometheus conventions; labels are given preformatted ("type=\"GET\"").
+
+class Metrics {
+public:
+    static constexpr int SUB_BITS = 3;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr int BUCKETS = (40 - SUB_BITS + 1) * SUB_BUCKETS;
+
+    static int bucketOf(uint64_t value) {
+        if (value < SUB_BUCKETS) return (int)value;
+        int top = 63 - __builtin_clzll(value);
+        int shift = top - SUB_BITS;
+        return std::min((shift + 1) * SUB_BUCKETS + (int)(value >> shift) - SUB_BUCKETS, BUCKETS - 1);
+    }
+
+    // Smallest value of the next bucket, so every value in bucket is below it
+    static uint64_t bucketLimit(int bucket) {
+        if (bucket < SUB_BUCKETS) return (uint64_t)bucket + 1;
+        int shift = bucket / SUB_BUCKETS - 1;
+        return (uint64_t)(bucket % SUB_BUCKETS + SUB_BUCKETS + 1) << shift;
+    }
+
+private:
+    enum Kind { COUNTER, GAUGE, HISTOGRAM, SAMPLED };
+
+    struct Metric {
+        Kind kind;
+        std::string name;
+        std::string labels;
+        std::string help;
+        double scale;  // Multiplies recorded values into the exported unit
+        int cell;      // First cell in a shard
+        std::function<double()> sample;
+    };
+
+    // Histogram cells: count, sum, then BUCKETS buckets
+    static constexpr int HISTOGRAM_CELLS = 2 + BUCKETS;
+
+    struct Shard {
+        std::unique_ptr<std::atomic<uint64_t>[]> cells;
+    };
+
+    std::vector<Metric> metrics;
+    int cellCount = 0;
+    ThreadSlots<Shard> shards;
+
+    // The calling thread's cells
+    std::atomic<uint64_t> *local() {
+        return shards.local([this](size_t) {
+            std::unique_ptr<Shard> shard(new Shard());
+            shard->cells.reset(new std::atomic<uint64_t>[cellCount]());
+            return shard;
+        })->cells.get();
+    }
+
+    static void bump(std::atomic<uint64_t> &cell, uint64_t delta) {
+        cell.store(cell.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    int define(Kind kind, const std::string &name, const std::string &labels, const std::string &help,
+            double scale, int cells) {
+        metrics.push_back({kind, name, labels, help, scale, cellCount, nullptr});
+        cellCount += cells;
+        return (int)metrics.size() - 1;
+    }
+
+    std::vector<uint64_t> totals() const {
+        std::vector<uint64_t> sum(cellCount, 0);
+        shards.forEach([&](const Shard &shard) {
+            for (int i = 0; i < cellCount; i++) sum[i] += shard.cells[i].load(std::memory_order_relaxed);
+        });
+        return sum;
+    }
+
+    // Upper bound of the bucket holding the q-th fraction of the values
+    static uint64_t quantile(const uint64_t *cells, double q) {
+        uint64_t count = cells[0];
+        if (count == 0) return 0;
+        uint64_t rank = (uint64_t)(q * (count - 1)) + 1;
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            seen += cells[2 + b];
+            if (seen >= rank) return bucketLimit(b) - 1;
+        }
+        return UINT64_MAX;
+    }
+
+    static std::string format(double value, int digits = 6) {
+        char text[32];
+        std::snprintf(text, sizeof(text), "%.*g", digits, value);
+        return text;
+    }
+
+    static std::string series(const Metric &metric, const std::string &suffix, const std::string &extra = "") {
+        std::string labels = metric.labels;
+        if (!extra.empty()) labels += (labels.empty() ? "" : ",") + extra;
+        return metric.name + suffix + (labels.empty() ? "" : "{" + labels + "}");
+    }
+
+public:
+    int counter(const std::string &name, const std::string &labels, const std::string &help) {
+        return define(COUNTER, name, labels, help, 1, 1);
+    }
+
+    // Goes up and down; add() with a negative delta, from any thread
+    int gauge(const std::string &name, const std::string &labels, const std::string &help) {
+        return define(GAUGE, name, labels, help, 1, 1);
+    }
+
+    // Read from sample when reported instead of being recorded
+    int sampled(const std::string &name, const std::string &labels, const std::string &help,
+                std::function<double()> sample) {
+        int id = define(SAMPLED, name, labels, help, 1, 0);
+        metrics[id].sample = sample;
+        return id;
+    }
+
+    // Values are recorded as integers (microseconds, bytes, per mille) and
+    // multiplied by scale when exported
+    int histogram(const std::string &name, const std::string &labels, const std::string &help, double scale) {
+        return define(HISTOGRAM, name, labels, help, scale, HISTOGRAM_CELLS);
+    }
+
+    void add(int id, int64_t delta = 1) { bump(local()[metrics[id].cell], (uint64_t)delta); }
+
+    void record(int id, uint64_t value) {
+        std::atomic<uint64_t> *cells = local() + metrics[id].cell;
+        bump(cells[0], 1);
+        bump(cells[1], value);
+        bump(cells[2 + bucketOf(value)], 1);
+    }
+
+    // One line per metric: counters and gauges as their value, histograms
+    // as count, mean and p50/p90/p99/p999/max in the exported unit
+    std::string summary() const {
+        std::vector<uint64_t> sum = totals();
+        std::string out;
+        for (const Metric &metric : metrics) {
+            out += series(metric, "") + " ";
+            const uint64_t *cells = sum.data() + metric.cell;
+            if (metric.kind == COUNTER) {
+                out += std::to_string(cells[0]);
+            } else if (metric.kind == GAUGE) {
+                out += std::to_string((int64_t)cells[0]);
+            } else if (metric.kind == SAMPLED) {
+                out += format(metric.sample());
+            } else {
+                out += "count=" + std::to_string(cells[0]);
+                if (cells[0] > 0) {
+                    out += " mean=" + format((double)cells[1] / cells[0] * metric.scale);
+                    const char *names[] = {"p50", "p90", "p99", "p999", "max"};
+                    const double points[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+                    for (int i = 0; i < 5; i++) {
+                        out += std::string(" ") + names[i] + "=" + format(quantile(cells, points[i]) * metric.scale);
+                    }
+                }
+            }
+            out += "\n";
+        }
+        return out;
+    }
+
+    // Prometheus text exposition format. Every power of two starts a bucket,
+    // so the buckets below 2^k hold exactly the values up to 2^k - 1, and
+    // that is the inclusive bound reported as le.
+    std::string prometheus() const {
+        std::vector<uint64_t> sum = totals();
+        std::string out;
+        std::string described;
+        for (const Metric &metric : metrics) {
+            if (metric.name != described) {
+                static const char *types[] = {"counter", "gauge", "histogram", "gauge"};
+                out += "# HELP " + metric.name + " " + metric.help + "\n";
+                out += "# TYPE " + metric.name + " " + types[metric.kind] + "\n";
+                described = metric.name;
+            }
+            const uint64_t *cells = sum.data() + metric.cell;
+            if (metric.kind == COUNTER) {
+                out += series(metric, "") + " " + std::to_string(cells[0]) + "\n";
+            } else if (metric.kind == GAUGE) {
+                out += series(metric, "") + " " + std::to_string((int64_t)cells[0]) + "\n";
+            } else if (metric.kind == SAMPLED) {
+                out += series(metric, "") + " " + format(metric.sample()) + "\n";
+            } else {
+                int last = 0;
+                for (int b = 0; b < BUCKETS; b++) {
+                    if (cells[2 + b]) last = b;
+                }
+                uint64_t cumulative = 0;
+                int b = 0;
+                for (int power = 0; power < 64; power++) {
+                    uint64_t limit = 1ull << power;
+                    // The last bucket has no upper bound and is only in +Inf
+                    while (b < BUCKETS - 1 && bucketLimit(b) <= limit) cumulative += cells[2 + b++];
+                    out += series(metric, "_bucket", "le=\"" + format((limit - 1) * metric.scale, 15) + "\"") + " " +
+                           std::to_string(cumulative) + "\n";
+                    if (b > last || b == BUCKETS - 1) break;
+                }
+                out += series(metric, "_bucket", "le=\"+Inf\"") + " " + std::to_string(cells[0]) + "\n";
+                out += series(metric, "_sum") + " " + format(cells[1] * metric.scale) + "\n";
+                out += series(metric, "_count") + " " + std::to_string(cells[0]) + "\n";
+            }
+        }
+        return out;
+    }
+};
+
+// Mutex that counts its acquisitions and, when it had to wait, how long.
+// The uncontended path is one try_lock and a counter bump.
+class MeteredMutex {
+private:
+    std::mutex mutex;
+    Metrics *metrics = nullptr;
+    int acquired = -1;
+    int contended = -1;
+    int waited = -1;
+
+public:
+    // waitHistogram is in microseconds
+    void meter(Metrics &registry, int acquiredCounter, int contendedCounter, int waitHistogram) {
+        metrics = &registry;
+        acquired = acquiredCounter;
+        contended = contendedCounter;
+        waited = waitHistogram;
+    }
+
+    void lock() {
+        if (!mutex.try_lock()) {
+            auto start = std::chrono::steady_clock::now();
+            mutex.lock();
+            if (metrics) {
+                metrics->add(contended);
+                metrics->record(waited, (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+                                            std::chrono::steady_clock::now() - start).count());
+            }
+        }
+        if (metrics) metrics->add(acquired);
+    }
+
+    bool try_lock() {
+        if (!mutex.try_lock()) return false;
+        if (metrics) metrics->add(acquired);
+        return true;
+    }
+
+    void unlock() { mutex.unlock(); }
+};
+
+#endif // METRICS_H
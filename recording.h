@@ -0,0 +1,90 @@
+#ifndef RECORDING_H
+#define RECORDING_H
+
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Pieces shared by the recorders in metrics.h, logger.h and trace.h.
+
+// One Slot per thread, so a recorder's hot path writes memory no other
+// thread writes and takes no lock. A thread takes a slot the first time it
+// records and hands it back when it exits; the next new thread reuses it, so
+// the count of slots follows the peak number of threads, not the total.
+//
+// The pool is shared with the threads' holders, so a thread that outlives the
+// recorder (a detached handler at exit) can still hand its slot back.
+template <typename Slot>
+class ThreadSlots {
+private:
+    struct Pool {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<Slot>> slots;
+        std::vector<Slot *> free;
+
+        void release(Slot *slot) {
+            std::lock_guard<std::mutex> lock(mutex);
+            free.push_back(slot);
+        }
+    };
+
+    struct Holder {
+        std::shared_ptr<Pool> pool;
+        Slot *slot = nullptr;
+        ~Holder() {
+            if (pool) pool->release(slot);
+        }
+    };
+
+    std::shared_ptr<Pool> pool = std::make_shared<Pool>();
+
+public:
+    // The calling thread's slot. make(n) builds the n-th slot when none is
+    // free; it runs under the pool's lock.
+    template <typename Make>
+    Slot *local(Make make) {
+        static thread_local Holder holder;
+        if (holder.pool != pool) {
+            if (holder.pool) holder.pool->release(holder.slot);
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            if (!pool->free.empty()) {
+                holder.slot = pool->free.back();
+                pool->free.pop_back();
+            } else {
+                pool->slots.emplace_back(make(pool->slots.size()));
+                holder.slot = pool->slots.back().get();
+            }
+            holder.pool = pool;
+        }
+        return holder.slot;
+    }
+
+    // Calls visit(slot) for every slot, in use or free, under the pool's lock
+    template <typename Visit>
+    void forEach(Visit visit) const {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        for (const auto &slot : pool->slots) visit(*slot);
+    }
+};
+
+// value as a JSON string literal, quotes included
+inline std::string jsonQuote(const std::string &value) {
+    std::string out = "\"";
+    for (unsigned char c : value) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += (char)c;
+        } else if (c < 0x20) {
+            char escape[8];
+            std::snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out += escape;
+        } else {
+            out += (char)c;
+        }
+    }
+    return out + "\"";
+}
+
+#endif // RECORDING_H
@@ -3,13 +3,22 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <list>
+#include <functional>
 #include <thread>
+#include <chrono>
 #include <mutex>
 #include <atomic>
+#include <condition_variable>
 #include <sstream>
 #include <iomanip>
 #include <filesystem>
 #include <algorithm>
+#include <memory>
+#include <cstring>
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <conio.h>
@@ -18,6 +27,12 @@
 #include <openssl/sha.h>
 #include <openssl/evp.h>
 
+#include "delta.h"
+#include "catalog.h"
+#include "metrics.h"
+#include "logger.h"
+#include "trace.h"
+
 #pragma comment(lib, "ws2_32.lib")
 #pragma comment(lib, "zlib.lib")
 #pragma comment(lib, "libcrypto.lib")
@@ -28,12 +43,961 @@ const int DEFAULT_PORT = 8080;
 const int CHUNK_SIZE = 65536;
 const std::string CONFIG_FILE = "server_config.txt";
 const int MAX_CONNECTIONS = 50;
+const DWORD KEEPALIVE_IDLE_MS = 30000;
+
+// Content-defined chunking bounds (FastCDC normalized chunking)
+const size_t CDC_MIN_CHUNK = 16 * 1024;
+const size_t CDC_AVG_CHUNK = 64 * 1024;
+const size_t CDC_MAX_CHUNK = 256 * 1024;
+const size_t MANIFEST_ENTRY_SIZE = sizeof(uint32_t) + SHA256_DIGEST_LENGTH;
+
+// Catalog listing (LISTB)
+const size_t LIST_PAGE_DEFAULT = 1000;
+const size_t LIST_PAGE_MAX = 10000;
+const size_t CHANGE_LOG_LIMIT = 100000;
+
+// Catalog change subscriptions (SUBSCRIBE)
+const int MAX_SUBSCRIBERS = 64;
+const size_t SUBSCRIBER_QUEUE_LIMIT = 1024;
+const int SUBSCRIBER_PING_SECONDS = 30;
+const DWORD SUBSCRIBER_SEND_TIMEOUT_MS = 10000;
+
+// Block cache
+const size_t CACHE_BLOCK_SIZE = 256 * 1024;
+const int CACHE_SHARDS = 16;
+const std::string POPULARITY_FILE = "cache_popularity.txt";
+
+// Shared folder watching
+const DWORD WATCH_POLL_MS = 250;
+const int WATCH_SETTLE_MS = 2000;         // Quiet time before a changed path is applied
+const DWORD WATCH_BUFFER_SIZE = 64 * 1024;
+
+// Memory-mapped I/O (io_backend=mmap)
+const size_t MMAP_WINDOW = 64 * 1024 * 1024;
+
+// Unbuffered reads of very large files (direct_io_mb)
+const size_t DIRECT_IO_ALIGNMENT = 4096;  // A multiple of the sector size of 512e and 4Kn disks
+const size_t DIRECT_IO_BUFFER = 1024 * 1024;
+
+// Read-ahead in sendFile (prefetch_depth)
+const size_t PREFETCH_MIN_DEPTH = 2;
+const size_t PREFETCH_MIN_LENGTH = 1024 * 1024;  // Shorter ranges are read inline
+
+// Shared reading of uncached files by concurrent transfers
+const size_t SHARED_READER_WINDOW = 256;    // Chunks kept for followers (16 MB)
+const size_t SHARED_ATTACH_AHEAD = 16;      // How many chunks ahead of a reader a transfer may start
+const size_t READERS_SWEEP_MIN = 64;        // Files tracked before finished readers are swept
+
+// Finds content-defined chunk boundaries with a gear rolling hash, so an edit
+// only changes the chunks around it and identical regions of different files
+// produce identical chunks. Below the average size a stricter mask is used and
+// above it a looser one, which keeps chunk sizes close to CDC_AVG_CHUNK.
+class ContentChunker {
+private:
+    static const uint64_t MASK_SMALL = 0xFFFFC00000000000ULL;  // 18 bits
+    static const uint64_t MASK_LARGE = 0xFFFC000000000000ULL;  // 14 bits
+
+    static const uint64_t *gearTable() {
+        static uint64_t table[256];
+        static bool ready = [] {
+            uint64_t seed = 0x9E3779B97F4A7C15ULL;
+            for (int i = 0; i < 256; i++) {
+                // Fixed splitmix64 sequence, so every server cuts identical chunks
+                uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                table[i] = z ^ (z >> 31);
+            }
+            return true;
+        }();
+        (void)ready;
+        return table;
+    }
+
+public:
+    // Length of the chunk starting at data. The caller passes at least
+    // CDC_MAX_CHUNK bytes unless it is at the end of the file.
+    static size_t nextChunk(const unsigned char *data, size_t length) {
+        if (length <= CDC_MIN_CHUNK) return length;
+
+        const uint64_t *gear = gearTable();
+        size_t limit = std::min(length, CDC_MAX_CHUNK);
+        size_t normal = std::min(limit, CDC_AVG_CHUNK);
+        uint64_t hash = 0;
+        size_t i = CDC_MIN_CHUNK;
+
+        for (; i < normal; i++) {
+            hash = (hash << 1) + gear[data[i]];
+            if (!(hash & MASK_SMALL)) return i + 1;
+        }
+        for (; i < limit; i++) {
+            hash = (hash << 1) + gear[data[i]];
+            if (!(hash & MASK_LARGE)) return i + 1;
+        }
+        return limit;
+    }
+};
 
-struct FileInfo {
+// One catalog mutation. Only the name is kept; LISTB SINCE reports the
+// entry's current state, so repeated changes to one file collapse into one.
+struct CatalogChange {
+    uint64_t version;
     std::string filename;
-    std::string filepath;
-    size_t filesize;
-    std::string sha256;
+};
+
+// Pending events of one SUBSCRIBE connection. A subscriber that falls
+// SUBSCRIBER_QUEUE_LIMIT events behind has its queue replaced by a single
+// RESYNC; one that stops reading is dropped when a send times out.
+struct Subscriber {
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<std::string> events;
+    bool resync = false;
+    uint64_t resyncVersion = 0;
+    bool closed = false;
+};
+
+// Fixed-size file blocks kept in memory, keyed by (file id, block index) and
+// spread over shards with their own locks. Each shard runs 2Q: a new block
+// enters the FIFO A1in and only reaches the LRU main queue Am if it is asked
+// for again after leaving A1in, which the ghost list A1out remembers. A
+// one-off pass over a large file cycles through A1in without pushing the hot
+// set out of Am. Concurrent misses on one block wait for a single disk read.
+class BlockCache {
+public:
+    struct Block {
+        std::vector<char> data;
+        bool ready = false;
+        bool failed = false;
+    };
+    typedef std::shared_ptr<Block> BlockPtr;
+    typedef std::function<bool(std::vector<char> &)> Loader;
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t misses;
+        uint64_t joined;        // Misses that waited for another request's read
+        uint64_t evictions;
+        uint64_t bytesLoaded;   // Read from disk
+        size_t bytesCached;
+    };
+
+private:
+    enum QueueId { QUEUE_IN, QUEUE_MAIN };
+
+    // The whole 64-bit file id: ids grow with every add and rehash
+    typedef std::pair<uint64_t, uint64_t> Key;  // File id, block index
+
+    struct KeyHash {
+        size_t operator()(const Key &key) const {
+            uint64_t hash = key.first * 0x9E3779B97F4A7C15ull ^ (key.second + 0x632BE59BD9B4E019ull);
+            hash ^= hash >> 32;
+            return (size_t)(hash * 0xD6E8FEB86659FD93ull);
+        }
+    };
+
+    struct Entry {
+        BlockPtr block;
+        QueueId queue;
+        std::list<Key>::iterator position;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::condition_variable loaded;
+        std::unordered_map<Key, Entry, KeyHash> entries;
+        std::list<Key> in;         // A1in, newest first
+        std::list<Key> main;       // Am, most recently used first
+        std::list<Key> ghosts;     // A1out, keys of blocks evicted from A1in
+        std::unordered_map<Key, std::list<Key>::iterator, KeyHash> ghostIndex;
+        size_t inBytes = 0;
+        size_t mainBytes = 0;
+    };
+
+    Shard shards[CACHE_SHARDS];
+    size_t shardBudget;
+    size_t ghostLimit;
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> joined{0};
+    std::atomic<uint64_t> evictions{0};
+    std::atomic<uint64_t> bytesLoaded{0};
+
+    Shard &shardFor(const Key &key) {
+        return shards[(KeyHash()(key) >> 32) % CACHE_SHARDS];
+    }
+
+    std::list<Key> &queueOf(Shard &shard, QueueId queue) {
+        return queue == QUEUE_IN ? shard.in : shard.main;
+    }
+
+    size_t &bytesOf(Shard &shard, QueueId queue) {
+        return queue == QUEUE_IN ? shard.inBytes : shard.mainBytes;
+    }
+
+    void remember(Shard &shard, const Key &key) {
+        shard.ghosts.push_front(key);
+        shard.ghostIndex[key] = shard.ghosts.begin();
+        if (shard.ghosts.size() > ghostLimit) {
+            shard.ghostIndex.erase(shard.ghosts.back());
+            shard.ghosts.pop_back();
+        }
+    }
+
+    // A1in is kept to a quarter of the shard; everything else is evicted from
+    // the cold end of Am.
+    void evictLocked(Shard &shard) {
+        while (shard.inBytes + shard.mainBytes > shardBudget) {
+            bool fromIn = !shard.in.empty() && (shard.inBytes > shardBudget / 4 || shard.main.empty());
+            std::list<Key> &queue = fromIn ? shard.in : shard.main;
+            if (queue.empty()) break;
+
+            Key key = queue.back();
+            queue.pop_back();
+            auto it = shard.entries.find(key);
+            if (it != shard.entries.end()) {
+                if (it->second.block->ready) {
+                    bytesOf(shard, it->second.queue) -= it->second.block->data.size();
+                }
+                shard.entries.erase(it);
+            }
+            if (fromIn) remember(shard, key);
+            evictions++;
+        }
+    }
+
+public:
+    explicit BlockCache(size_t budgetBytes) {
+        shardBudget = std::max(budgetBytes / CACHE_SHARDS, CACHE_BLOCK_SIZE);
+        ghostLimit = std::max<size_t>(shardBudget / CACHE_BLOCK_SIZE / 2, 16);
+    }
+
+    // The block, loaded through loader on a miss; nullptr if loading failed.
+    BlockPtr get(uint64_t fileId, uint64_t blockIndex, const Loader &loader) {
+        Key key(fileId, blockIndex);
+        Shard &shard = shardFor(key);
+        std::unique_lock<std::mutex> lock(shard.mutex);
+
+        auto it = shard.entries.find(key);
+        if (it != shard.entries.end()) {
+            BlockPtr block = it->second.block;
+            if (!block->ready) {
+                joined++;
+                shard.loaded.wait(lock, [&block] { return block->ready || block->failed; });
+                return block->failed ? nullptr : block;
+            }
+            hits++;
+            if (it->second.queue == QUEUE_MAIN) {
+                shard.main.splice(shard.main.begin(), shard.main, it->second.position);
+            }
+            return block;
+        }
+
+        misses++;
+        QueueId queue = QUEUE_IN;
+        auto ghost = shard.ghostIndex.find(key);
+        if (ghost != shard.ghostIndex.end()) {
+            shard.ghosts.erase(ghost->second);
+            shard.ghostIndex.erase(ghost);
+            queue = QUEUE_MAIN;
+        }
+
+        BlockPtr block = std::make_shared<Block>();
+        std::list<Key> &list = queueOf(shard, queue);
+        list.push_front(key);
+        shard.entries[key] = {block, queue, list.begin()};
+
+        lock.unlock();
+        bool ok = loader(block->data);
+        lock.lock();
+
+        it = shard.entries.find(key);
+        bool cached = (it != shard.entries.end() && it->second.block == block);
+        if (ok) {
+            block->ready = true;
+            bytesLoaded += block->data.size();
+            if (cached) {
+                bytesOf(shard, it->second.queue) += block->data.size();
+                evictLocked(shard);
+            }
+        } else {
+            block->failed = true;
+            if (cached) {
+                queueOf(shard, it->second.queue).erase(it->second.position);
+                shard.entries.erase(it);
+            }
+        }
+        shard.loaded.notify_all();
+        return ok ? block : nullptr;
+    }
+
+    Stats stats() {
+        Stats result = {hits, misses, joined, evictions, bytesLoaded, 0};
+        for (auto &shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            result.bytesCached += shard.inBytes + shard.mainBytes;
+        }
+        return result;
+    }
+
+    size_t budget() const { return shardBudget * CACHE_SHARDS; }
+};
+
+// Runs fn(context), turning the EXCEPTION_IN_PAGE_ERROR raised when a mapped
+// page can no longer be read (the file was truncated on a network share, the
+// disk failed) into a false return. __try cannot share a frame with C++
+// objects, so callers pass a plain function and a context struct.
+#ifdef _MSC_VER
+const bool MAPPED_IO_GUARDED = true;
+
+static bool guardedMappedAccess(void (*fn)(void *), void *context) {
+    __try {
+        fn(context);
+        return true;
+    } __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER
+                                                               : EXCEPTION_CONTINUE_SEARCH) {
+        return false;
+    }
+}
+#else
+// g++ (build.bat) has no structured exception handling, so a failed page read
+// cannot be caught and would end the process. These builds never map files:
+// io_backend=mmap falls back to stream (see useMapping()), and the guard only
+// ever sees ordinary buffers.
+const bool MAPPED_IO_GUARDED = false;
+
+static bool guardedMappedAccess(void (*fn)(void *), void *context) {
+    fn(context);
+    return true;
+}
+#endif
+
+// Read-only mapping of a file, seen through one MMAP_WINDOW view at a time so
+// multi-GB files never need that much address space. The handle is opened for
+// sequential scan, and each new view is prefetched (the Windows counterpart of
+// MADV_WILLNEED) over the part of it inside the range the caller advised.
+// Pointers from view() stay valid until the next view() call; reading through
+// them must go through guardedMappedAccess, e.g. via touch() or copy().
+class MappedFile {
+private:
+    struct PrefetchRange {      // WIN32_MEMORY_RANGE_ENTRY
+        void *address;
+        SIZE_T bytes;
+    };
+    typedef BOOL (WINAPI *PrefetchFn)(HANDLE, ULONG_PTR, PrefetchRange *, ULONG);
+
+    struct CopyRequest {
+        char *dest;
+        const char *source;
+        size_t length;
+    };
+
+    HANDLE file;
+    HANDLE mapping;
+    const char *base;
+    size_t baseOffset;
+    size_t baseLength;
+    size_t fileSize;
+    size_t adviseStart;
+    size_t adviseEnd;
+
+    static size_t granularity() {
+        static size_t value = [] {
+            SYSTEM_INFO info;
+            GetSystemInfo(&info);
+            return (size_t)info.dwAllocationGranularity;
+        }();
+        return value;
+    }
+
+    // PrefetchVirtualMemory needs Windows 8, so it is looked up at runtime
+    static PrefetchFn prefetchFunction() {
+        static PrefetchFn fn = (PrefetchFn)GetProcAddress(GetModuleHandleA("kernel32.dll"),
+                                                          "PrefetchVirtualMemory");
+        return fn;
+    }
+
+    void prefetch() {
+        size_t start = std::max(baseOffset, adviseStart);
+        size_t end = std::min(baseOffset + baseLength, adviseEnd);
+        PrefetchFn fn = prefetchFunction();
+        if (!fn || start >= end) return;
+        PrefetchRange range = {(void *)(base + (start - baseOffset)), end - start};
+        fn(GetCurrentProcess(), 1, &range, 0);
+    }
+
+    void unmap() {
+        if (base) UnmapViewOfFile(base);
+        base = nullptr;
+    }
+
+    static void touchPages(void *context) {
+        const CopyRequest *request = (const CopyRequest *)context;
+        volatile char sink = 0;
+        for (size_t i = 0; i < request->length; i += 4096) sink ^= request->source[i];
+        if (request->length > 0) sink ^= request->source[request->length - 1];
+        (void)sink;
+    }
+
+    static void copyBytes(void *context) {
+        const CopyRequest *request = (const CopyRequest *)context;
+        std::memcpy(request->dest, request->source, request->length);
+    }
+
+public:
+    MappedFile()
+        : file(INVALID_HANDLE_VALUE), mapping(nullptr), base(nullptr), baseOffset(0),
+          baseLength(0), fileSize(0), adviseStart(0), adviseEnd(SIZE_MAX) {}
+
+    ~MappedFile() {
+        unmap();
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const std::string &path) {
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return false;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size)) return false;
+        fileSize = (size_t)size.QuadPart;
+        if (fileSize == 0) return true;  // Empty files cannot be mapped; there is nothing to view
+
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        return mapping != nullptr;
+    }
+
+    bool isOpen() const { return file != INVALID_HANDLE_VALUE; }
+    size_t size() const { return fileSize; }
+
+    // Limits prefetching to the bytes the caller is going to read
+    void advise(size_t offset, size_t length) {
+        adviseStart = offset;
+        adviseEnd = offset + length;
+    }
+
+    // Pointer to offset with at least min(minBytes, size() - offset) bytes
+    // behind it; span is set to everything the current view holds from there.
+    // minBytes must stay well below MMAP_WINDOW.
+    const char *view(size_t offset, size_t minBytes, size_t &span) {
+        if (!mapping || offset >= fileSize) return nullptr;
+        size_t needed = std::min(minBytes, fileSize - offset);
+        if (!base || offset < baseOffset || offset + needed > baseOffset + baseLength) {
+            unmap();
+            baseOffset = offset / granularity() * granularity();
+            baseLength = std::min(MMAP_WINDOW, fileSize - baseOffset);
+            base = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, (DWORD)((uint64_t)baseOffset >> 32),
+                                               (DWORD)baseOffset, baseLength);
+            if (!base) return nullptr;
+            prefetch();
+        }
+        span = baseOffset + baseLength - offset;
+        return base + (offset - baseOffset);
+    }
+
+    // Faults in every page of [data, data + length); false if one is unreadable
+    static bool touch(const char *data, size_t length) {
+        CopyRequest request = {nullptr, data, length};
+        return guardedMappedAccess(touchPages, &request);
+    }
+
+    static bool copy(char *dest, const char *data, size_t length) {
+        CopyRequest request = {dest, data, length};
+        return guardedMappedAccess(copyBytes, &request);
+    }
+};
+
+// Supplies one byte range of a file to sendFile, in pieces of at most
+// maxBytes. A piece stays valid until the next call.
+class ChunkSource {
+public:
+    virtual ~ChunkSource() {}
+    virtual bool next(size_t maxBytes, const char *&data, size_t &length) = 0;
+};
+
+// Reads the range straight from the file through a private buffer.
+class StreamChunkSource : public ChunkSource {
+private:
+    std::ifstream file;
+    std::vector<char> buffer;
+    size_t remaining;
+
+public:
+    StreamChunkSource(const std::string &path, size_t offset, size_t length)
+        : file(path, std::ios::binary), buffer(CHUNK_SIZE), remaining(length) {
+        file.seekg(offset, std::ios::beg);
+    }
+
+    bool next(size_t maxBytes, const char *&data, size_t &length) override {
+        size_t want = std::min({maxBytes, remaining, buffer.size()});
+        if (want == 0 || !file.read(buffer.data(), want)) return false;
+        data = buffer.data();
+        length = want;
+        remaining -= want;
+        return true;
+    }
+};
+
+// Hands out pieces straight from the mapped file, so nothing is copied before
+// send(). Each piece is faulted in under the guard first, and a file that has
+// become unreadable ends the transfer early instead of taking the server down.
+class MmapChunkSource : public ChunkSource {
+private:
+    MappedFile file;
+    size_t position;
+    size_t end;
+
+public:
+    MmapChunkSource(const std::string &path, size_t offset, size_t length)
+        : position(offset), end(offset + length) {
+        if (!file.open(path)) end = 0;
+        file.advise(offset, length);
+    }
+
+    bool next(size_t maxBytes, const char *&data, size_t &length) override {
+        if (position >= end) return false;
+        size_t span;
+        const char *view = file.view(position, 1, span);
+        if (!view) return false;
+        length = std::min({maxBytes, end - position, span});
+        if (!MappedFile::touch(view, length)) return false;
+        data = view;
+        position += length;
+        return true;
+    }
+};
+
+// Streams the range with FILE_FLAG_NO_BUFFERING, so a huge file goes from
+// disk to the socket without passing through, and flushing out, the system
+// file cache. Unbuffered reads must be sector aligned in offset, size and
+// memory, so the range is widened to DIRECT_IO_ALIGNMENT and read into two
+// VirtualAlloc'd buffers: while one is being sent, an overlapped read fills
+// the other.
+class DirectChunkSource : public ChunkSource {
+private:
+    HANDLE file;
+    HANDLE readDone;
+    OVERLAPPED overlapped;
+    char *buffers[2];
+    int current;            // Buffer pieces are handed out from
+    size_t currentLength;   // Bytes read into it
+    size_t currentPosition;
+    size_t readOffset;      // File offset of the next read
+    size_t skip;            // Bytes before the range start in the first read
+    size_t remaining;
+    bool pending;
+
+    // Starts filling the buffer that is not being handed out
+    bool startRead() {
+        ZeroMemory(&overlapped, sizeof(overlapped));
+        overlapped.Offset = (DWORD)readOffset;
+        overlapped.OffsetHigh = (DWORD)((uint64_t)readOffset >> 32);
+        overlapped.hEvent = readDone;
+        if (!ReadFile(file, buffers[1 - current], (DWORD)DIRECT_IO_BUFFER, nullptr, &overlapped) &&
+            GetLastError() != ERROR_IO_PENDING) {
+            return false;
+        }
+        pending = true;
+        readOffset += DIRECT_IO_BUFFER;
+        return true;
+    }
+
+    // Waits for the read in flight and makes its buffer the current one
+    bool finishRead() {
+        DWORD bytesRead = 0;
+        pending = false;
+        if (!GetOverlappedResult(file, &overlapped, &bytesRead, TRUE) && GetLastError() != ERROR_HANDLE_EOF) {
+            return false;
+        }
+        current = 1 - current;
+        currentLength = bytesRead;
+        currentPosition = skip;
+        skip = 0;
+        return currentPosition < currentLength;
+    }
+
+public:
+    DirectChunkSource(const std::string &path, size_t offset, size_t length)
+        : readDone(nullptr), current(1), currentLength(0), currentPosition(0),
+          readOffset(offset / DIRECT_IO_ALIGNMENT * DIRECT_IO_ALIGNMENT), remaining(length), pending(false) {
+        skip = offset - readOffset;
+        buffers[0] = (char *)VirtualAlloc(nullptr, 2 * DIRECT_IO_BUFFER, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        buffers[1] = buffers[0] ? buffers[0] + DIRECT_IO_BUFFER : nullptr;
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           nullptr, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING | FILE_FLAG_OVERLAPPED, nullptr);
+        if (file != INVALID_HANDLE_VALUE) readDone = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        if (isOpen()) startRead();
+    }
+
+    ~DirectChunkSource() {
+        if (pending) {
+            // The buffer must not be freed while the kernel may still write to it
+            DWORD bytesRead;
+            CancelIo(file);
+            GetOverlappedResult(file, &overlapped, &bytesRead, TRUE);
+        }
+        if (readDone) CloseHandle(readDone);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        if (buffers[0]) VirtualFree(buffers[0], 0, MEM_RELEASE);
+    }
+
+    DirectChunkSource(const DirectChunkSource &) = delete;
+    DirectChunkSource &operator=(const DirectChunkSource &) = delete;
+
+    bool isOpen() const { return file != INVALID_HANDLE_VALUE && readDone && buffers[0]; }
+
+    bool next(size_t maxBytes, const char *&data, size_t &length) override {
+        if (remaining == 0) return false;
+        if (currentPosition >= currentLength) {
+            if (!pending || !finishRead()) return false;
+            if (remaining > currentLength - currentPosition && !startRead()) return false;
+        }
+        length = std::min({maxBytes, remaining, currentLength - currentPosition});
+        data = buffers[current] + currentPosition;
+        currentPosition += length;
+        remaining -= length;
+        return true;
+    }
+};
+
+// Serves the range out of the block cache. Missing blocks are read from the
+// file, which is only opened on the first miss, through a stream or, with
+// mapped set, a mapping of the file.
+class CachedChunkSource : public ChunkSource {
+private:
+    BlockCache &cache;
+    const FileInfo &info;
+    size_t position;
+    size_t end;
+    bool mapped;
+    std::ifstream file;
+    MappedFile mapping;
+    BlockCache::BlockPtr block;
+    size_t blockStart;
+
+    bool loadMapped(std::vector<char> &out) {
+        if (!mapping.isOpen()) {
+            if (!mapping.open(info.filepath)) return false;
+            mapping.advise(position, end - position);
+        }
+        size_t span;
+        const char *view = mapping.view(blockStart, out.size(), span);
+        return view && span >= out.size() && MappedFile::copy(out.data(), view, out.size());
+    }
+
+public:
+    CachedChunkSource(BlockCache &c, const FileInfo &fileInfo, size_t offset, size_t length,
+                      bool useMapping = false)
+        : cache(c), info(fileInfo), position(offset), end(offset + length), mapped(useMapping),
+          blockStart(0) {}
+
+    bool next(size_t maxBytes, const char *&data, size_t &length) override {
+        if (position >= end) return false;
+
+        if (!block || position < blockStart || position >= blockStart + block->data.size()) {
+            uint64_t index = position / CACHE_BLOCK_SIZE;
+            blockStart = (size_t)index * CACHE_BLOCK_SIZE;
+            block = cache.get(info.id, index, [this](std::vector<char> &out) {
+                if (!mapped && !file.is_open()) file.open(info.filepath, std::ios::binary);
+                out.resize(std::min(CACHE_BLOCK_SIZE, info.filesize - blockStart));
+                if (mapped) return loadMapped(out);
+                file.clear();
+                file.seekg(blockStart, std::ios::beg);
+                return (bool)file.read(out.data(), out.size());
+            });
+            if (!block) return false;
+        }
+
+        size_t inBlock = position - blockStart;
+        length = std::min({maxBytes, end - position, block->data.size() - inBlock});
+        if (length == 0) return false;
+        data = block->data.data() + inBlock;
+        position += length;
+        return true;
+    }
+};
+
+// Reads ahead of the sender: an I/O thread pulls pieces of the wrapped source
+// into a ring of CHUNK_SIZE slots while sendFile drains it, so disk and
+// network waits overlap instead of adding up. How many slots the reader may
+// fill follows the observed read latency: enough to cover one read at the
+// rate the sender drains the ring, plus one, between PREFETCH_MIN_DEPTH and
+// the configured maximum. A sender that finds the ring empty doubles it;
+// otherwise it shrinks by at most one slot per read.
+class PrefetchChunkSource : public ChunkSource {
+private:
+    struct Slot {
+        std::vector<char> data;
+        size_t length = 0;
+    };
+
+    std::unique_ptr<ChunkSource> source;
+    std::vector<Slot> slots;
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t head;            // Slot the sender is reading
+    size_t count;           // Filled slots, including the one being read
+    size_t consumed;        // Bytes of the head slot already handed out
+    bool holding;           // The head slot has been handed out
+    size_t depth;
+    bool finished;          // The source is exhausted or failed
+    bool stopping;
+    double readSeconds;     // Moving averages of one read and of the
+    double drainSeconds;    // sender's time between two pieces
+    std::chrono::steady_clock::time_point lastHandout;
+    std::thread reader;
+
+    void readLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            if (count >= depth) {
+                changed.wait(lock);
+                continue;
+            }
+            Slot &slot = slots[(head + count) % slots.size()];
+            lock.unlock();
+
+            auto start = std::chrono::steady_clock::now();
+            const char *data;
+            size_t length = 0;
+            bool ok = source->next(CHUNK_SIZE, data, length);
+            if (ok) {
+                slot.data.resize(CHUNK_SIZE);
+                std::memcpy(slot.data.data(), data, length);
+                slot.length = length;
+            }
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+            lock.lock();
+            if (!ok) {
+                finished = true;
+                changed.notify_all();
+                return;
+            }
+            count++;
+            readSeconds = readSeconds == 0 ? seconds : 0.8 * readSeconds + 0.2 * seconds;
+            if (drainSeconds > 0) {
+                size_t wanted = (size_t)std::ceil(readSeconds / drainSeconds) + 1;
+                wanted = std::min(std::max(wanted, PREFETCH_MIN_DEPTH), slots.size());
+                depth = std::max(wanted, depth - (depth > PREFETCH_MIN_DEPTH ? 1 : 0));
+            }
+            changed.notify_all();
+        }
+    }
+
+public:
+    PrefetchChunkSource(std::unique_ptr<ChunkSource> wrapped, size_t maxDepth)
+        : source(std::move(wrapped)), slots(std::max(maxDepth, PREFETCH_MIN_DEPTH)), head(0), count(0),
+          consumed(0), holding(false), depth(PREFETCH_MIN_DEPTH), finished(false), stopping(false),
+          readSeconds(0), drainSeconds(0) {
+        reader = std::thread(&PrefetchChunkSource::readLoop, this);
+    }
+
+    ~PrefetchChunkSource() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        reader.join();
+    }
+
+    bool next(size_t maxBytes, const char *&data, size_t &length) override {
+        std::unique_lock<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        if (holding) {
+            double seconds = std::chrono::duration<double>(now - lastHandout).count();
+            drainSeconds = drainSeconds == 0 ? seconds : 0.8 * drainSeconds + 0.2 * seconds;
+            holding = false;
+            if (consumed == slots[head].length) {
+                head = (head + 1) % slots.size();
+                count--;
+                consumed = 0;
+                changed.notify_all();
+            }
+        }
+
+        if (count == 0 && !finished) {
+            depth = std::min(depth * 2, slots.size());
+            changed.notify_all();
+            changed.wait(lock, [this] { return count > 0 || finished; });
+        }
+        if (count == 0) return false;
+
+        const Slot &slot = slots[head];
+        length = std::min(maxBytes, slot.length - consumed);
+        data = slot.data.data() + consumed;
+        consumed += length;
+        holding = true;
+        lastHandout = std::chrono::steady_clock::now();
+        return true;
+    }
+};
+
+// One sequential read of a file, shared by every transfer of it that starts
+// close enough behind or just ahead of it. The file is read once, in
+// CHUNK_SIZE chunks that live in reference-counted buffers; the last
+// SHARED_READER_WINDOW of them are kept for slower transfers. Whichever
+// transfer first needs a chunk that has not been read yet reads it while
+// the others wait, so the reader runs at the pace of the fastest client
+// and nobody waits for the slowest. A transfer that falls out of the
+// window is told so and carries on with a reader of its own.
+class SharedReader {
+public:
+    typedef std::shared_ptr<const std::vector<char>> Chunk;
+
+private:
+    std::mutex mutex;
+    std::condition_variable readDone;
+    std::unique_ptr<ChunkSource> source;
+    size_t start;               // File offset of chunk 0
+    size_t fileSize;
+    std::deque<Chunk> window;   // Chunks firstIndex .. firstIndex + window.size() - 1
+    size_t firstIndex;
+    bool reading;
+    bool exhausted;             // End of file reached or a read failed
+    std::atomic<uint64_t> &bytesRead;
+    std::atomic<uint64_t> &bytesServed;
+
+    // Reads the next chunk with the lock released; returns an empty chunk at the end
+    Chunk readChunk() {
+        std::shared_ptr<std::vector<char>> chunk = std::make_shared<std::vector<char>>(CHUNK_SIZE);
+        size_t filled = 0;
+        const char *data;
+        size_t length;
+        while (filled < chunk->size() && source->next(chunk->size() - filled, data, length)) {
+            std::memcpy(chunk->data() + filled, data, length);
+            filled += length;
+        }
+        chunk->resize(filled);
+        bytesRead += filled;
+        return chunk;
+    }
+
+public:
+    SharedReader(std::unique_ptr<ChunkSource> fileSource, size_t offset, size_t size,
+                 std::atomic<uint64_t> &readCounter, std::atomic<uint64_t> &servedCounter)
+        : source(std::move(fileSource)), start(offset), fileSize(size), firstIndex(0), reading(false),
+          exhausted(false), bytesRead(readCounter), bytesServed(servedCounter) {}
+
+    size_t startOffset() const { return start; }
+    void served(size_t bytes) { bytesServed += bytes; }
+
+    // Whether a transfer of a file of this size starting at offset can join
+    bool accepts(size_t offset, size_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        size_t windowStart = start + firstIndex * CHUNK_SIZE;
+        size_t readEnd = start + (firstIndex + window.size()) * CHUNK_SIZE;
+        return !exhausted && size == fileSize && offset >= windowStart &&
+               offset <= readEnd + SHARED_ATTACH_AHEAD * CHUNK_SIZE;
+    }
+
+    // Chunk number index, reading up to it if needed. Returns nullptr at the
+    // end of the file or on a read error, or with behind set if the chunk
+    // has already left the window.
+    Chunk get(size_t index, bool &behind) {
+        std::unique_lock<std::mutex> lock(mutex);
+        behind = false;
+        while (true) {
+            if (index < firstIndex) {
+                behind = true;
+                return nullptr;
+            }
+            if (index < firstIndex + window.size()) return window[index - firstIndex];
+            if (exhausted) return nullptr;
+            if (reading) {
+                readDone.wait(lock);
+                continue;
+            }
+
+            reading = true;
+            lock.unlock();
+            Chunk chunk = readChunk();
+            lock.lock();
+            reading = false;
+            if (chunk->empty()) {
+                exhausted = true;
+            } else {
+                window.push_back(chunk);
+                if (chunk->size() < CHUNK_SIZE) exhausted = true;
+                if (window.size() > SHARED_READER_WINDOW) {
+                    window.pop_front();
+                    firstIndex++;
+                }
+            }
+            readDone.notify_all();
+        }
+    }
+};
+
+// A transfer's view of a SharedReader. If the transfer falls too far behind
+// the reader, it detaches and opens its own source through reopen.
+class SharedChunkSource : public ChunkSource {
+public:
+    typedef std::function<std::unique_ptr<ChunkSource>(size_t offset, size_t length)> Opener;
+
+private:
+    std::shared_ptr<SharedReader> reader;
+    Opener reopen;
+    std::unique_ptr<ChunkSource> own;
+    size_t position;
+    size_t remaining;
+    SharedReader::Chunk chunk;
+    size_t chunkIndex;
+
+public:
+    SharedChunkSource(std::shared_ptr<SharedReader> sharedReader, size_t offset, size_t length, Opener opener)
+        : reader(std::move(sharedReader)), reopen(std::move(opener)), position(offset), remaining(length),
+          chunkIndex(0) {}
+
+    bool next(size_t maxBytes, const char *&data, size_t &length) override {
+        if (own) return own->next(maxBytes, data, length);
+        if (remaining == 0) return false;
+
+        size_t relative = position - reader->startOffset();
+        size_t index = relative / CHUNK_SIZE;
+        if (!chunk || index != chunkIndex) {
+            bool behind;
+            chunk = reader->get(index, behind);
+            if (!chunk) {
+                if (!behind) return false;
+                reader.reset();
+                own = reopen(position, remaining);
+                return own->next(maxBytes, data, length);
+            }
+            chunkIndex = index;
+        }
+
+        size_t inChunk = relative - index * CHUNK_SIZE;
+        if (inChunk >= chunk->size()) return false;
+        length = std::min({maxBytes, remaining, chunk->size() - inChunk});
+        data = chunk->data() + inChunk;
+        position += length;
+        remaining -= length;
+        reader->served(length);
+        return true;
+    }
+};
+
+// Request kinds timed separately in STATS. SUBSCRIBE is left out: it holds
+// its connection for as long as the client watches.
+const char *const REQUEST_TYPES[] = {"LIST", "LISTB", "GET", "GETHASH", "CHECKSUM", "MANIFEST", "DELTA", "STATS", "OTHER"};
+const int REQUEST_TYPE_COUNT = sizeof(REQUEST_TYPES) / sizeof(REQUEST_TYPES[0]);
+
+// Metric ids registered with the server's Metrics (see registerMetrics)
+struct ServerMetrics {
+    int requestSeconds[REQUEST_TYPE_COUNT];
+    int requestCpuSeconds;
+    int connectionsBusy, connectionsAccepted, connectionsRejected, connectionsEvicted;
+    int sentRaw, sentCompressed, sentDelta;
+    int readChunkSeconds, sendChunkSeconds;
+    int compressSeconds, compressRatio, compressIn, compressOut;
+    int hashBacklog, hashedBytes, hashSeconds;
 };
 
 struct ServerConfig {
@@ -41,6 +1005,20 @@ struct ServerConfig {
     bool enableCompression = true;
     int maxConnections = MAX_CONNECTIONS;
     std::string sharedFolder = "";
+    bool chunking = true;  // Build chunk manifests while hashing
+    int maxUploadKBps = 0;  // Upload cap shared by all transfers, 0 = unlimited
+    int cacheMB = 256;      // Block cache budget, 0 = read every transfer from disk
+    std::string ioBackend = "stream";  // How files are read: "stream" (ifstream) or "mmap"
+    int directIOMB = 1024;  // Files at least this large are sent unbuffered, 0 = never
+    int prefetchDepth = 16; // Most 64 KB chunks read ahead of a transfer, 0 = no read-ahead
+    bool watchFolders = true;  // Follow changes in shared folders after the initial scan
+    bool searchIndex = true;   // Trigram index for substring and glob searches
+    std::string logFile = "server_log.jsonl";  // JSON-lines request log, empty = none
+    std::string logLevel = "info";             // Least severe level recorded
+    std::string logConsole = "warn";           // Least severe level also shown on the console
+    int logRateLimit = 1000;  // Records per event per second below error, 0 = unlimited
+    std::string traceFile = "";  // Chrome trace of sampled requests, empty = off
+    double traceSample = 1.0;    // Fraction of requests traced
 
     void load() {
         std::ifstream file(CONFIG_FILE);
@@ -56,6 +1034,20 @@ struct ServerConfig {
                 else if (key == "compression") enableCompression = (value == "true");
                 else if (key == "max_connections") maxConnections = std::stoi(value);
                 else if (key == "shared_folder") sharedFolder = value;
+                else if (key == "chunking") chunking = (value == "true");
+                else if (key == "max_upload_kbps") maxUploadKBps = std::stoi(value);
+                else if (key == "cache_mb") cacheMB = std::stoi(value);
+                else if (key == "io_backend") ioBackend = value;
+                else if (key == "direct_io_mb") directIOMB = std::stoi(value);
+                else if (key == "prefetch_depth") prefetchDepth = std::stoi(value);
+                else if (key == "watch_folders") watchFolders = (value == "true");
+                else if (key == "search_index") searchIndex = (value == "true");
+                else if (key == "log_file") logFile = value;
+                else if (key == "log_level") logLevel = value;
+                else if (key == "log_console") logConsole = value;
+                else if (key == "log_rate_limit") logRateLimit = std::stoi(value);
+                else if (key == "trace_file") traceFile = value;
+                else if (key == "trace_sample") traceSample = std::stod(value);
             }
         }
     }
@@ -67,6 +1059,20 @@ struct ServerConfig {
         file << "compression=" << (enableCompression ? "true" : "false") << "\n";
         file << "max_connections=" << maxConnections << "\n";
         file << "shared_folder=" << sharedFolder << "\n";
+        file << "chunking=" << (chunking ? "true" : "false") << "\n";
+        file << "max_upload_kbps=" << maxUploadKBps << "\n";
+        file << "cache_mb=" << cacheMB << "\n";
+        file << "io_backend=" << ioBackend << "\n";
+        file << "direct_io_mb=" << directIOMB << "\n";
+        file << "prefetch_depth=" << prefetchDepth << "\n";
+        file << "watch_folders=" << (watchFolders ? "true" : "false") << "\n";
+        file << "search_index=" << (searchIndex ? "true" : "false") << "\n";
+        file << "log_file=" << logFile << "\n";
+        file << "log_level=" << logLevel << "\n";
+        file << "log_console=" << logConsole << "\n";
+        file << "log_rate_limit=" << logRateLimit << "\n";
+        file << "trace_file=" << traceFile << "\n";
+        file << "trace_sample=" << traceSample << "\n";
     }
 };
 
@@ -201,12 +1207,34 @@ std::string readLineWithCompletion(const std::string &prompt) {
 class P2PFileServer {
 private:
     SOCKET serverSocket;
-    std::map<std::string, FileInfo> sharedFiles;
-    std::mutex filesMutex;
+    Catalog catalog;                    // Keyed by path relative to the shared folder
+    MeteredMutex filesMutex;
+    uint64_t catalogVersion;            // Bumped on every add/remove, guarded by filesMutex
+    uint64_t changeLogFloor;            // Every change after this version is in changeLog
+    std::deque<CatalogChange> changeLog;
+    std::mutex subscribersMutex;        // Lock order: filesMutex, subscribersMutex, Subscriber::mutex
+    std::vector<std::shared_ptr<Subscriber>> subscribers;
+    std::atomic<uint64_t> nextFileId{0};
+    std::unique_ptr<BlockCache> blockCache;   // Null when cache_mb is 0
+    MeteredMutex readersMutex;
+    std::unordered_map<uint64_t, std::vector<std::weak_ptr<SharedReader>>> sharedReaders;  // By file id
+    size_t readersSweepAt = READERS_SWEEP_MIN;  // sharedReaders size that triggers a full sweep
+    std::atomic<uint64_t> sharedBytesRead{0};
+    std::atomic<uint64_t> sharedBytesSent{0};
+    MeteredMutex popularityMutex;
+    std::unordered_map<std::string, double> popularity;  // Bytes requested per file, aged across runs
     std::atomic<bool> running;
     std::atomic<int> activeConnections;
+    std::mutex idleMutex;
+    std::map<SOCKET, std::chrono::steady_clock::time_point> idleConnections;  // Keep-alives waiting for a request
     ServerConfig config;
     bool wsaInitialized;
+    std::mutex uploadMutex;
+    std::chrono::steady_clock::time_point nextUploadSlot;
+    Metrics metrics;
+    ServerMetrics stats;
+    Logger logger;
+    Tracer tracer;
 
     std::string calculateSHA256(const std::string &filepath, size_t maxBytes = 0) {
         std::ifstream file(filepath, std::ios::binary);
@@ -220,6 +1248,13 @@ private:
             return "";
         }
 
+        if (useMapping()) {
+            bool ok = digestMapped(context, filepath, maxBytes);
+            std::string hash = ok ? finishDigest(context) : "";
+            EVP_MD_CTX_free(context);
+            return hash;
+        }
+
         char buffer[CHUNK_SIZE];
         size_t bytesProcessed = 0;
         
@@ -238,14 +1273,16 @@ private:
             if (maxBytes > 0 && bytesProcessed >= maxBytes) break;
         }
 
-        unsigned char hash[EVP_MAX_MD_SIZE];
-        unsigned int hashLen;
-
-        if (EVP_DigestFinal_ex(context, hash, &hashLen) != 1) {
-            EVP_MD_CTX_free(context);
-            return "";
-        }
+        std::string hash = finishDigest(context);
         EVP_MD_CTX_free(context);
+        return hash;
+    }
+
+    // Hex digest of everything fed to context, or "" on failure
+    static std::string finishDigest(EVP_MD_CTX *context) {
+        unsigned char hash[EVP_MAX_MD_SIZE];
+        unsigned int hashLen = 0;
+        if (EVP_DigestFinal_ex(context, hash, &hashLen) != 1) return "";
 
         std::stringstream ss;
         for (unsigned int i = 0; i < hashLen; i++) {
@@ -254,6 +1291,134 @@ private:
         return ss.str();
     }
 
+    // Mapped reads are only safe where guardedMappedAccess can catch a failed
+    // page read, so builds without __try read through the stream backend.
+    bool useMapping() const { return MAPPED_IO_GUARDED && config.ioBackend == "mmap"; }
+
+    bool usesDirectIO(size_t filesize) const {
+        return config.directIOMB > 0 && filesize >= (size_t)config.directIOMB * 1024 * 1024;
+    }
+
+    // One hashing step over mapped memory, run under guardedMappedAccess:
+    // finds the next chunk in [data, data + available) when chunking (the
+    // whole span otherwise) and feeds it to the file digest.
+    struct HashStep {
+        const unsigned char *data;
+        size_t available;
+        bool chunking;
+        EVP_MD_CTX *context;
+        size_t length;
+        unsigned char digest[SHA256_DIGEST_LENGTH];
+        bool ok;
+    };
+
+    static void runHashStep(void *context) {
+        HashStep *step = (HashStep *)context;
+        step->length = step->chunking ? ContentChunker::nextChunk(step->data, step->available)
+                                      : step->available;
+        step->ok = EVP_DigestUpdate(step->context, step->data, step->length) == 1;
+        if (step->chunking) SHA256(step->data, step->length, step->digest);
+    }
+
+    // Feeds the first maxBytes (0 = all) of the file to context straight from
+    // a mapping, one view at a time.
+    bool digestMapped(EVP_MD_CTX *context, const std::string &filepath, size_t maxBytes) {
+        MappedFile mapped;
+        if (!mapped.open(filepath)) return false;
+        size_t total = maxBytes > 0 ? std::min(maxBytes, mapped.size()) : mapped.size();
+        mapped.advise(0, total);
+
+        size_t offset = 0;
+        while (offset < total) {
+            size_t span;
+            const char *view = mapped.view(offset, 1, span);
+            if (!view) return false;
+            HashStep step = {(const unsigned char *)view, std::min(span, total - offset), false, context};
+            if (!guardedMappedAccess(runHashStep, &step) || !step.ok) {
+                logger.log(LOG_ERROR, "read_failed").text("file", filepath).text("while", "mapped");
+                return false;
+            }
+            offset += step.length;
+        }
+        return true;
+    }
+
+    // Hashes the whole file and, when chunking is on, splits it into content-
+    // defined chunks and hashes each one, all in a single read pass.
+    bool indexFile(FileInfo &info) {
+        // Mapped files are walked view by view; otherwise a sliding buffer
+        // keeps at least CDC_MAX_CHUNK bytes ahead of the chunker
+        MappedFile mapped;
+        std::ifstream file;
+        bool useMapped = useMapping() && mapped.open(info.filepath);
+        if (useMapped) {
+            mapped.advise(0, mapped.size());
+        } else {
+            file.open(info.filepath, std::ios::binary);
+            if (!file) return false;
+        }
+
+        EVP_MD_CTX *context = EVP_MD_CTX_new();
+        if (!context || EVP_DigestInit_ex(context, EVP_sha256(), nullptr) != 1) {
+            if (context) EVP_MD_CTX_free(context);
+            return false;
+        }
+
+        std::string manifest;
+        std::vector<char> buffer(useMapped ? 0 : 4 * 1024 * 1024);
+        size_t available = 0;
+        size_t pos = 0;           // Into buffer, or into the file when mapped
+        bool eof = false;
+
+        while (true) {
+            const unsigned char *chunk;
+            size_t span;
+            if (useMapped) {
+                if (pos == mapped.size()) break;
+                chunk = (const unsigned char *)mapped.view(pos, CDC_MAX_CHUNK, span);
+                if (!chunk) {
+                    EVP_MD_CTX_free(context);
+                    return false;
+                }
+            } else {
+                if (available - pos < CDC_MAX_CHUNK && !eof) {
+                    std::memmove(buffer.data(), buffer.data() + pos, available - pos);
+                    available -= pos;
+                    pos = 0;
+                    file.read(buffer.data() + available, buffer.size() - available);
+                    size_t bytesRead = file.gcount();
+                    eof = (available + bytesRead < buffer.size());
+                    available += bytesRead;
+                }
+                if (pos == available) break;
+                chunk = (const unsigned char *)buffer.data() + pos;
+                span = available - pos;
+            }
+
+            HashStep step = {chunk, span, config.chunking, context};
+            if (!guardedMappedAccess(runHashStep, &step) || !step.ok) {
+                logger.log(LOG_ERROR, "read_failed").text("file", info.filepath).text("while", "hashing");
+                EVP_MD_CTX_free(context);
+                return false;
+            }
+
+            if (config.chunking) {
+                uint32_t size = (uint32_t)step.length;
+                manifest.append((const char *)&size, sizeof(size));
+                manifest.append((const char *)step.digest, sizeof(step.digest));
+            }
+            pos += step.length;
+        }
+
+        info.sha256 = finishDigest(context);
+        EVP_MD_CTX_free(context);
+        if (info.sha256.empty()) return false;
+        if (config.chunking) {
+            info.manifest = std::make_shared<const std::string>(std::move(manifest));
+        }
+        return true;
+    }
+
     std::string getLocalIP() {
         char hostName[256];
         if (gethostname(hostName, sizeof(hostName)) == SOCKET_ERROR) return "Unknown";
@@ -272,9 +1437,135 @@ private:
         return std::string(ipStr);
     }
 
-    std::vector<char> compressData(const char *data, size_t size, size_t &compressedSize) {
-        compressedSize = compressBound(size);
-        std::vector<char> compressed(compressedSize);
+    static size_t parseNumberParam(const std::string &params, size_t start) {
+        std::string value = params.substr(start);
+        size_t spacePos = value.find(' ');
+        if (spacePos != std::string::npos) {
+            value = value.substr(0, spacePos);
+        }
+        try {
+            return std::stoull(value);
+        } catch (...) {
+            return 0;
+        }
+    }
+
+    static bool recvAll(SOCKET sock, char *data, size_t length) {
+        size_t received = 0;
+        while (received < length) {
+            int n = recv(sock, data + received, (int)std::min(length - received, (size_t)CHUNK_SIZE), 0);
+            if (n <= 0) return false;
+            received += n;
+        }
+        return true;
+    }
+
+    static bool sendAll(SOCKET sock, const char *data, size_t length) {
+        size_t sent = 0;
+        while (sent < length) {
+            int n = send(sock, data + sent, (int)std::min(length - sent, (size_t)CHUNK_SIZE), 0);
+            if (n == SOCKET_ERROR) return false;
+            sent += n;
+        }
+        return true;
+    }
+
+    // Paces outgoing data so all transfers together stay under max_upload_kbps.
+    // Each caller books the next slot on a shared timeline and sleeps until it.
+    void throttleUpload(size_t bytes) {
+        if (config.maxUploadKBps <= 0) return;
+        TraceSpan span("throttle");
+
+        std::chrono::steady_clock::time_point sendAt;
+        {
+            std::lock_guard<std::mutex> lock(uploadMutex);
+            auto now = std::chrono::steady_clock::now();
+            if (nextUploadSlot < now) nextUploadSlot = now;
+            sendAt = nextUploadSlot;
+            nextUploadSlot += std::chrono::microseconds(
+                (long long)(bytes * 1000000.0 / (config.maxUploadKBps * 1024.0)));
+        }
+        std::this_thread::sleep_until(sendAt);
+    }
+
+    // Caller holds filesMutex.
+    void recordChangeLocked(const std::string &filename) {
+        catalogVersion++;
+        changeLog.push_back({catalogVersion, filename});
+        while (changeLog.size() > CHANGE_LOG_LIMIT) {
+            changeLogFloor = changeLog.front().version;
+            changeLog.pop_front();
+        }
+    }
+
+    void recordPopularity(const std::string &filename, size_t bytes) {
+        if (!blockCache) return;
+        std::lock_guard<MeteredMutex> lock(popularityMutex);
+        popularity[filename] += (double)bytes;
+    }
+
+    // Stats from the previous run count half, so popularity follows recent demand.
+    void loadPopularity() {
+        std::ifstream file(POPULARITY_FILE);
+        std::string line;
+        while (std::getline(file, line)) {
+            size_t space = line.find(' ');
+            if (space == std::string::npos) continue;
+            try {
+                popularity[line.substr(space + 1)] = std::stod(line.substr(0, space)) / 2;
+            } catch (...) {}
+        }
+    }
+
+    void savePopularity() {
+        std::lock_guard<MeteredMutex> lock(popularityMutex);
+        std::ofstream file(POPULARITY_FILE);
+        for (const auto &pair : popularity) {
+            if (pair.second >= 1) file << (uint64_t)pair.second << " " << pair.first << "\n";
+        }
+    }
+
+    // Queues one event line for every subscriber. Called with filesMutex held
+    // so events reach subscribers in version order.
+    void publishEventLocked(const std::string &event, uint64_t version) {
+        std::lock_guard<std::mutex> lock(subscribersMutex);
+        for (const auto &subscriber : subscribers) {
+            std::lock_guard<std::mutex> subscriberLock(subscriber->mutex);
+            if (subscriber->resync) {
+                subscriber->resyncVersion = version;
+            } else if (subscriber->events.size() >= SUBSCRIBER_QUEUE_LIMIT) {
+                subscriber->events.clear();
+                subscriber->resync = true;
+                subscriber->resyncVersion = version;
+            } else {
+                subscriber->events.push_back(event);
+            }
+            subscriber->wake.notify_one();
+        }
+    }
+
+    // LISTB entry record: 'F' [u16 name length][name][u64 size][u8 hash length][raw SHA-256]
+    static void appendEntryRecord(std::string &out, const Catalog::Listing &listing) {
+        uint16_t nameLength = (uint16_t)std::min(listing.filename.size(), (size_t)UINT16_MAX);
+        out += 'F';
+        out.append((const char *)&nameLength, sizeof(nameLength));
+        out.append(listing.filename, 0, nameLength);
+        out.append((const char *)&listing.size, sizeof(listing.size));
+        out += (char)Catalog::DIGEST_SIZE;
+        out.append((const char *)listing.digest, Catalog::DIGEST_SIZE);
+    }
+
+    // LISTB removal record: 'R' [u16 name length][name]
+    static void appendRemovalRecord(std::string &out, const std::string &filename) {
+        uint16_t nameLength = (uint16_t)std::min(filename.size(), (size_t)UINT16_MAX);
+        out += 'R';
+        out.append((const char *)&nameLength, sizeof(nameLength));
+        out.append(filename, 0, nameLength);
+    }
+
+    std::vector<char> compressData(const char *data, size_t size, size_t &compressedSize) {
+        compressedSize = compressBound(size);
+        std::vector<char> compressed(compressedSize);
 
         if (compress2((Bytef *)compressed.data(), (uLongf *)&compressedSize,
                       (const Bytef *)data, size, Z_BEST_SPEED) != Z_OK) {
@@ -285,9 +1576,108 @@ private:
         return compressed;
     }
 
+    static uint64_t microsSince(std::chrono::steady_clock::time_point start) {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+
+    // User plus kernel time of the calling thread, in microseconds
+    static uint64_t threadCpuMicros() {
+        FILETIME created, exited, kernel, user;
+        if (!GetThreadTimes(GetCurrentThread(), &created, &exited, &kernel, &user)) return 0;
+        uint64_t total = ((uint64_t)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+                         ((uint64_t)user.dwHighDateTime << 32 | user.dwLowDateTime);
+        return total / 10;
+    }
+
+    // Index into REQUEST_TYPES, or -1 for SUBSCRIBE
+    static int requestType(const std::string &request) {
+        if (request.find("SUBSCRIBE") == 0) return -1;
+        for (int i = 0; i < REQUEST_TYPE_COUNT - 1; i++) {
+            size_t length = strlen(REQUEST_TYPES[i]);
+            if (request.compare(0, length, REQUEST_TYPES[i]) == 0 &&
+                (request.size() == length || !isalpha((unsigned char)request[length]))) {
+                return i;
+            }
+        }
+        return REQUEST_TYPE_COUNT - 1;
+    }
+
+    // Everything STATS reports. Runs from the constructor, before any
+    // thread can record.
+    void registerMetrics() {
+        for (int i = 0; i < REQUEST_TYPE_COUNT; i++) {
+            stats.requestSeconds[i] = metrics.histogram("p2p_request_duration_seconds",
+                std::string("type=\"") + REQUEST_TYPES[i] + "\"", "Time to answer a request", 1e-6);
+        }
+        stats.requestCpuSeconds = metrics.histogram("p2p_request_cpu_seconds", "",
+            "CPU time the handler thread spent on a request", 1e-6);
+        metrics.sampled("p2p_connections_open", "", "Open client connections, idle keep-alives included",
+                        [this] { return (double)activeConnections; });
+        stats.connectionsBusy = metrics.gauge("p2p_connections_busy", "", "Connections with a request in progress");
+        metrics.sampled("p2p_subscribers", "", "Connections following catalog changes with SUBSCRIBE", [this] {
+            std::lock_guard<std::mutex> lock(subscribersMutex);
+            return (double)subscribers.size();
+        });
+        stats.connectionsRejected = metrics.counter("p2p_connections_rejected_total", "",
+            "Connections turned away at max_connections");
+        stats.connectionsAccepted = metrics.counter("p2p_connections_accepted_total", "",
+                                                    "Connections handed to a handler thread");
+        stats.connectionsEvicted = metrics.counter("p2p_connections_evicted_total", "",
+            "Idle keep-alive connections closed to admit a new client");
+
+        stats.sentRaw = metrics.counter("p2p_sent_bytes_total", "mode=\"raw\"", "File data bytes sent");
+        stats.sentCompressed = metrics.counter("p2p_sent_bytes_total", "mode=\"compressed\"",
+                                               "File data bytes sent");
+        stats.sentDelta = metrics.counter("p2p_sent_bytes_total", "mode=\"delta\"", "File data bytes sent");
+        stats.readChunkSeconds = metrics.histogram("p2p_chunk_read_seconds", "",
+            "Wait for the next chunk of a file from the cache or disk", 1e-6);
+        stats.sendChunkSeconds = metrics.histogram("p2p_chunk_send_seconds", "",
+            "Time to hand one chunk to the socket", 1e-6);
+
+        stats.compressSeconds = metrics.histogram("p2p_compress_seconds", "", "Time to compress one chunk", 1e-6);
+        stats.compressRatio = metrics.histogram("p2p_compress_ratio", "",
+            "Compressed size over original size, per chunk", 0.001);
+        stats.compressIn = metrics.counter("p2p_compress_input_bytes_total", "", "Bytes fed to the compressor");
+        stats.compressOut = metrics.counter("p2p_compress_output_bytes_total", "", "Bytes the compressor produced");
+
+        stats.hashBacklog = metrics.gauge("p2p_hash_backlog_files", "", "Files found in a folder scan, not yet hashed");
+        stats.hashedBytes = metrics.counter("p2p_hashed_bytes_total", "", "Bytes read to hash shared files");
+        stats.hashSeconds = metrics.histogram("p2p_hash_seconds", "", "Time to hash one file", 1e-6);
+
+        metrics.sampled("p2p_catalog_files", "", "Files in the catalog", [this] {
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            return (double)catalog.size();
+        });
+        struct { MeteredMutex *mutex; const char *name; } locks[] = {
+            {&filesMutex, "files"}, {&readersMutex, "readers"}, {&popularityMutex, "popularity"},
+        };
+        // Registered a name at a time so each name's series stay together
+        const int lockCount = sizeof(locks) / sizeof(locks[0]);
+        int acquired[lockCount], contended[lockCount];
+        for (int i = 0; i < lockCount; i++) {
+            acquired[i] = metrics.counter("p2p_lock_acquisitions_total", std::string("lock=\"") + locks[i].name + "\"",
+                                          "Times the lock was taken");
+        }
+        for (int i = 0; i < lockCount; i++) {
+            contended[i] = metrics.counter("p2p_lock_contended_total", std::string("lock=\"") + locks[i].name + "\"",
+                                           "Times the lock had to be waited for");
+        }
+        for (int i = 0; i < lockCount; i++) {
+            int waited = metrics.histogram("p2p_lock_wait_seconds", std::string("lock=\"") + locks[i].name + "\"",
+                                           "Wait for a contended lock", 1e-6);
+            locks[i].mutex->meter(metrics, acquired[i], contended[i], waited);
+        }
+    }
+
 public:
-    P2PFileServer() : serverSocket(INVALID_SOCKET), running(false),
-                      activeConnections(0), wsaInitialized(false) {
+    P2PFileServer() : serverSocket(INVALID_SOCKET), catalogVersion(0), changeLogFloor(0),
+                      running(false), activeConnections(0), wsaInitialized(false) {
+        // Versions start at the startup time in milliseconds so a version a
+        // client remembers from an earlier run of the server is always below
+        // the change log floor and gets a RESYNC instead of a wrong delta.
+        catalogVersion = changeLogFloor = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
         WSADATA wsaData;
         if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
             std::cerr << "WSAStartup failed\n";
@@ -295,10 +1685,28 @@ public:
             wsaInitialized = true;
         }
         config.load();
+        catalog.setSubstringIndex(config.searchIndex);
+        registerMetrics();
+        if (!logger.start(config.logFile, Logger::parseLevel(config.logLevel, LOG_INFO),
+                          Logger::parseLevel(config.logConsole, LOG_WARN), (uint64_t)std::max(config.logRateLimit, 0))) {
+            std::cerr << "Cannot open log file: " << config.logFile << "\n";
+        }
+        if (config.ioBackend == "mmap" && !MAPPED_IO_GUARDED) {
+            logger.log(LOG_WARN, "mmap_unavailable").text("reason", "build has no SEH").text("using", "stream");
+        }
+        if (!config.traceFile.empty() && !tracer.start(config.traceFile, config.traceSample, "server", 1)) {
+            std::cerr << "Cannot open trace file: " << config.traceFile << "\n";
+        }
+        if (config.cacheMB > 0) {
+            blockCache.reset(new BlockCache((size_t)config.cacheMB * 1024 * 1024));
+            loadPopularity();
+        }
     }
 
     ~P2PFileServer() {
         stop();
+        logger.stop();
+        tracer.stop();
         if (serverSocket != INVALID_SOCKET) closesocket(serverSocket);
         if (wsaInitialized) WSACleanup();
     }
@@ -329,6 +1737,12 @@ public:
             return false;
         }
 
+#ifdef TCP_FASTOPEN
+        // Lets returning clients put their request in the SYN; harmless where unsupported
+        DWORD fastOpen = 1;
+        setsockopt(serverSocket, IPPROTO_TCP, TCP_FASTOPEN, (char *)&fastOpen, sizeof(fastOpen));
+#endif
+
         if (listen(serverSocket, config.maxConnections) == SOCKET_ERROR) {
             std::cerr << "Listen failed: " << WSAGetLastError() << "\n";
             closesocket(serverSocket);
@@ -349,11 +1763,23 @@ public:
         if (!config.sharedFolder.empty() && fs::exists(config.sharedFolder)) {
             std::cout << "Auto-loading shared folder...\n";
             addFolder(config.sharedFolder);
+            watchFolder(config.sharedFolder);
         }
         return true;
     }
 
-    void addSharedFile(const std::string &filepath) {
+    // Catalog key of a file under folder: its path relative to the folder
+    // with '/' separators, or just its name if it is not under the folder.
+    static std::string catalogKey(const std::string &folder, const std::string &filepath) {
+        fs::path relative = fs::path(filepath).lexically_relative(folder);
+        if (relative.empty() || *relative.begin() == "..") return fs::path(filepath).filename().string();
+        return relative.generic_string();
+    }
+
+    // Shares filepath under its path relative to folder, or under its own
+    // name when no folder is given. A file already shared under the same
+    // key is replaced.
+    void addSharedFile(const std::string &filepath, const std::string &folder = "") {
         if (!fs::exists(filepath)) {
             std::cerr << "File does not exist: " << filepath << std::endl;
             return;
@@ -369,109 +1795,443 @@ public:
         file.close();
 
         FileInfo info;
-        info.filename = fs::path(filepath).filename().string();
+        info.id = ++nextFileId;
+        std::string root = folder.empty() ? fs::path(filepath).parent_path().string() : folder;
+        info.filename = catalogKey(root, filepath);
         info.filepath = filepath;
         info.filesize = filesize;
+        std::error_code error;
+        info.modified = fs::last_write_time(filepath, error);
+
+        {
+            // Announced before hashing so watchers know the file is coming;
+            // it is only downloadable once HASHED follows (REMOVE if it fails).
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            publishEventLocked("ADD " + std::to_string(catalogVersion) + " " + std::to_string(filesize) +
+                               " " + info.filename + "\n", catalogVersion);
+        }
 
-        std::cout << "[HASHING] " << info.filename << "... " << std::flush;
-        info.sha256 = calculateSHA256(filepath);
-        std::cout << "Done\n";
+        logger.log(LOG_DEBUG, "hashing").text("file", info.filename).number("size", filesize);
+        auto hashStart = std::chrono::steady_clock::now();
+        if (!indexFile(info)) {
+            logger.log(LOG_WARN, "hash_failed").text("file", info.filename);
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            withdrawLocked(info.filename);
+            return;
+        }
+        uint64_t hashMicros = microsSince(hashStart);
+        metrics.record(stats.hashSeconds, hashMicros);
+        metrics.add(stats.hashedBytes, filesize);
+
+        std::lock_guard<MeteredMutex> lock(filesMutex);
+        if (!catalog.put(info, catalog.addRoot(root))) {
+            logger.log(LOG_ERROR, "catalog_failed").text("file", info.filename);
+            withdrawLocked(info.filename);
+            return;
+        }
+        recordChangeLocked(info.filename);
+        publishEventLocked("HASHED " + std::to_string(catalogVersion) + " " + std::to_string(filesize) + " " +
+                           info.sha256 + " " + info.filename + "\n", catalogVersion);
 
-        std::lock_guard<std::mutex> lock(filesMutex);
-        sharedFiles[info.filename] = info;
+        Logger::Entry shared = logger.log(LOG_INFO, "shared");
+        shared.text("file", info.filename).number("size", filesize).number("hash_ms", hashMicros / 1000);
+        if (info.manifest) shared.number("chunks", info.manifest->size() / MANIFEST_ENTRY_SIZE);
+    }
 
-        std::cout << "[SHARED] " << info.filename << " (" << filesize << " bytes)\n";
+    // Follows an ADD for a file that could not be shared with a REMOVE, so
+    // watchers do not wait for a HASHED that never comes. An older entry
+    // under the same name goes too: it no longer matches what is on disk.
+    void withdrawLocked(const std::string &filename) {
+        catalog.erase(filename);
+        recordChangeLocked(filename);
+        publishEventLocked("REMOVE " + std::to_string(catalogVersion) + " " + filename + "\n", catalogVersion);
     }
 
     void addFolder(const std::string &folderPath) {
+        size_t backlog = 0;
         try {
             if (!fs::exists(folderPath) || !fs::is_directory(folderPath)) {
                 std::cerr << "Invalid folder: " << folderPath << std::endl;
                 return;
             }
 
-            int count = 0;
+            // Listed up front so STATS can show how many are left to hash
+            std::vector<std::string> paths;
             for (const auto &entry : fs::recursive_directory_iterator(folderPath)) {
-                if (entry.is_regular_file()) {
-                    addSharedFile(entry.path().string());
-                    count++;
-                }
+                if (entry.is_regular_file()) paths.push_back(entry.path().string());
+            }
+            backlog = paths.size();
+            metrics.add(stats.hashBacklog, (int64_t)backlog);
+            for (const auto &path : paths) {
+                addSharedFile(path, folderPath);
+                metrics.add(stats.hashBacklog, -1);
+                backlog--;
             }
-            std::cout << "[INFO] Added " << count << " files from folder\n";
+            logger.log(LOG_INFO, "folder_added").text("folder", folderPath).number("files", paths.size());
         } catch (const std::exception &e) {
+            metrics.add(stats.hashBacklog, -(int64_t)backlog);
             std::cerr << "Error reading folder: " << e.what() << std::endl;
         }
     }
 
+    struct PendingChange {
+        std::chrono::steady_clock::time_point lastChange;
+        bool appeared = false;  // Created or renamed into place at some point
+    };
+
+    // Keeps the catalog in step with a shared folder after addFolder has
+    // scanned it. ReadDirectoryChangesW reports changed paths, which wait
+    // until they have been quiet for WATCH_SETTLE_MS and are then added,
+    // rehashed or removed one at a time; nothing else is rescanned.
+    void watchFolder(const std::string &folderPath) {
+        if (!config.watchFolders) return;
+        std::thread(&P2PFileServer::runFolderWatch, this, folderPath).detach();
+    }
+
+    void runFolderWatch(std::string folderPath) {
+        HANDLE directory = CreateFileA(folderPath.c_str(), FILE_LIST_DIRECTORY,
+                                       FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                                       OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+        if (directory == INVALID_HANDLE_VALUE) {
+            logger.log(LOG_WARN, "watch_failed").text("folder", folderPath).number("error", GetLastError());
+            return;
+        }
+        HANDLE changed = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+        std::vector<DWORD> buffer(WATCH_BUFFER_SIZE / sizeof(DWORD));  // Must be DWORD aligned
+        OVERLAPPED overlapped;
+        std::map<std::string, PendingChange> pending;
+        bool listening = false;
+        logger.log(LOG_INFO, "watching").text("folder", folderPath);
+
+        while (running) {
+            if (!listening) {
+                ZeroMemory(&overlapped, sizeof(overlapped));
+                overlapped.hEvent = changed;
+                listening = ReadDirectoryChangesW(directory, buffer.data(), WATCH_BUFFER_SIZE, TRUE,
+                                                  FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME |
+                                                      FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE,
+                                                  nullptr, &overlapped, nullptr) != 0;
+                if (!listening) {
+                    logger.log(LOG_WARN, "watch_stopped").text("folder", folderPath).number("error", GetLastError());
+                    break;
+                }
+            }
+
+            if (WaitForSingleObject(changed, WATCH_POLL_MS) == WAIT_OBJECT_0) {
+                DWORD bytes = 0;
+                listening = false;
+                if (GetOverlappedResult(directory, &overlapped, &bytes, FALSE) && bytes > 0) {
+                    collectChanges(folderPath, (const char *)buffer.data(), pending);
+                } else {
+                    // More changes than the buffer holds; they are lost
+                    logger.log(LOG_WARN, "watch_overflow").text("folder", folderPath).text("action", "checking all files");
+                    reconcileFolder(folderPath);
+                }
+            }
+            settleChanges(folderPath, pending);
+        }
+
+        if (listening) {
+            DWORD bytes;
+            CancelIo(directory);
+            GetOverlappedResult(directory, &overlapped, &bytes, TRUE);
+        }
+        CloseHandle(changed);
+        CloseHandle(directory);
+    }
+
+    static void collectChanges(const std::string &folderPath, const char *data,
+                               std::map<std::string, PendingChange> &pending) {
+        auto now = std::chrono::steady_clock::now();
+        while (true) {
+            const FILE_NOTIFY_INFORMATION *change = (const FILE_NOTIFY_INFORMATION *)data;
+            std::wstring name(change->FileName, change->FileNameLength / sizeof(WCHAR));
+            PendingChange &entry = pending[(fs::path(folderPath) / name).string()];
+            entry.lastChange = now;
+            entry.appeared = entry.appeared || change->Action == FILE_ACTION_ADDED ||
+                             change->Action == FILE_ACTION_RENAMED_NEW_NAME;
+            if (change->NextEntryOffset == 0) break;
+            data += change->NextEntryOffset;
+        }
+    }
+
+    // Applies the pending paths that have been quiet long enough. What is
+    // there now decides what happens, so renames need no pairing: they are a
+    // path that is gone and one that appeared.
+    void settleChanges(const std::string &folderPath, std::map<std::string, PendingChange> &pending) {
+        auto now = std::chrono::steady_clock::now();
+        std::vector<std::pair<std::string, PendingChange>> ready;
+        for (const auto &change : pending) {
+            if (now - change.second.lastChange >= std::chrono::milliseconds(WATCH_SETTLE_MS)) ready.push_back(change);
+        }
+
+        for (const auto &change : ready) {
+            if (!running) return;
+            const std::string &path = change.first;
+            pending.erase(path);
+            std::error_code error;
+            fs::file_status status = fs::status(path, error);
+            if (fs::is_directory(status)) {
+                // A folder moved in is reported once, without its contents.
+                // Other folder changes are just their files changing.
+                if (!change.second.appeared) continue;
+                for (const auto &entry : fs::recursive_directory_iterator(path, error)) {
+                    if (entry.is_regular_file() && !syncFile(folderPath, entry.path().string())) {
+                        pending[entry.path().string()] = {now, true};
+                    }
+                }
+            } else if (!fs::exists(status)) {
+                removePath(folderPath, path);
+            } else if (fs::is_regular_file(status) && !syncFile(folderPath, path)) {
+                pending[path] = {now, change.second.appeared};
+            }
+        }
+    }
+
+    // Adds or rehashes the file unless the catalog already has it at this
+    // size and write time. False while another process still has it open
+    // for writing, so half-written files are left for a later round.
+    bool syncFile(const std::string &folderPath, const std::string &path) {
+        HANDLE probe = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                   FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (probe == INVALID_HANDLE_VALUE) return GetLastError() != ERROR_SHARING_VIOLATION;
+        CloseHandle(probe);
+
+        std::error_code error;
+        size_t size = (size_t)fs::file_size(path, error);
+        fs::file_time_type modified = fs::last_write_time(path, error);
+        if (error) return true;
+        {
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            FileInfo info;
+            if (catalog.find(catalogKey(folderPath, path), info) && fs::path(info.filepath) == fs::path(path) &&
+                info.filesize == size && info.modified == modified) {
+                return true;
+            }
+        }
+        addSharedFile(path, folderPath);
+        return true;
+    }
+
+    // Removes the catalog entries that folderPath shared for path, or for
+    // everything under it if it was a folder
+    void removePath(const std::string &folderPath, const std::string &path) {
+        std::vector<std::string> names;
+        {
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            names = catalog.pathsUnder(catalogKey(folderPath, path), catalog.addRoot(folderPath));
+        }
+        for (const auto &name : names) removeFile(name);
+    }
+
+    // Catches up after lost change notifications: files are only rehashed if
+    // their size or write time changed, and entries whose file is gone are
+    // removed.
+    void reconcileFolder(const std::string &folderPath) {
+        std::error_code error;
+        for (const auto &entry : fs::recursive_directory_iterator(folderPath, error)) {
+            if (!running) return;
+            if (entry.is_regular_file()) syncFile(folderPath, entry.path().string());
+        }
+
+        std::vector<std::string> gone;
+        {
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            for (const auto &name : catalog.pathsUnder("", catalog.addRoot(folderPath))) {
+                FileInfo info;
+                if (catalog.find(name, info) && !fs::exists(info.filepath, error)) gone.push_back(name);
+            }
+        }
+        for (const auto &name : gone) removeFile(name);
+    }
+
     void removeFile(const std::string &filename) {
-        std::lock_guard<std::mutex> lock(filesMutex);
-        auto it = sharedFiles.find(filename);
-        if (it != sharedFiles.end()) {
-            sharedFiles.erase(it);
-            std::cout << "[REMOVED] " << filename << "\n";
+        std::lock_guard<MeteredMutex> lock(filesMutex);
+        if (catalog.erase(filename)) {
+            recordChangeLocked(filename);
+            publishEventLocked("REMOVE " + std::to_string(catalogVersion) + " " + filename + "\n", catalogVersion);
+            logger.log(LOG_INFO, "removed").text("file", filename);
         } else {
-            std::cout << "[ERROR] File not found: " << filename << "\n";
+            logger.log(LOG_WARN, "remove_failed").text("file", filename).text("reason", "not shared");
         }
     }
 
-    void handleClient(SOCKET clientSocket, std::string clientIP) {
+    // A request ending in '\n' whose reply has a known length keeps the
+    // connection open for the next one (idle for up to KEEPALIVE_IDLE_MS).
+    // Anything else is answered and the connection closed, as older clients
+    // expect. Idle connections are not kept while the server is at
+    // max_connections, and a new client at the limit takes the place of the
+    // one that has been idle longest (see evictIdleConnection).
+    void handleClient(SOCKET clientSocket, std::string clientIP, std::chrono::steady_clock::time_point accepted) {
         activeConnections++;
 
-        char buffer[4096] = {0};
-        int bytesRead = recv(clientSocket, buffer, sizeof(buffer) - 1, 0);
+        std::string pending;
+        bool idleTimeoutSet = false;
+        bool first = true;
+        while (running) {
+            std::string request;
+            bool idle = !first && pending.find('\n') == std::string::npos;
+            if (idle) setIdle(clientSocket, true);
+            bool gotRequest = readRequest(clientSocket, pending, request);
+            if (idle) setIdle(clientSocket, false);
+            if (!gotRequest) break;
+            auto received = std::chrono::steady_clock::now();
+            logger.log(LOG_INFO, "request").text("client", clientIP)
+                .text("line", request.data(), request.find_last_not_of("\r\n") + 1);
+
+            int type = requestType(request);
+            auto start = std::chrono::steady_clock::now();
+            uint64_t cpuStart = threadCpuMicros();
+            metrics.add(stats.connectionsBusy);
+            bool reusable;
+            {
+                // SUBSCRIBE holds its connection for good and is not traced
+                std::unique_ptr<TraceScope> trace;
+                if (type >= 0 && tracer.enabled()) {
+                    trace.reset(new TraceScope(tracer, request.substr(0, request.find_last_not_of("\r\n") + 1) +
+                                                           " from " + clientIP));
+                }
+                // From accept until the handler thread had the first request
+                if (first) Tracer::mark("queue", accepted, received);
+                TraceSpan span(type >= 0 ? REQUEST_TYPES[type] : "SUBSCRIBE");
+                reusable = handleRequest(clientSocket, request, clientIP);
+            }
+            first = false;
+            metrics.add(stats.connectionsBusy, -1);
+            if (type >= 0) {
+                metrics.record(stats.requestSeconds[type], microsSince(start));
+                metrics.record(stats.requestCpuSeconds, threadCpuMicros() - cpuStart);
+            }
+            if (!reusable || request.back() != '\n' || activeConnections >= config.maxConnections) break;
 
-        if (bytesRead <= 0) {
-            closesocket(clientSocket);
-            activeConnections--;
-            return;
+            if (!idleTimeoutSet) {
+                DWORD timeout = KEEPALIVE_IDLE_MS;
+                setsockopt(clientSocket, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout));
+                idleTimeoutSet = true;
+            }
         }
 
-        std::string request(buffer);
-        std::cout << "[REQUEST] " << clientIP << " - " << request << std::flush;
+        closesocket(clientSocket);
+        activeConnections--;
+    }
+
+    // Marks a keep-alive connection as waiting for its next request, which
+    // makes it the candidate for eviction when the server is full
+    void setIdle(SOCKET clientSocket, bool idle) {
+        std::lock_guard<std::mutex> lock(idleMutex);
+        if (idle) {
+            idleConnections[clientSocket] = std::chrono::steady_clock::now();
+        } else {
+            idleConnections.erase(clientSocket);
+        }
+    }
+
+    // Shuts down the connection that has been idle longest; its handler sees
+    // the close and exits. False when every connection has a request in
+    // progress. The handler unmarks its socket before closing it, so the
+    // socket shut down here is always still open.
+    bool evictIdleConnection() {
+        std::lock_guard<std::mutex> lock(idleMutex);
+        if (idleConnections.empty()) return false;
+        auto oldest = std::min_element(idleConnections.begin(), idleConnections.end(),
+                                       [](const std::pair<const SOCKET, std::chrono::steady_clock::time_point> &a,
+                                          const std::pair<const SOCKET, std::chrono::steady_clock::time_point> &b) {
+                                           return a.second < b.second;
+                                       });
+        shutdown(oldest->first, SD_BOTH);
+        idleConnections.erase(oldest);
+        return true;
+    }
+
+    // Next request line including its '\n'. Like the original single recv,
+    // data without a newline is taken as one whole request.
+    static bool readRequest(SOCKET clientSocket, std::string &pending, std::string &request) {
+        if (pending.find('\n') == std::string::npos) {
+            char buffer[4096];
+            int bytesRead = recv(clientSocket, buffer, (int)(sizeof(buffer) - pending.size()), 0);
+            if (bytesRead <= 0) return false;
+            pending.append(buffer, bytesRead);
+        }
 
-        if (request.find("LIST") == 0) {
+        size_t newline = pending.find('\n');
+        size_t length = (newline == std::string::npos) ? pending.size() : newline + 1;
+        request = pending.substr(0, length);
+        pending.erase(0, length);
+        return !request.empty();
+    }
+
+    // Answers one request. Returns true if the reply was complete and
+    // self-delimiting, so the connection can carry another request.
+    bool handleRequest(SOCKET clientSocket, const std::string &request, const std::string &clientIP) {
+        bool reusable = true;
+
+        if (request.find("SUBSCRIBE") == 0) {
+            handleSubscribe(clientSocket);
+            reusable = false;
+        } else if (request.find("LISTB") == 0) {
+            // LISTB [SINCE version] [LIMIT n] [SORT order] [CURSOR name | MATCH kind query];
+            // the cursor or query runs to the end of the line
+            std::string params = request.substr(5);
+            params.erase(params.find_last_not_of(" \n\r\t") + 1);
+
+            size_t sincePos = params.find(" SINCE ");
+            size_t limitPos = params.find(" LIMIT ");
+            size_t sortPos = params.find(" SORT ");
+            size_t cursorPos = params.find(" CURSOR ");
+            size_t matchPos = params.find(" MATCH ");
+            size_t tailPos = std::min(cursorPos, matchPos);
+
+            std::string cursor;
+            if (cursorPos != std::string::npos && cursorPos == tailPos) cursor = params.substr(cursorPos + 8);
+            size_t limit = (limitPos != std::string::npos && limitPos < tailPos) ?
+                           parseNumberParam(params, limitPos + 7) : 0;
+
+            if (sincePos != std::string::npos && sincePos < tailPos) {
+                handleListChanges(clientSocket, parseNumberParam(params, sincePos + 7));
+            } else if (matchPos != std::string::npos && matchPos == tailPos) {
+                std::string sort;
+                if (sortPos != std::string::npos && sortPos < tailPos) {
+                    sort = params.substr(sortPos + 6, params.find(' ', sortPos + 6) - (sortPos + 6));
+                }
+                handleListMatch(clientSocket, params.substr(matchPos + 7), sort, limit);
+            } else {
+                handleListPage(clientSocket, cursor, limit);
+            }
+        } else if (request.find("LIST") == 0) {
             handleListRequest(clientSocket);
-        } else if (request.find("GET ") == 0) {
-            std::string params = request.substr(4);
+            reusable = false;
+        } else if (request.find("GET ") == 0 || request.find("GETHASH ") == 0) {
+            // GET <filename> / GETHASH <sha256>, then [OFFSET n] [LENGTH n] [COMPRESS]
+            bool byHash = request.find("GETHASH ") == 0;
+            std::string params = request.substr(byHash ? 8 : 4);
             params.erase(params.find_last_not_of(" \n\r\t") + 1);
 
-            std::string filename;
+            std::string target;
             size_t offset = 0;
+            size_t length = 0;
             bool compress = false;
 
             size_t offsetPos = params.find(" OFFSET ");
+            size_t lengthPos = params.find(" LENGTH ");
             size_t compressPos = params.find(" COMPRESS");
 
-            size_t filenameEnd = std::string::npos;
-            if (offsetPos != std::string::npos) filenameEnd = offsetPos;
-            if (compressPos != std::string::npos &&
-                (filenameEnd == std::string::npos || compressPos < filenameEnd)) {
-                filenameEnd = compressPos;
-            }
-
-            if (filenameEnd != std::string::npos) {
-                filename = params.substr(0, filenameEnd);
+            size_t targetEnd = std::min({offsetPos, lengthPos, compressPos});
+            if (targetEnd != std::string::npos) {
+                target = params.substr(0, targetEnd);
             } else {
-                filename = params;
-            }
-            filename.erase(filename.find_last_not_of(" \t") + 1);
-
-            if (offsetPos != std::string::npos) {
-                std::string offsetStr = params.substr(offsetPos + 8);
-                size_t spacePos = offsetStr.find(' ');
-                if (spacePos != std::string::npos) {
-                    offsetStr = offsetStr.substr(0, spacePos);
-                }
-                try {
-                    offset = std::stoull(offsetStr);
-                } catch (...) {
-                    offset = 0;
-                }
+                target = params;
             }
+            target.erase(target.find_last_not_of(" \t") + 1);
 
+            if (offsetPos != std::string::npos) offset = parseNumberParam(params, offsetPos + 8);
+            if (lengthPos != std::string::npos) length = parseNumberParam(params, lengthPos + 8);
             if (compressPos != std::string::npos) compress = true;
 
-            handleGetRequest(clientSocket, filename, offset, compress, clientIP);
+            if (byHash) {
+                reusable = handleGetByHashRequest(clientSocket, target, offset, length, compress, clientIP);
+            } else {
+                reusable = handleGetRequest(clientSocket, target, offset, length, compress, clientIP);
+            }
         } else if (request.find("CHECKSUM ") == 0) {
             std::string params = request.substr(9);
             params.erase(params.find_last_not_of(" \n\r\t") + 1);
@@ -491,81 +2251,470 @@ public:
                 filename = params;
             }
             handleChecksumRequest(clientSocket, filename, bytes);
+        } else if (request.find("MANIFEST ") == 0) {
+            std::string filename = request.substr(9);
+            filename.erase(filename.find_last_not_of(" \n\r\t") + 1);
+            handleManifestRequest(clientSocket, filename);
+        } else if (request.find("DELTA ") == 0) {
+            // DELTA <filename> <block size> <block count>
+            std::string params = request.substr(6);
+            params.erase(params.find_last_not_of(" \n\r\t") + 1);
+
+            std::string filename;
+            uint32_t blockSize = 0;
+            uint32_t blockCount = 0;
+
+            size_t countPos = params.find_last_of(' ');
+            size_t sizePos = (countPos == std::string::npos || countPos == 0) ?
+                             std::string::npos : params.find_last_of(' ', countPos - 1);
+            if (sizePos != std::string::npos) {
+                filename = params.substr(0, sizePos);
+                blockSize = (uint32_t)parseNumberParam(params, sizePos + 1);
+                blockCount = (uint32_t)parseNumberParam(params, countPos + 1);
+            }
+            handleDeltaRequest(clientSocket, filename, blockSize, blockCount, clientIP);
+        } else if (request.find("STATS") == 0) {
+            // STATS [PROMETHEUS]
+            bool prometheus = request.find(" PROMETHEUS") == 5;
+            std::string body = prometheus ? metrics.prometheus() : metrics.summary();
+            std::string out = "OK:" + std::to_string(body.size()) + ":STATS\n" + body;
+            sendAll(clientSocket, out.data(), out.size());
+        } else {
+            reusable = false;
         }
+        return reusable;
+    }
 
-        closesocket(clientSocket);
+    // Holds the connection open and streams catalog events as text lines:
+    //   ADD <version> <size> <name>                  file found, hashing started
+    //   HASHED <version> <size> <sha256> <name>      file listed and downloadable
+    //   REMOVE <version> <name>                      file no longer shared, or its
+    //                                                hashing after ADD failed
+    //   RESYNC <version>                             events were dropped, list again
+    //   PING                                         keep-alive while idle
+    // The reply "OK:<version>:SUBSCRIBED" is sent under the same lock that
+    // orders events, so "LISTB SINCE <version>" afterwards covers any gap.
+    // Subscribers do not count against max_connections.
+    void handleSubscribe(SOCKET clientSocket) {
+        auto subscriber = std::make_shared<Subscriber>();
+        std::string reply;
+        {
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            std::lock_guard<std::mutex> subscribersLock(subscribersMutex);
+            if ((int)subscribers.size() >= MAX_SUBSCRIBERS) {
+                reply = "ERROR: Too many subscribers\n";
+            } else {
+                subscribers.push_back(subscriber);
+                reply = "OK:" + std::to_string(catalogVersion) + ":SUBSCRIBED\n";
+            }
+        }
+        if (!sendAll(clientSocket, reply.data(), reply.size()) || reply.find("OK:") != 0) {
+            unsubscribe(subscriber);
+            return;
+        }
+
+        DWORD timeout = SUBSCRIBER_SEND_TIMEOUT_MS;
+        setsockopt(clientSocket, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout, sizeof(timeout));
+        // A subscriber is counted by p2p_subscribers, not as a busy connection
         activeConnections--;
+        metrics.add(stats.connectionsBusy, -1);
+
+        while (running) {
+            std::string out;
+            {
+                std::unique_lock<std::mutex> lock(subscriber->mutex);
+                subscriber->wake.wait_for(lock, std::chrono::seconds(SUBSCRIBER_PING_SECONDS), [&] {
+                    return subscriber->closed || subscriber->resync || !subscriber->events.empty();
+                });
+                if (subscriber->closed) break;
+
+                if (subscriber->resync) {
+                    out = "RESYNC " + std::to_string(subscriber->resyncVersion) + "\n";
+                    subscriber->resync = false;
+                } else if (subscriber->events.empty()) {
+                    out = "PING\n";
+                }
+                for (const auto &event : subscriber->events) out += event;
+                subscriber->events.clear();
+            }
+            if (!sendAll(clientSocket, out.data(), out.size())) break;
+        }
+
+        activeConnections++;
+        metrics.add(stats.connectionsBusy);
+        unsubscribe(subscriber);
     }
 
+    void unsubscribe(const std::shared_ptr<Subscriber> &subscriber) {
+        std::lock_guard<std::mutex> lock(subscribersMutex);
+        subscribers.erase(std::remove(subscribers.begin(), subscribers.end(), subscriber), subscribers.end());
+    }
+
+    // Text listing kept for older clients, in name order. Entries are copied
+    // under the lock and sorted, formatted and sent in batches outside it.
     void handleListRequest(SOCKET clientSocket) {
-        std::string response;
-        std::lock_guard<std::mutex> lock(filesMutex);
+        std::vector<FileInfo> files;
+        {
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            files.reserve(catalog.size());
+            catalog.forEach([&](const FileInfo &info) { files.push_back(info); });
+        }
+        std::sort(files.begin(), files.end(),
+                  [](const FileInfo &a, const FileInfo &b) { return a.filename < b.filename; });
 
-        if (sharedFiles.empty()) {
-            response = "No files available\n";
-        } else {
-            response = "Available files:\n";
-            for (const auto &pair : sharedFiles) {
-                response += pair.second.filename + ":" +
-                            std::to_string(pair.second.filesize) + ":" +
-                            pair.second.sha256 + "\n";
+        if (files.empty()) {
+            std::string response = "No files available\n";
+            send(clientSocket, response.c_str(), (int)response.length(), 0);
+            return;
+        }
+
+        std::string response = "Available files:\n";
+        for (const auto &info : files) {
+            response += info.filename + ":" + std::to_string(info.filesize) + ":" + info.sha256 + "\n";
+            if (response.size() >= CHUNK_SIZE) {
+                if (!sendAll(clientSocket, response.data(), response.size())) return;
+                response.clear();
             }
         }
-        send(clientSocket, response.c_str(), (int)response.length(), 0);
+        sendAll(clientSocket, response.data(), response.size());
     }
 
-    void handleChecksumRequest(SOCKET clientSocket, const std::string &filename, size_t bytes = 0) {
-        std::lock_guard<std::mutex> lock(filesMutex);
-        auto it = sharedFiles.find(filename);
+    // One page of the binary catalog in catalog order, starting after cursor:
+    // "OK:<version>:PAGE\n", entry records, then 'E' [u8 more]. The client
+    // continues with the last name it received as the next cursor. Removed
+    // files still mark their place until their slot is reused; a cursor the
+    // catalog no longer knows gets "RESYNC:<version>" and the client starts
+    // over.
+    void handleListPage(SOCKET clientSocket, const std::string &cursor, size_t limit) {
+        if (limit == 0) limit = LIST_PAGE_DEFAULT;
+        limit = std::min(limit, LIST_PAGE_MAX);
+
+        std::vector<Catalog::Listing> page;
+        uint64_t version;
+        bool more;
+        {
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            version = catalogVersion;
+            size_t slot = 0;
+            if (!cursor.empty()) {
+                uint32_t cursorSlot = catalog.slotOf(cursor);
+                if (cursorSlot == OpenIndex::NONE) {
+                    std::string response = "RESYNC:" + std::to_string(catalogVersion) + "\n";
+                    send(clientSocket, response.c_str(), (int)response.length(), 0);
+                    return;
+                }
+                slot = cursorSlot + 1;
+            }
+            Catalog::Listing listing;
+            for (; slot < catalog.slotCount() && page.size() < limit; slot++) {
+                if (catalog.listingAt(slot, listing)) page.push_back(listing);
+            }
+            while (slot < catalog.slotCount() && !catalog.isLive(slot)) slot++;
+            more = (slot < catalog.slotCount());
+        }
 
-        if (it == sharedFiles.end()) {
-            std::string response = "ERROR: File not found\n";
+        std::string out = "OK:" + std::to_string(version) + ":PAGE\n";
+        for (const auto &listing : page) {
+            appendEntryRecord(out, listing);
+            if (out.size() >= CHUNK_SIZE) {
+                if (!sendAll(clientSocket, out.data(), out.size())) return;
+                out.clear();
+            }
+        }
+        out += 'E';
+        out += (char)(more ? 1 : 0);
+        sendAll(clientSocket, out.data(), out.size());
+    }
+
+    // Files matching "<PREFIX|SUBSTR|GLOB> <query>", case-insensitively and
+    // sorted by name, size (largest first) or newest, as one reply:
+    // "OK:<version>:MATCH:<total>", up to limit entry records, then 'E' and
+    // a byte that is 1 when more than limit files matched.
+    void handleListMatch(SOCKET clientSocket, const std::string &spec, const std::string &sort, size_t limit) {
+        if (limit == 0) limit = LIST_PAGE_DEFAULT;
+        limit = std::min(limit, LIST_PAGE_MAX);
+
+        size_t space = spec.find(' ');
+        std::string kindName = spec.substr(0, space);
+        std::string query = (space != std::string::npos) ? spec.substr(space + 1) : "";
+        Catalog::MatchKind kind;
+        if (kindName == "PREFIX") kind = Catalog::MATCH_PREFIX;
+        else if (kindName == "SUBSTR") kind = Catalog::MATCH_SUBSTRING;
+        else if (kindName == "GLOB") kind = Catalog::MATCH_GLOB;
+        else {
+            std::string response = "ERROR: Unknown match kind\n";
             send(clientSocket, response.c_str(), (int)response.length(), 0);
-        } else {
-            std::string hash;
-            if (bytes > 0 && bytes < it->second.filesize) {
-                hash = calculateSHA256(it->second.filepath, bytes);
+            return;
+        }
+        Catalog::SortOrder order;
+        if (sort.empty() || sort == "name") order = Catalog::SORT_NAME;
+        else if (sort == "size") order = Catalog::SORT_SIZE;
+        else if (sort == "newest") order = Catalog::SORT_NEWEST;
+        else {
+            std::string response = "ERROR: Unknown sort order\n";
+            send(clientSocket, response.c_str(), (int)response.length(), 0);
+            return;
+        }
+
+        std::vector<Catalog::Listing> found;
+        uint64_t version;
+        size_t total;
+        {
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            version = catalogVersion;
+            total = catalog.search(kind, query, order, limit, found);
+        }
+
+        std::string out = "OK:" + std::to_string(version) + ":MATCH:" + std::to_string(total) + "\n";
+        for (const auto &listing : found) {
+            appendEntryRecord(out, listing);
+            if (out.size() >= CHUNK_SIZE) {
+                if (!sendAll(clientSocket, out.data(), out.size())) return;
+                out.clear();
+            }
+        }
+        out += 'E';
+        out += (char)(total > found.size() ? 1 : 0);
+        sendAll(clientSocket, out.data(), out.size());
+    }
+
+    // Everything that changed after version since: an entry record for each
+    // file added or updated and a removal record for each file that is gone.
+    // Clients whose version has fallen out of the change log get
+    // "RESYNC:<version>" and list from scratch.
+    void handleListChanges(SOCKET clientSocket, uint64_t since) {
+        std::vector<std::pair<bool, Catalog::Listing>> changes;  // Whether the file is still there
+        uint64_t version;
+        {
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            version = catalogVersion;
+            if (since < changeLogFloor || since > catalogVersion) {
+                std::string response = "RESYNC:" + std::to_string(catalogVersion) + "\n";
+                send(clientSocket, response.c_str(), (int)response.length(), 0);
+                return;
+            }
+
+            std::unordered_set<std::string> seen;
+            for (auto it = changeLog.rbegin(); it != changeLog.rend() && it->version > since; ++it) {
+                if (!seen.insert(it->filename).second) continue;
+                changes.emplace_back();
+                changes.back().first = catalog.findListing(it->filename, changes.back().second);
+                if (!changes.back().first) changes.back().second.filename = it->filename;
+            }
+        }
+
+        std::string out = "OK:" + std::to_string(version) + ":CHANGES\n";
+        for (const auto &change : changes) {
+            if (change.first) {
+                appendEntryRecord(out, change.second);
             } else {
-                hash = it->second.sha256;
+                appendRemovalRecord(out, change.second.filename);
             }
-            std::string response = "CHECKSUM:" + hash + "\n";
-            send(clientSocket, response.c_str(), (int)response.length(), 0);
         }
+        out += 'E';
+        out += (char)0;
+        sendAll(clientSocket, out.data(), out.size());
+    }
+
+    void handleChecksumRequest(SOCKET clientSocket, const std::string &filename, size_t bytes = 0) {
+        FileInfo info;
+        {
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            if (!catalog.find(filename, info)) {
+                std::string response = "ERROR: File not found\n";
+                send(clientSocket, response.c_str(), (int)response.length(), 0);
+                return;
+            }
+        }
+
+        std::string hash;
+        if (bytes > 0 && bytes < info.filesize) {
+            hash = calculateSHA256(info.filepath, bytes);
+        } else {
+            hash = info.sha256;
+        }
+        std::string response = "CHECKSUM:" + hash + "\n";
+        send(clientSocket, response.c_str(), (int)response.length(), 0);
     }
 
-    void handleGetRequest(SOCKET clientSocket, const std::string &filename,
-                          size_t offset, bool compress, const std::string &clientIP) {
-        std::lock_guard<std::mutex> lock(filesMutex);
-        auto it = sharedFiles.find(filename);
+    // Sends the chunk list of a file: "OK:<count>:MANIFEST" followed by one
+    // [u32 length][32-byte SHA-256] entry per chunk in file order.
+    void handleManifestRequest(SOCKET clientSocket, const std::string &filename) {
+        std::shared_ptr<const std::string> manifest;
+        {
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            FileInfo info;
+            if (!catalog.find(filename, info)) {
+                std::string response = "ERROR: File not found\n";
+                send(clientSocket, response.c_str(), (int)response.length(), 0);
+                return;
+            }
+            manifest = info.manifest;
+        }
 
-        if (it == sharedFiles.end()) {
-            std::string response = "ERROR: File not found\n";
+        if (!manifest) {
+            std::string response = "ERROR: No manifest\n";
             send(clientSocket, response.c_str(), (int)response.length(), 0);
             return;
         }
-        sendFile(clientSocket, it->second, offset, compress, clientIP);
+
+        std::string response = "OK:" + std::to_string(manifest->size() / MANIFEST_ENTRY_SIZE) + ":MANIFEST\n";
+        send(clientSocket, response.c_str(), (int)response.length(), 0);
+        sendAll(clientSocket, manifest->data(), manifest->size());
     }
 
-    void sendFile(SOCKET clientSocket, const FileInfo &fileInfo,
-                  size_t offset, bool compress, const std::string &clientIP) {
-        std::ifstream file(fileInfo.filepath, std::ios::binary);
-        if (!file) {
+    // The catalog lock is only held long enough to copy the entry, so concurrent
+    // transfers (including parallel segments of the same file) do not serialize.
+    bool handleGetRequest(SOCKET clientSocket, const std::string &filename, size_t offset,
+                          size_t length, bool compress, const std::string &clientIP) {
+        FileInfo info;
+        {
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            if (!catalog.find(filename, info)) {
+                std::string response = "ERROR: File not found\n";
+                send(clientSocket, response.c_str(), (int)response.length(), 0);
+                return true;
+            }
+        }
+        return sendFile(clientSocket, info, offset, length, compress, clientIP);
+    }
+
+    // GET by content: serves whichever shared file has this SHA-256. Files
+    // with the same content share one id, so they also share cached blocks
+    // and shared readers whichever name they are requested by.
+    bool handleGetByHashRequest(SOCKET clientSocket, const std::string &sha256, size_t offset,
+                                size_t length, bool compress, const std::string &clientIP) {
+        FileInfo info;
+        {
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            if (!catalog.findByDigest(sha256, info)) {
+                std::string response = "ERROR: File not found\n";
+                send(clientSocket, response.c_str(), (int)response.length(), 0);
+                return true;
+            }
+        }
+        return sendFile(clientSocket, info, offset, length, compress, clientIP);
+    }
+
+    // Whether the file on disk is still the content that was hashed. Its
+    // cached blocks are keyed by a content id that twins share, so a file
+    // rewritten in place (same size, new data) must not fill or read them.
+    static bool unchangedSinceIndexed(const FileInfo &info) {
+        std::error_code error;
+        size_t size = (size_t)fs::file_size(info.filepath, error);
+        if (error) return false;
+        fs::file_time_type modified = fs::last_write_time(info.filepath, error);
+        return !error && size == info.filesize && modified == info.modified;
+    }
+
+    // Picks how sendFile reads [offset, offset + length) of a file whose
+    // current size on disk is filesize.
+    std::unique_ptr<ChunkSource> openChunkSource(const FileInfo &fileInfo, size_t filesize,
+                                                 size_t offset, size_t length) {
+        // One pass over a file this large would flush the block cache and
+        // the system file cache, and with them every small hot file.
+        // Cached blocks are sized from the catalog entry and shared with the
+        // file's twins, so a file that changed on disk since it was hashed
+        // is read directly.
+        bool direct = usesDirectIO(filesize);
+        bool cached = !direct && blockCache && filesize == fileInfo.filesize && unchangedSinceIndexed(fileInfo);
+
+        // Mapped reads are prefetched by the OS and are not worth a copy
+        if (!direct && !cached && useMapping()) {
+            return std::unique_ptr<ChunkSource>(new MmapChunkSource(fileInfo.filepath, offset, length));
+        }
+
+        // The block cache already reads each block once for everyone; other
+        // reads are shared between concurrent transfers of the file
+        std::unique_ptr<ChunkSource> source;
+        if (cached) {
+            source.reset(new CachedChunkSource(*blockCache, fileInfo, offset, length, useMapping()));
+        } else {
+            source.reset(new SharedChunkSource(
+                attachReader(fileInfo, filesize, offset), offset, length,
+                [this, fileInfo, filesize](size_t start, size_t count) {
+                    return openFileSource(fileInfo, filesize, start, count);
+                }));
+        }
+        if (!direct && config.prefetchDepth > 0 && length >= PREFETCH_MIN_LENGTH) {
+            source.reset(new PrefetchChunkSource(std::move(source), config.prefetchDepth));
+        }
+        return source;
+    }
+
+    // Reads straight from the file, unbuffered past the direct I/O threshold
+    std::unique_ptr<ChunkSource> openFileSource(const FileInfo &fileInfo, size_t filesize,
+                                                size_t offset, size_t length) {
+        if (usesDirectIO(filesize)) {
+            std::unique_ptr<DirectChunkSource> direct(new DirectChunkSource(fileInfo.filepath, offset, length));
+            if (direct->isOpen()) return std::move(direct);
+        }
+        return std::unique_ptr<ChunkSource>(new StreamChunkSource(fileInfo.filepath, offset, length));
+    }
+
+    // Forgets readers whose transfers have all finished
+    static void pruneReaders(std::vector<std::weak_ptr<SharedReader>> &readers) {
+        readers.erase(std::remove_if(readers.begin(), readers.end(),
+                                     [](const std::weak_ptr<SharedReader> &reader) { return reader.expired(); }),
+                      readers.end());
+    }
+
+    // A running reader of the file that a transfer starting at offset can
+    // join, or a new one starting there
+    std::shared_ptr<SharedReader> attachReader(const FileInfo &fileInfo, size_t filesize, size_t offset) {
+        std::lock_guard<MeteredMutex> lock(readersMutex);
+        // Files whose last transfer finished long ago are swept once the map
+        // has doubled, so a GET does not walk every file ever downloaded
+        if (sharedReaders.size() >= readersSweepAt) {
+            for (auto it = sharedReaders.begin(); it != sharedReaders.end();) {
+                pruneReaders(it->second);
+                it = it->second.empty() ? sharedReaders.erase(it) : std::next(it);
+            }
+            readersSweepAt = std::max(READERS_SWEEP_MIN, sharedReaders.size() * 2);
+        }
+
+        std::vector<std::weak_ptr<SharedReader>> &readers = sharedReaders[fileInfo.id];
+        pruneReaders(readers);
+        for (const auto &weak : readers) {
+            std::shared_ptr<SharedReader> reader = weak.lock();
+            if (reader && reader->accepts(offset, filesize)) return reader;
+        }
+
+        std::shared_ptr<SharedReader> reader = std::make_shared<SharedReader>(
+            openFileSource(fileInfo, filesize, offset, filesize - offset), offset, filesize,
+            sharedBytesRead, sharedBytesSent);
+        readers.push_back(reader);
+        return reader;
+    }
+
+    // Sends [offset, offset + length) of the file, or everything from offset to
+    // the end when length is 0. Returns false if fewer bytes than announced
+    // went out, in which case the connection must not be reused.
+    bool sendFile(SOCKET clientSocket, const FileInfo &fileInfo, size_t offset,
+                  size_t length, bool compress, const std::string &clientIP) {
+        std::error_code error;
+        size_t filesize = (size_t)fs::file_size(fileInfo.filepath, error);
+        if (error) {
             std::string response = "ERROR: Cannot open file\n";
             send(clientSocket, response.c_str(), (int)response.length(), 0);
-            return;
+            return true;
         }
 
-        file.seekg(0, std::ios::end);
-        size_t filesize = file.tellg();
-
         if (offset >= filesize) {
             std::string response = "ERROR: Invalid offset\n";
             send(clientSocket, response.c_str(), (int)response.length(), 0);
-            return;
+            return true;
         }
 
-        file.seekg(offset, std::ios::beg);
         size_t remaining = filesize - offset;
+        if (length > 0 && length < remaining) remaining = length;
+        recordPopularity(fileInfo.filename, remaining);
+
+        std::unique_ptr<ChunkSource> source;
+        {
+            TraceSpan span("open");
+            source = openChunkSource(fileInfo, filesize, offset, remaining);
+        }
 
         compress = compress && config.enableCompression;
 
@@ -574,37 +2723,245 @@ public:
         std::string response = ss.str();
         send(clientSocket, response.c_str(), (int)response.length(), 0);
 
-        std::cout << "[SENDING] " << fileInfo.filename << " to " << clientIP
-                  << " (offset:" << offset << ", size:" << remaining
-                  << ", compress:" << (compress ? "yes" : "no") << ")\n";
+        logger.log(LOG_INFO, "sending").text("file", fileInfo.filename).text("client", clientIP)
+            .number("offset", offset).number("size", remaining).number("compress", compress);
 
-        char buffer[CHUNK_SIZE];
         size_t totalSent = 0;
-
-        while (file.read(buffer, CHUNK_SIZE) || file.gcount() > 0) {
-            size_t bytesRead = file.gcount();
+        const char *buffer;
+        size_t bytesRead;
+
+        while (true) {
+            auto readStart = std::chrono::steady_clock::now();
+            {
+                TraceSpan span("read");
+                if (!source->next(CHUNK_SIZE, buffer, bytesRead)) break;
+                span.arg("bytes", bytesRead);
+            }
+            metrics.record(stats.readChunkSeconds, microsSince(readStart));
 
             if (compress) {
                 size_t compressedSize;
-                std::vector<char> compressed = compressData(buffer, bytesRead, compressedSize);
+                auto compressStart = std::chrono::steady_clock::now();
+                std::vector<char> compressed;
+                {
+                    TraceSpan span("compress2");
+                    compressed = compressData(buffer, bytesRead, compressedSize);
+                    span.arg("bytes", compressedSize);
+                }
+                metrics.record(stats.compressSeconds, microsSince(compressStart));
 
                 if (compressedSize > 0) {
+                    metrics.record(stats.compressRatio, compressedSize * 1000 / bytesRead);
+                    metrics.add(stats.compressIn, bytesRead);
+                    metrics.add(stats.compressOut, compressedSize);
+                    throttleUpload(compressedSize);
                     uint32_t size = (uint32_t)compressedSize;
-                    send(clientSocket, (char *)&size, sizeof(size), 0);
-                    send(clientSocket, compressed.data(), (int)compressedSize, 0);
+                    auto sendStart = std::chrono::steady_clock::now();
+                    TraceSpan span("send");
+                    if (!sendAll(clientSocket, (char *)&size, sizeof(size)) ||
+                        !sendAll(clientSocket, compressed.data(), compressedSize)) break;
+                    metrics.record(stats.sendChunkSeconds, microsSince(sendStart));
+                    metrics.add(stats.sentCompressed, sizeof(size) + compressedSize);
                     totalSent += bytesRead;
                 } else {
                     break;
                 }
             } else {
-                int sent = send(clientSocket, buffer, (int)bytesRead, 0);
-                if (sent == SOCKET_ERROR) break;
-                totalSent += sent;
+                throttleUpload(bytesRead);
+                auto sendStart = std::chrono::steady_clock::now();
+                TraceSpan span("send");
+                if (!sendAll(clientSocket, buffer, bytesRead)) break;
+                metrics.record(stats.sendChunkSeconds, microsSince(sendStart));
+                metrics.add(stats.sentRaw, bytesRead);
+                totalSent += bytesRead;
             }
         }
 
-        file.close();
-        std::cout << "[COMPLETE] Sent " << totalSent << " bytes to " << clientIP << "\n";
+        logger.log(totalSent == remaining ? LOG_INFO : LOG_WARN, "complete").text("file", fileInfo.filename)
+            .text("client", clientIP).number("sent", totalSent).number("size", remaining);
+        return totalSent == remaining;
+    }
+
+    // Answers a DELTA request: after the OK line the client uploads one
+    // BlockSignature per block of its local copy, and the file is sent back as
+    // block matches plus literal data (see delta.h).
+    void handleDeltaRequest(SOCKET clientSocket, const std::string &filename, uint32_t blockSize,
+                            uint32_t blockCount, const std::string &clientIP) {
+        FileInfo info;
+        {
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            if (!catalog.find(filename, info)) {
+                std::string response = "ERROR: File not found\n";
+                send(clientSocket, response.c_str(), (int)response.length(), 0);
+                return;
+            }
+        }
+
+        if (blockSize < DELTA_MIN_BLOCK || blockSize > DELTA_MAX_BLOCK || blockCount > DELTA_MAX_BLOCKS) {
+            std::string response = "ERROR: Invalid delta parameters\n";
+            send(clientSocket, response.c_str(), (int)response.length(), 0);
+            return;
+        }
+
+        std::ifstream file(info.filepath, std::ios::binary);
+        if (!file) {
+            std::string response = "ERROR: Cannot open file\n";
+            send(clientSocket, response.c_str(), (int)response.length(), 0);
+            return;
+        }
+        file.seekg(0, std::ios::end);
+        size_t filesize = file.tellg();
+        file.seekg(0, std::ios::beg);
+
+        // Checked against the file before the signatures are allocated
+        if (blockCount > deltaMaxBlocks(filesize, blockSize)) {
+            std::string response = "ERROR: Invalid delta parameters\n";
+            send(clientSocket, response.c_str(), (int)response.length(), 0);
+            return;
+        }
+
+        std::string response = "OK:" + std::to_string(filesize) + ":DELTA\n";
+        send(clientSocket, response.c_str(), (int)response.length(), 0);
+
+        std::vector<BlockSignature> signatures(blockCount);
+        if (blockCount > 0 &&
+            !recvAll(clientSocket, (char *)signatures.data(), blockCount * sizeof(BlockSignature))) {
+            return;
+        }
+
+        std::unordered_map<uint32_t, std::vector<uint32_t>> blocksByWeak;
+        blocksByWeak.reserve(blockCount);
+        for (uint32_t i = 0; i < blockCount; i++) {
+            blocksByWeak[signatures[i].weak].push_back(i);
+        }
+
+        logger.log(LOG_INFO, "delta").text("file", info.filename).text("client", clientIP)
+            .number("blocks", blockCount).number("block_size", blockSize);
+
+        std::string out;
+        uint32_t runStart = 0;
+        uint32_t runCount = 0;
+        size_t matchedBytes = 0;
+        size_t literalBytes = 0;
+        bool failed = false;
+
+        auto flushOut = [&](bool force) {
+            if (!failed && (force || out.size() >= 256 * 1024)) {
+                throttleUpload(out.size());
+                TraceSpan span("send");
+                failed = !sendAll(clientSocket, out.data(), out.size());
+                if (!failed) metrics.add(stats.sentDelta, out.size());
+                out.clear();
+            }
+        };
+        auto putU32 = [&](uint32_t value) { out.append((const char *)&value, sizeof(value)); };
+        auto flushRun = [&]() {
+            if (runCount == 0) return;
+            out += (char)DELTA_MATCH;
+            putU32(runStart);
+            putU32(runCount);
+            matchedBytes += (size_t)runCount * blockSize;
+            runCount = 0;
+            flushOut(false);
+        };
+        auto emitLiteral = [&](const char *data, size_t length) {
+            if (length > 0) flushRun();
+            while (length > 0) {
+                uint32_t part = (uint32_t)std::min(length, (size_t)DELTA_MAX_LITERAL);
+                out += (char)DELTA_LITERAL;
+                putU32(part);
+                out.append(data, part);
+                literalBytes += part;
+                data += part;
+                length -= part;
+                flushOut(false);
+            }
+        };
+
+        // Window over the file; literal bytes are pending in [literalStart, pos)
+        std::vector<char> buffer(std::max<size_t>(4 * 1024 * 1024, 2 * (size_t)blockSize));
+        size_t available = 0;
+        size_t pos = 0;
+        size_t literalStart = 0;
+        bool eof = false;
+        RollingChecksum rolling;
+        bool rollingValid = false;
+        unsigned char strong[DELTA_STRONG_SIZE];
+
+        while (!failed) {
+            if (available - pos < blockSize && !eof) {
+                emitLiteral(buffer.data() + literalStart, pos - literalStart);
+                std::memmove(buffer.data(), buffer.data() + pos, available - pos);
+                available -= pos;
+                pos = 0;
+                literalStart = 0;
+
+                file.read(buffer.data() + available, buffer.size() - available);
+                size_t bytesRead = file.gcount();
+                eof = (available + bytesRead < buffer.size());
+                available += bytesRead;
+                rollingValid = false;
+                continue;
+            }
+            if (blockCount == 0 || available - pos < blockSize) break;
+
+            if (!rollingValid) {
+                rolling.init(buffer.data() + pos, blockSize);
+                rollingValid = true;
+            }
+
+            int64_t match = -1;
+            auto it = blocksByWeak.find(rolling.value());
+            if (it != blocksByWeak.end() && strongHash(buffer.data() + pos, blockSize, strong)) {
+                for (uint32_t candidate : it->second) {
+                    if (std::memcmp(signatures[candidate].strong, strong, DELTA_STRONG_SIZE) != 0) continue;
+                    match = candidate;
+                    // Prefer the block that continues the current run
+                    if (runCount > 0 && candidate == runStart + runCount) break;
+                }
+            }
+
+            if (match >= 0) {
+                emitLiteral(buffer.data() + literalStart, pos - literalStart);
+                if (runCount > 0 && match == runStart + runCount) {
+                    runCount++;
+                } else {
+                    flushRun();
+                    runStart = (uint32_t)match;
+                    runCount = 1;
+                }
+                pos += blockSize;
+                literalStart = pos;
+                rollingValid = false;
+            } else {
+                if (pos + blockSize < available) {
+                    rolling.roll((unsigned char)buffer[pos], (unsigned char)buffer[pos + blockSize]);
+                } else {
+                    rollingValid = false;
+                }
+                pos++;
+                if (pos - literalStart >= DELTA_MAX_LITERAL) {
+                    emitLiteral(buffer.data() + literalStart, pos - literalStart);
+                    literalStart = pos;
+                }
+            }
+        }
+
+        // Whatever is left after the last full window goes out as literal data
+        while (!failed) {
+            emitLiteral(buffer.data() + literalStart, available - literalStart);
+            if (eof) break;
+            file.read(buffer.data(), buffer.size());
+            available = file.gcount();
+            literalStart = 0;
+            eof = (available < buffer.size());
+        }
+        flushRun();
+        out += (char)DELTA_END;
+        flushOut(true);
+
+        logger.log(failed ? LOG_WARN : LOG_INFO, "delta_complete").text("file", info.filename)
+            .text("client", clientIP).number("matched", matchedBytes).number("literal", literalBytes);
     }
 
     void acceptConnections() {
@@ -613,59 +2970,230 @@ public:
             int clientLen = sizeof(clientAddr);
 
             SOCKET clientSocket = accept(serverSocket, (sockaddr *)&clientAddr, &clientLen);
+            auto accepted = std::chrono::steady_clock::now();
 
             if (clientSocket == INVALID_SOCKET) {
                 if (running) {
-                    std::cerr << "[ERROR] Accept failed: " << WSAGetLastError() << "\n";
+                    logger.log(LOG_ERROR, "accept_failed").number("error", WSAGetLastError());
                 }
                 continue;
             }
 
-            if (activeConnections >= config.maxConnections) {
+            if (activeConnections >= config.maxConnections && evictIdleConnection()) {
+                metrics.add(stats.connectionsEvicted);
+            } else if (activeConnections >= config.maxConnections) {
+                metrics.add(stats.connectionsRejected);
+                logger.log(LOG_WARN, "busy").number("active", activeConnections);
                 std::string response = "ERROR: Server busy\n";
                 send(clientSocket, response.c_str(), (int)response.length(), 0);
                 closesocket(clientSocket);
                 continue;
             }
+            metrics.add(stats.connectionsAccepted);
 
             char clientIP[INET_ADDRSTRLEN];
             inet_ntop(AF_INET, &(clientAddr.sin_addr), clientIP, INET_ADDRSTRLEN);
 
-            std::cout << "\n[CONNECTED] " << clientIP
-                      << " (Active: " << activeConnections + 1 << ")\n";
+            logger.log(LOG_INFO, "connected").text("client", clientIP).number("active", activeConnections + 1);
 
             std::thread(&P2PFileServer::handleClient, this, clientSocket,
-                        std::string(clientIP)).detach();
+                        std::string(clientIP), accepted).detach();
         }
     }
 
     void listFiles() {
-        std::lock_guard<std::mutex> lock(filesMutex);
+        std::lock_guard<MeteredMutex> lock(filesMutex);
 
-        if (sharedFiles.empty()) {
+        if (catalog.empty()) {
             std::cout << "No files shared.\n";
             return;
         }
 
-        std::cout << "\nShared Files (" << sharedFiles.size() << " total):\n";
+        std::cout << "\nShared Files (" << catalog.size() << " total):\n";
         std::cout << "----------------------------------------\n";
-        for (const auto &pair : sharedFiles) {
-            double sizeMB = pair.second.filesize / (1024.0 * 1024.0);
-            std::cout << pair.second.filename << " - "
+        catalog.forEach([](const FileInfo &info) {
+            double sizeMB = info.filesize / (1024.0 * 1024.0);
+            std::cout << info.filename << " - "
                       << std::fixed << std::setprecision(2) << sizeMB << " MB\n";
-            std::cout << "  SHA256: " << pair.second.sha256.substr(0, 16) << "...\n";
-        }
+            std::cout << "  SHA256: " << info.sha256.substr(0, 16) << "...\n";
+            if (info.manifest) {
+                std::cout << "  Chunks: " << info.manifest->size() / MANIFEST_ENTRY_SIZE << "\n";
+            }
+        });
         std::cout << "----------------------------------------\n";
+        std::cout << "Catalog memory: " << std::fixed << std::setprecision(1)
+                  << catalog.memoryUsage() / (1024.0 * 1024.0) << " MB\n";
+    }
+
+    // Loads the most requested shared files into the block cache in the
+    // background, filling at most half of it so there is room for whatever
+    // turns out to be hot in this run.
+    void prewarmCache() {
+        if (!blockCache) return;
+
+        std::vector<std::pair<double, FileInfo>> candidates;
+        {
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            std::lock_guard<MeteredMutex> popularityLock(popularityMutex);
+            for (const auto &pair : popularity) {
+                FileInfo info;
+                if (catalog.find(pair.first, info)) candidates.push_back({pair.second, info});
+            }
+        }
+        if (candidates.empty()) return;
+        std::sort(candidates.begin(), candidates.end(),
+                  [](const std::pair<double, FileInfo> &a, const std::pair<double, FileInfo> &b) {
+                      return a.first > b.first;
+                  });
+
+        std::thread([this, candidates]() {
+            size_t limit = blockCache->budget() / 2;
+            size_t warmed = 0;
+            int files = 0;
+            for (const auto &candidate : candidates) {
+                if (!running || warmed >= limit) break;
+                const FileInfo &info = candidate.second;
+                if (!unchangedSinceIndexed(info)) continue;
+                size_t length = std::min(info.filesize, limit - warmed);
+                CachedChunkSource source(*blockCache, info, 0, length, useMapping());
+                const char *data;
+                size_t piece;
+                while (running && source.next(CACHE_BLOCK_SIZE, data, piece)) warmed += piece;
+                files++;
+            }
+            logger.log(LOG_INFO, "cache_prewarmed").number("files", files).number("mb", warmed / (1024 * 1024));
+        }).detach();
+    }
+
+    void printStats() {
+        std::cout << "\n" << metrics.summary() << "\n";
     }
 
-    void stop() { running = false; }
+    void printCacheStats() {
+        std::cout << "\nShared readers: " << sharedBytesRead / (1024 * 1024) << " MB read from disk for "
+                  << sharedBytesSent / (1024 * 1024) << " MB sent\n";
+        if (!blockCache) {
+            std::cout << "Block cache disabled (cache_mb=0).\n";
+            return;
+        }
+        BlockCache::Stats stats = blockCache->stats();
+        uint64_t requests = stats.hits + stats.misses + stats.joined;
+        std::cout << "Block cache: " << stats.bytesCached / (1024 * 1024) << " / "
+                  << blockCache->budget() / (1024 * 1024) << " MB\n";
+        std::cout << "  Hits: " << stats.hits << ", misses: " << stats.misses
+                  << ", shared reads: " << stats.joined << "\n";
+        std::cout << "  Hit rate: " << std::fixed << std::setprecision(1)
+                  << (requests ? 100.0 * (stats.hits + stats.joined) / requests : 0.0) << "%\n";
+        std::cout << "  Read from disk: " << stats.bytesLoaded / (1024 * 1024) << " MB, evictions: "
+                  << stats.evictions << "\n";
+    }
+
+    // Reads a shared file end to end through each backend, bypassing the
+    // block cache. The first pass may come from disk and the second from the
+    // OS file cache, so both are shown; direct reads always go to the disk.
+    void benchmarkIO(const std::string &filename) {
+        FileInfo info;
+        {
+            std::lock_guard<MeteredMutex> lock(filesMutex);
+            if (!catalog.find(filename, info)) {
+                std::cout << "File not found: " << filename << "\n";
+                return;
+            }
+        }
+
+        std::cout << "\nReading " << info.filename << " (" << info.filesize / (1024 * 1024) << " MB)\n";
+        for (const std::string backend : {"stream", "mmap", "direct"}) {
+            std::cout << "  " << std::left << std::setw(8) << backend << std::right;
+            if (backend == "mmap" && !MAPPED_IO_GUARDED) {
+                std::cout << "  not available in this build (needs __try, see README)\n";
+                continue;
+            }
+            for (int pass = 0; pass < 2; pass++) {
+                auto start = std::chrono::steady_clock::now();
+                std::unique_ptr<ChunkSource> source;
+                if (backend == "mmap") {
+                    source.reset(new MmapChunkSource(info.filepath, 0, info.filesize));
+                } else if (backend == "direct") {
+                    source.reset(new DirectChunkSource(info.filepath, 0, info.filesize));
+                } else {
+                    source.reset(new StreamChunkSource(info.filepath, 0, info.filesize));
+                }
+
+                // Fold every word so both backends really read all the data
+                uint64_t fold = 0;
+                size_t total = 0;
+                const char *data;
+                size_t length;
+                while (source->next(CHUNK_SIZE, data, length)) {
+                    for (size_t i = 0; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+                        uint64_t word;
+                        std::memcpy(&word, data + i, sizeof(word));
+                        fold ^= word;
+                    }
+                    total += length;
+                }
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+                if (total != info.filesize) {
+                    std::cout << "  read failed after " << total << " bytes";
+                    break;
+                }
+                std::cout << "  pass " << pass + 1 << ": " << std::fixed << std::setprecision(1)
+                          << total / (1024.0 * 1024.0) / std::max(seconds, 1e-6) << " MB/s";
+                if (pass == 1) std::cout << "  [" << std::hex << fold << std::dec << "]";
+            }
+            std::cout << "\n";
+        }
+        std::cout << "Current backend: " << config.ioBackend << " (io_backend in " << CONFIG_FILE << ")";
+        if (config.ioBackend == "mmap" && !useMapping()) std::cout << ", read as stream";
+        if (config.directIOMB > 0) std::cout << ", direct from " << config.directIOMB << " MB";
+        std::cout << "\n";
+    }
+
+    void stop() {
+        if (running.exchange(false) && blockCache) savePopularity();
+        std::lock_guard<std::mutex> lock(subscribersMutex);
+        for (const auto &subscriber : subscribers) {
+            std::lock_guard<std::mutex> subscriberLock(subscriber->mutex);
+            subscriber->closed = true;
+            subscriber->wake.notify_one();
+        }
+    }
     void setPort(int p) { config.port = p; config.save(); }
     void setCompression(bool enable) { config.enableCompression = enable; config.save(); }
     void setSharedFolder(const std::string &folder) { config.sharedFolder = folder; config.save(); }
+
+    // Command-line overrides for this run only; they are not saved to the config
+    void overridePort(int p) { config.port = p; }
+    void overrideUploadLimit(int kbps) { config.maxUploadKBps = kbps; }
 };
 
+void printUsage() {
+    std::cout << "Usage: server.exe [options]\n\n";
+    std::cout << "  --port <n>          Listen on this port for this run\n";
+    std::cout << "  --share <folder>    Share a folder for this run\n";
+    std::cout << "  --max-rate <KB/s>   Cap total upload speed for this run\n";
+}
+
 int main(int argc, char *argv[]) {
     P2PFileServer server;
+    std::vector<std::string> shareFolders;
+
+    // Several servers can run side by side (e.g. on loopback) with their own
+    // ports, folders and upload caps without touching server_config.txt
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--port" && i + 1 < argc) {
+            server.overridePort(std::atoi(argv[++i]));
+        } else if (arg == "--share" && i + 1 < argc) {
+            shareFolders.push_back(argv[++i]);
+        } else if (arg == "--max-rate" && i + 1 < argc) {
+            server.overrideUploadLimit(std::atoi(argv[++i]));
+        } else {
+            printUsage();
+            return arg == "--help" || arg == "-h" ? 0 : 2;
+        }
+    }
 
     if (!server.startServer()) {
         std::cout << "\nPress Enter to exit...";
@@ -673,6 +3201,12 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    for (const auto &folder : shareFolders) {
+        server.addFolder(folder);
+        server.watchFolder(folder);
+    }
+    server.prewarmCache();
+
     std::thread acceptThread(&P2PFileServer::acceptConnections, &server);
     acceptThread.detach();
 
@@ -683,6 +3217,9 @@ int main(int argc, char *argv[]) {
     std::cout << "  list                   - List shared files\n";
     std::cout << "  setfolder <path>       - Set auto-share folder (TAB to autocomplete)\n";
     std::cout << "  compress on/off        - Toggle compression\n";
+    std::cout << "  cache                  - Show block cache and shared reader statistics\n";
+    std::cout << "  stats                  - Show request latency, throughput and lock counters\n";
+    std::cout << "  iobench <filename>     - Compare stream, mmap and direct read speed\n";
     std::cout << "  quit                   - Exit\n\n";
 
     while (true) {
@@ -702,6 +3239,12 @@ int main(int argc, char *argv[]) {
         } else if (command.find("setfolder ") == 0) {
             server.setSharedFolder(command.substr(10));
             std::cout << "Folder set. Will auto-load on next start.\n";
+        } else if (command == "cache") {
+            server.printCacheStats();
+        } else if (command == "stats") {
+            server.printStats();
+        } else if (command.find("iobench ") == 0) {
+            server.benchmarkIO(command.substr(8));
         } else if (command == "compress on") {
             server.setCompression(true);
             std::cout << "Compression enabled.\n";
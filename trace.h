@@ -0,0 +1,280 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "recording.h"
+
+// Span tracing of individual transfers, written in the Chrome trace event
+// format so a trace file opens in chrome://tracing or ui.perfetto.dev.
+//
+// A TraceScope starts a trace for one request or download on the calling
+// thread, if the tracer samples it. Until the scope ends, every TraceSpan on
+// that thread is recorded in it:
+//
+//   TraceScope trace(tracer, "GET " + filename);
+//   ...
+//   { TraceSpan span("read"); source->next(...); }
+//
+// Other threads working for the same transfer join it with a TraceLane.
+// Each thread of a trace is one track in the viewer, named after the trace.
+// Spans are kept with their trace and written out together when it ends, so
+// the file is only locked once per trace.
+//
+// When tracing is off, or the transfer is not sampled, a TraceSpan costs one
+// thread-local load and does not read the clock.
+
+class Tracer {
+public:
+    static constexpr size_t MAX_EVENTS = 200000;  // Per trace; later spans are dropped
+
+private:
+    struct Sink {
+        std::mutex mutex;
+        std::ofstream file;
+        std::chrono::steady_clock::time_point origin;
+        int pid = 1;
+        uint32_t nextLane = 0;
+        bool empty = true;
+        bool closed = false;
+
+        void write(const std::string &event) {
+            file << (empty ? "" : ",\n") << event;
+            empty = false;
+        }
+    };
+
+    struct Event {
+        const char *name;
+        uint32_t lane;
+        int64_t start;  // Nanoseconds since the sink's origin
+        int64_t end;
+        const char *argName;
+        uint64_t arg;
+    };
+
+public:
+    // The spans of one sampled transfer
+    class Trace {
+    private:
+        friend class Tracer;
+        friend class TraceLane;
+        friend class TraceSpan;
+
+        std::shared_ptr<Sink> sink;
+        std::string name;
+        std::mutex mutex;
+        std::vector<Event> events;
+        std::vector<uint32_t> lanes;
+        size_t dropped = 0;
+
+        int64_t nanos(std::chrono::steady_clock::time_point time) const {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(time - sink->origin).count();
+        }
+
+        uint32_t addLane() {
+            std::lock_guard<std::mutex> sinkLock(sink->mutex);
+            uint32_t lane = ++sink->nextLane;
+            std::lock_guard<std::mutex> lock(mutex);
+            lanes.push_back(lane);
+            return lane;
+        }
+
+        void add(const Event &event) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (events.size() < MAX_EVENTS) {
+                events.push_back(event);
+            } else {
+                dropped++;
+            }
+        }
+
+    public:
+        ~Trace() {
+            std::lock_guard<std::mutex> lock(sink->mutex);
+            if (sink->closed) return;
+            for (size_t i = 0; i < lanes.size(); i++) {
+                std::string label = i == 0 ? name : name + " (" + std::to_string(i) + ")";
+                if (dropped > 0 && i == 0) label += " [" + std::to_string(dropped) + " spans dropped]";
+                sink->write("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" + std::to_string(sink->pid) +
+                            ",\"tid\":" + std::to_string(lanes[i]) + ",\"args\":{\"name\":" + jsonQuote(label) + "}}");
+            }
+            for (const Event &event : events) {
+                char times[64];
+                std::snprintf(times, sizeof(times), "\"ts\":%.3f,\"dur\":%.3f", event.start / 1000.0,
+                              (event.end - event.start) / 1000.0);
+                std::string line = "{\"name\":\"" + std::string(event.name) + "\",\"ph\":\"X\",\"pid\":" +
+                                   std::to_string(sink->pid) + ",\"tid\":" + std::to_string(event.lane) + "," + times;
+                if (event.argName) {
+                    line += ",\"args\":{\"" + std::string(event.argName) + "\":" + std::to_string(event.arg) + "}";
+                }
+                sink->write(line + "}");
+            }
+            sink->file.flush();
+        }
+    };
+
+    typedef std::shared_ptr<Trace> Handle;
+
+    ~Tracer() { stop(); }
+
+    // Traces sampleRate (0 to 1) of the transfers into path
+    bool start(const std::string &path, double sampleRate, const std::string &processName, int pid) {
+        auto opened = std::make_shared<Sink>();
+        opened->file.open(path, std::ios::trunc);
+        if (!opened->file) return false;
+        opened->origin = std::chrono::steady_clock::now();
+        opened->pid = pid;
+        opened->file << "[\n";
+        opened->write("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + std::to_string(pid) +
+                      ",\"args\":{\"name\":" + jsonQuote(processName) + "}}");
+        sink = opened;
+        rate = sampleRate;
+        return true;
+    }
+
+    // Closes the file. Traces still running are not written.
+    void stop() {
+        if (!sink) return;
+        std::lock_guard<std::mutex> lock(sink->mutex);
+        if (sink->closed) return;
+        sink->file << "\n]\n";
+        sink->file.close();
+        sink->closed = true;
+    }
+
+    bool enabled() const { return sink != nullptr && rate > 0; }
+
+    // The trace the calling thread records into, for handing to a TraceLane
+    static Handle current() {
+        Lane *lane = currentLane();
+        return lane ? lane->trace : nullptr;
+    }
+
+    // Records a span whose times were taken earlier, such as a wait that
+    // ended before the trace began
+    static void mark(const char *name, std::chrono::steady_clock::time_point start,
+                     std::chrono::steady_clock::time_point end) {
+        Lane *lane = currentLane();
+        if (!lane) return;
+        lane->trace->add({name, lane->id, lane->trace->nanos(start), lane->trace->nanos(end), nullptr, 0});
+    }
+
+private:
+    friend class TraceScope;
+    friend class TraceLane;
+    friend class TraceSpan;
+
+    struct Lane {
+        Handle trace;
+        uint32_t id;
+    };
+
+    std::shared_ptr<Sink> sink;
+    double rate = 0;
+    std::atomic<uint64_t> transfers{0};
+
+    static Lane *&currentLane() {
+        static thread_local Lane *lane = nullptr;
+        return lane;
+    }
+
+    // Spreads the sampled transfers evenly: the n-th is traced when
+    // n * rate crosses an integer
+    Handle sample(const std::string &name) {
+        if (!enabled()) return nullptr;
+        uint64_t n = transfers++;
+        if ((uint64_t)((n + 1) * rate) == (uint64_t)(n * rate)) return nullptr;
+        Handle trace = std::make_shared<Trace>();
+        trace->sink = sink;
+        trace->name = name;
+        return trace;
+    }
+};
+
+// Makes the calling thread record into trace (a Tracer::current() from the
+// thread that started it) until this goes out of scope. A null trace does
+// nothing.
+class TraceLane {
+private:
+    Tracer::Lane lane;
+    Tracer::Lane *previous = nullptr;
+    bool joined = false;
+
+public:
+    explicit TraceLane(const Tracer::Handle &trace) {
+        if (!trace) return;
+        lane.trace = trace;
+        lane.id = trace->addLane();
+        previous = Tracer::currentLane();
+        Tracer::currentLane() = &lane;
+        joined = true;
+    }
+
+    ~TraceLane() {
+        if (joined) Tracer::currentLane() = previous;
+    }
+
+    TraceLane(const TraceLane &) = delete;
+    TraceLane &operator=(const TraceLane &) = delete;
+};
+
+// Starts a trace named name on the calling thread if the tracer samples it
+class TraceScope {
+private:
+    std::unique_ptr<TraceLane> lane;
+
+public:
+    TraceScope(Tracer &tracer, const std::string &name) {
+        if (!tracer.enabled()) return;
+        Tracer::Handle trace = tracer.sample(name);
+        if (trace) lane.reset(new TraceLane(trace));
+    }
+
+    bool active() const { return lane != nullptr; }
+};
+
+// One timed step of the current thread's trace
+class TraceSpan {
+private:
+    Tracer::Lane *lane;
+    std::chrono::steady_clock::time_point start;
+    const char *name;
+    const char *argName = nullptr;
+    uint64_t argValue = 0;
+
+public:
+    explicit TraceSpan(const char *name) : lane(Tracer::currentLane()), name(name) {
+        if (lane) start = std::chrono::steady_clock::now();
+    }
+
+    ~TraceSpan() { end(); }
+
+    // Ends the span before it goes out of scope
+    void end() {
+        if (!lane) return;
+        Tracer::Trace *trace = lane->trace.get();
+        trace->add({name, lane->id, trace->nanos(start), trace->nanos(std::chrono::steady_clock::now()),
+                    argName, argValue});
+        lane = nullptr;
+    }
+
+    // One numeric argument shown with the span, such as its byte count
+    void arg(const char *key, uint64_t value) {
+        argName = key;
+        argValue = value;
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+};
+
+#endif // TRACE_H